@@ -0,0 +1,391 @@
+'''Benchmarks for the _lzo extension.
+
+    python bench.py                      throughput of every data kind
+    python bench.py -s 16M random mixed  just the poorly compressible ones
+    python bench.py -m many              small blocks, one by one vs
+                                         decompress_many
+    python bench.py -m opt -s 4M         level 10 next to LZO1X-1 and,
+                                         built with liblzo, LZO1X-999
+    python bench.py -m qos text          4 KiB compress_block latency next
+                                         to bulk compress_many, QoS on/off
+    python bench.py -m latency -t 4      per-call latency percentiles of
+                                         64 B - 16 KiB blocks, 1 and 4
+                                         threads
+    python bench.py -m aio -s 256M text  compress_file / decompress_file
+                                         of a temporary file: plain, pread
+                                         and io_uring queues, with and
+                                         without nocache
+'''
+
+import argparse
+import binascii
+import math
+import os
+import random
+import shutil
+import sys
+import tempfile
+import threading
+import timeit
+
+import lzo
+
+KINDS = ['zeros', 'text', 'mixed', 'random']
+
+WORDS = [b'lzo', b'block', b'header', b'checksum', b'adler32',
+         b'compress', b'the', b'a', b'of', b'data', b'\n']
+
+
+def sample_data(kind, size, rng=None):
+    '''Deterministic sample payloads, shared with fuzz/make_corpus.py.'''
+    if rng is None:
+        rng = random.Random(size)
+    if kind == 'zeros':
+        return b'\0' * size
+    if kind == 'random':
+        if size == 0:
+            return b''
+        return binascii.unhexlify('%0*x' % (size * 2, rng.getrandbits(size * 8)))
+    if kind == 'text':
+        out = []
+        n = 0
+        while n < size:
+            w = rng.choice(WORDS)
+            out.append(w + b' ')
+            n += len(w) + 1
+        return b''.join(out)[:size]
+    if kind == 'mixed':
+        half = size // 2
+        return sample_data('text', half, rng) + sample_data('random', size - half, rng)
+    raise ValueError(kind)
+
+
+def parse_size(s):
+    units = {'K': 1024, 'M': 1024 * 1024}
+    if s[-1:].upper() in units:
+        return int(s[:-1]) * units[s[-1:].upper()]
+    return int(s)
+
+
+def best_of(repeat, fn):
+    best = None
+    for i in range(repeat):
+        t0 = timeit.default_timer()
+        fn()
+        t = timeit.default_timer() - t0
+        if best is None or t < best:
+            best = t
+    return best
+
+
+def blocks_of(data, block_size):
+    return [data[i:i + block_size] for i in range(0, len(data), block_size)]
+
+
+def bench_throughput(kinds, size, block_size, repeat):
+    mb = size / (1024.0 * 1024.0)
+    print('%-8s %10s %10s %8s' % ('kind', 'comp MB/s', 'dec MB/s', 'ratio'))
+    for kind in kinds:
+        blocks = blocks_of(sample_data(kind, size), block_size)
+        compressed = [lzo.compress_block(b, 1, 1) for b in blocks]
+
+        def compress():
+            for b in blocks:
+                lzo.compress_block(b, 1, 1)
+
+        def decompress():
+            for b, c in zip(blocks, compressed):
+                lzo.decompress_block(c, len(b))
+
+        tc = best_of(repeat, compress)
+        td = best_of(repeat, decompress)
+        ratio = float(sum(len(c) for c in compressed)) / max(size, 1)
+        print('%-8s %10.1f %10.1f %8.3f' % (kind, mb / tc, mb / td, ratio))
+
+
+def bench_opt(kinds, size, block_size, repeat):
+    '''the suffix array encoder (method 3, level 10) next to LZO1X-1 and,
+    when the module is built with liblzo, its LZO1X-999 level 9'''
+    mb = size / (1024.0 * 1024.0)
+    # lzo_crc32 only comes with liblzo, without it level 9 is level 10
+    methods = [('1x-1', 1, 1)]
+    if hasattr(lzo, 'lzo_crc32'):
+        methods.append(('1x-999/9', 3, 9))
+    methods.append(('opt/%d' % lzo.OPT_LEVEL, 3, lzo.OPT_LEVEL))
+    print('%-8s %-9s %10s %8s' % ('kind', 'method', 'comp MB/s', 'ratio'))
+    for kind in kinds:
+        blocks = blocks_of(sample_data(kind, size), block_size)
+        for name, method, level in methods:
+            compressed = [lzo.compress_block(b, method, level) for b in blocks]
+
+            def compress():
+                for b in blocks:
+                    lzo.compress_block(b, method, level)
+
+            tc = best_of(repeat, compress)
+            ratio = float(sum(len(c) for c in compressed)) / max(size, 1)
+            print('%-8s %-9s %10.2f %8.3f' % (kind, name, mb / tc, ratio))
+    if not hasattr(lzo, 'lzo_crc32'):
+        print('built with minilzo: no LZO1X-999 to compare with')
+
+
+def bench_many(kinds, size, repeat):
+    '''decode small blocks one call each and in one decompress_many call'''
+    mb = size / (1024.0 * 1024.0)
+    print('%-8s %6s %10s %10s %8s' % ('kind', 'block', 'loop MB/s', 'many MB/s', 'speedup'))
+    for kind in kinds:
+        data = sample_data(kind, size)
+        for block_size in (4096, 8192, 16384):
+            blocks = blocks_of(data, block_size)
+            compressed = [lzo.compress_block(b, 1, 1) for b in blocks]
+            lens = [len(b) for b in blocks]
+
+            def loop():
+                # keep the results, like decompress_many does
+                return [lzo.decompress_block(c, n) for c, n in zip(compressed, lens)]
+
+            def many():
+                lzo.decompress_many(compressed, lens)
+
+            assert lzo.decompress_many(compressed, lens) == blocks
+            tl = best_of(repeat, loop)
+            tm = best_of(repeat, many)
+            print('%-8s %6d %10.1f %10.1f %8.2f' % (kind, block_size, mb / tl,
+                                                    mb / tm, tl / tm))
+
+
+class Histogram(object):
+    '''Log-linear histogram of durations: 16 buckets per power of two of
+    nanoseconds, so a percentile is off by at most 1/16. Recording is one
+    frexp and a list increment.'''
+
+    SUB = 16
+
+    def __init__(self):
+        self.counts = [0] * (64 * self.SUB)
+        self.n = 0
+
+    def record(self, seconds):
+        m, e = math.frexp(seconds * 1e9 + 1)
+        self.counts[e * self.SUB + int((m - 0.5) * 2 * self.SUB)] += 1
+        self.n += 1
+
+    def merge(self, other):
+        for i, c in enumerate(other.counts):
+            self.counts[i] += c
+        self.n += other.n
+
+    def percentile(self, p):
+        '''upper bound of the bucket holding the p-th fraction, in us'''
+        rank = p * self.n
+        seen = 0
+        for i, c in enumerate(self.counts):
+            seen += c
+            if c and seen >= rank:
+                e, sub = divmod(i, self.SUB)
+                return math.ldexp(0.5 + (sub + 1) / (2.0 * self.SUB), e) / 1e3
+        return 0.0
+
+
+def time_calls(fn, args, calls, hist):
+    '''call fn(*args[i]) calls times round robin, recording each call'''
+    timer = timeit.default_timer
+    record = hist.record
+    k = len(args)
+    for i in range(calls):
+        a = args[i % k]
+        t0 = timer()
+        fn(*a)
+        record(timer() - t0)
+
+
+LATENCY_SIZES = [64, 256, 1024, 4096, 16384]
+
+
+def bench_latency(kinds, calls, threads):
+    '''per-call latency of small blocks, from one thread and from several
+    at once (compress_block releases the GIL, decompress_block does not).
+    Times below the resolution of timeit.default_timer (1 us with
+    gettimeofday) land in its lowest bucket'''
+    print('%-8s %6s %3s %-10s %8s %8s %8s %8s' % (
+        'kind', 'block', 'thr', 'call', 'p50 us', 'p90 us', 'p99 us', 'p999 us'))
+    for kind in kinds:
+        for size in LATENCY_SIZES:
+            # a few distinct payloads, so the branch predictor can't learn one
+            blocks = blocks_of(sample_data(kind, 16 * size), size)
+            compressed = [lzo.compress_block(b, 1, 1) for b in blocks]
+            calls_of = [
+                ('compress', lzo.compress_block, [(b, 1, 1) for b in blocks]),
+                ('decompress', lzo.decompress_block,
+                 [(c, len(b)) for b, c in zip(blocks, compressed)])]
+            for n in sorted(set([1, threads])):
+                for name, fn, args in calls_of:
+                    time_calls(fn, args, min(calls, 1000), Histogram())  # warm up
+                    hists = [Histogram() for i in range(n)]
+                    workers = [threading.Thread(target=time_calls,
+                                                args=(fn, args, calls, h))
+                               for h in hists]
+                    for t in workers:
+                        t.start()
+                    for t in workers:
+                        t.join()
+                    hist = hists[0]
+                    for h in hists[1:]:
+                        hist.merge(h)
+                    print('%-8s %6d %3d %-10s %8.2f %8.2f %8.2f %8.2f' % (
+                        kind, size, n, name, hist.percentile(0.5),
+                        hist.percentile(0.9), hist.percentile(0.99),
+                        hist.percentile(0.999)))
+
+
+def bench_qos(kinds, size, repeat):
+    '''latency of small compress_block calls while the pool runs bulk work'''
+    threads = max(lzo.pool_size(), 2)
+    print('pool of %d, %d threads per bulk call' % (lzo.pool_size(), threads))
+    print('%-8s %4s %10s %10s %10s' % ('kind', 'qos', 'p50 us', 'p99 us', 'bulk MB/s'))
+    for kind in kinds:
+        data = sample_data(kind, size)
+        bulk = blocks_of(data, lzo.BLOCK_SIZE)
+        small = blocks_of(data[:1024 * 1024], 4096)
+        for qos in (1, 0):
+            lzo.set_pool_qos(qos)
+            stop = []
+            done = [0]
+
+            def background():
+                while not stop:
+                    lzo.compress_many(bulk, 1, 1, threads)
+                    done[0] += len(data)
+
+            t = threading.Thread(target=background)
+            t.start()
+            hist = Histogram()
+            t0 = timeit.default_timer()
+            for i in range(repeat):
+                time_calls(lzo.compress_block, [(b, 1, 1) for b in small],
+                           len(small), hist)
+            elapsed = timeit.default_timer() - t0
+            stop.append(True)
+            t.join()
+            print('%-8s %4s %10.1f %10.1f %10.1f' % (
+                kind, 'on' if qos else 'off', hist.percentile(0.5),
+                hist.percentile(0.99), done[0] / elapsed / (1024.0 * 1024.0)))
+    lzo.set_pool_qos(1)
+
+
+def bench_aio(kinds, size, repeat):
+    '''file to file conversion: the plain loop against aio=pread and the
+    io_uring, then both with nocache. The files live in the temporary
+    directory and, but for nocache, stay in the page cache, so this
+    measures the overlap of I/O and compression more than a cold disk;
+    the nocache rows pay for writing back and rereading'''
+    mb = size / (1024.0 * 1024.0)
+    paths = [('plain', False, False), ('pread', 'pread', False)]
+    if lzo.aio_uring():
+        paths.append(('io_uring', True, False))
+    paths += [(name + '/nc', aio, True) for name, aio, nocache in paths[1:]]
+    print('%-8s %-12s %10s %10s' % ('kind', 'path', 'comp MB/s', 'dec MB/s'))
+    tmp = tempfile.mkdtemp()
+    try:
+        src = os.path.join(tmp, 'src')
+        packed = os.path.join(tmp, 'src.lzo')
+        out = os.path.join(tmp, 'out')
+        for kind in kinds:
+            with open(src, 'wb') as f:
+                f.write(sample_data(kind, size))
+            for name, aio, nocache in paths:
+                tc = best_of(repeat, lambda: lzo.compress_file(
+                    src, packed, threads=lzo.pool_size(), aio=aio, nocache=nocache))
+                td = best_of(repeat, lambda: lzo.decompress_file(packed, out, aio=aio,
+                                                                 nocache=nocache))
+                print('%-8s %-12s %10.1f %10.1f' % (kind, name, mb / tc, mb / td))
+    finally:
+        shutil.rmtree(tmp)
+
+
+def bench_reader(kinds, size, block_size, repeat):
+    '''LzoReader on reads of 4 KiB: a sequential scan, every 4th block,
+    and random offsets: without prefetch, with it, and without it but
+    with a BlockCache another reader has filled (a second worker process
+    of a server). The hit rate counts the decoded blocks found in the
+    reader's cache, waste the prefetched blocks never read'''
+    read = 4096
+    rng = random.Random(1)
+    print('%-8s %-10s %-9s %10s %8s %8s' % ('kind', 'pattern', 'reader',
+                                           'MB/s', 'hits', 'waste'))
+    tmp = tempfile.mkdtemp()
+    try:
+        packed = os.path.join(tmp, 'src.lzo')
+        for kind in kinds:
+            with lzo.LzoFile(packed, 'wb', block_size=block_size) as f:
+                f.write(sample_data(kind, size))
+            index = lzo.LzoIndex.build(packed)
+            cache = lzo.BlockCache(2 * size, max(block_size, lzo.SHARED_CACHE_SLOT))
+            with lzo.LzoReader(packed, index, shared=cache) as r:
+                r.read(0)
+            readers = [('plain', 0, None), ('prefetch', lzo.PREFETCH_BLOCKS, None),
+                       ('shared', 0, cache)]
+            patterns = [
+                ('sequential', range(0, size, read)),
+                ('stride', range(0, size, 4 * block_size)),
+                ('random', [rng.randrange(size) for _ in range(size // block_size * 4)]),
+            ]
+            for name, offsets in patterns:
+                for reader, prefetch, shared in readers:
+                    done = []
+                    def scan():
+                        r = lzo.LzoReader(packed, index, prefetch=prefetch, shared=shared)
+                        for offset in offsets:
+                            r.read(offset, read)
+                        r.close()
+                        done.append(r)
+                    t = best_of(repeat, scan)
+                    stats = done[-1].stats
+                    print('%-8s %-10s %-9s %10.1f %7.0f%% %7.0f%%' % (
+                        kind, name, reader, len(offsets) * read / t / (1024.0 * 1024.0),
+                        stats.hit_rate * 100, stats.waste_rate * 100))
+            cache.close()
+    finally:
+        shutil.rmtree(tmp)
+
+
+def main():
+    parser = argparse.ArgumentParser(description='Benchmark the _lzo extension')
+    parser.add_argument('-s', '--size', default='16M', help='bytes per data kind')
+    parser.add_argument('-b', '--block-size', default=str(lzo.BLOCK_SIZE))
+    parser.add_argument('-r', '--repeat', type=int, default=5)
+    parser.add_argument('-m', '--mode', choices=['throughput', 'many', 'qos', 'latency', 'aio',
+                                                 'reader', 'opt'],
+                        default='throughput')
+    parser.add_argument('-n', '--calls', type=int, default=20000,
+                        help='calls per thread in latency mode')
+    parser.add_argument('-t', '--threads', type=int, default=4,
+                        help='contending threads in latency mode')
+    parser.add_argument('kinds', nargs='*', default=KINDS)
+    args = parser.parse_args()
+
+    for kind in args.kinds:
+        if kind not in KINDS:
+            sys.exit('unknown data kind %r' % kind)
+
+    if args.mode == 'many':
+        bench_many(args.kinds, parse_size(args.size), args.repeat)
+    elif args.mode == 'latency':
+        bench_latency(args.kinds, args.calls, args.threads)
+    elif args.mode == 'qos':
+        bench_qos(args.kinds, parse_size(args.size), args.repeat)
+    elif args.mode == 'aio':
+        bench_aio(args.kinds, parse_size(args.size), args.repeat)
+    elif args.mode == 'opt':
+        bench_opt(args.kinds, parse_size(args.size),
+                  parse_size(args.block_size), args.repeat)
+    elif args.mode == 'reader':
+        bench_reader(args.kinds, parse_size(args.size),
+                     parse_size(args.block_size), args.repeat)
+    else:
+        bench_throughput(args.kinds, parse_size(args.size),
+                         parse_size(args.block_size), args.repeat)
+
+
+if __name__ == '__main__':
+    main()
@@ -0,0 +1,39 @@
+#!/bin/sh
+# Build the differential decoder fuzzer.
+#
+#   ./build.sh              libFuzzer with ASan/UBSan (needs clang)
+#   ./build.sh afl          afl-clang-fast, reads the test case from stdin
+#   ./build.sh standalone   plain $CC with ASan/UBSan, replays files given
+#                           on the command line (e.g. the seed corpus)
+#
+# Then, for libFuzzer:
+#
+#   python make_corpus.py && ./fuzz_decompress corpus/block
+#
+# and for the lzop framing parser in lzo.py:
+#
+#   python fuzz_lzop.py -n 100000 corpus/lzop
+
+set -e
+cd "$(dirname "$0")"
+
+SRCS="fuzz_decompress.c ../minilzo.c ../lzostream.c ../lzosegment.c ../lzoctx.c ../lzoinplace.c ../lzoopt.c"
+FLAGS="-g -O1 -I.. -fno-omit-frame-pointer"
+# minilzo does unaligned loads on purpose (LZO_OPT_UNALIGNED*)
+SAN="-fsanitize=address,undefined -fno-sanitize=alignment"
+
+case "${1:-libfuzzer}" in
+libfuzzer)
+    ${CC:-clang} $FLAGS -fsanitize=fuzzer $SAN $SRCS -o fuzz_decompress
+    ;;
+afl)
+    ${CC:-afl-clang-fast} $FLAGS -DFUZZ_STANDALONE $SRCS -o fuzz_decompress_afl
+    ;;
+standalone)
+    ${CC:-cc} $FLAGS -DFUZZ_STANDALONE $SAN $SRCS -o fuzz_decompress_replay
+    ;;
+*)
+    echo "usage: $0 [libfuzzer|afl|standalone]" >&2
+    exit 1
+    ;;
+esac
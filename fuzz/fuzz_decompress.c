@@ -0,0 +1,350 @@
+/*
+ * Differential fuzzer for the LZO1X decoders.
+ *
+ * Every decoder variant is checked against lzo1x_decompress_safe, which is
+ * the reference.  Input layout:
+ *
+ *   byte 0      mode: bit 0 clear = decode the payload as a raw LZO1X block,
+ *                     bit 0 set   = compress the payload and round-trip it
+ *   bytes 1..3  output buffer size for raw decoding, segment size for
+ *               round trips (big endian)
+ *   bytes 4..   payload
+ *
+ * Raw decoding only runs the checked variants, they must agree with the
+ * reference on success/failure and on the output.  Round-tripping runs all
+ * variants, including the unchecked ones, on well-formed compressor output;
+ * the payload is also compressed in segments and joined (lzosegment.h),
+ * and as a sequence of messages of the segment size through a context
+ * (lzoctx.h), and with the maximum ratio encoder (lzoopt.h), which must
+ * all decode to the same bytes.  Every block is
+ * also decoded in place (lzoinplace.h), with the margin and without any:
+ * a refused block is fine, wrong output is not, and compressor output
+ * must always fit with the margin.
+ *
+ * Built with libFuzzer by default; define FUZZ_STANDALONE to get a main()
+ * that replays files (or stdin, for AFL).
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "minilzo.h"
+#include "lzostream.h"
+#include "lzosegment.h"
+#include "lzoctx.h"
+#include "lzoinplace.h"
+#include "lzoopt.h"
+
+#define MAX_OUT         (1024*1024l)
+
+typedef int (*decoder_fn)(const lzo_bytep src, lzo_uint src_len,
+                          lzo_bytep dst, lzo_uintp dst_len, lzo_voidp wrkmem);
+
+struct variant {
+  const char *name;
+  decoder_fn fn;
+  int checked;          /* safe on malformed input */
+};
+
+static lzo_stream_t stream;
+static lzo_ctx_t ctx;
+static lzo_dctx_t dctx;
+
+/* lzo_stream_decode with growing output steps, so decoding pauses inside
+   literal runs and matches */
+static int
+stream_decompress(const lzo_bytep src, lzo_uint src_len,
+                  lzo_bytep dst, lzo_uintp dst_len, lzo_voidp wrkmem)
+{
+  lzo_uint done = 0;
+  lzo_uint step = 1;
+  int err;
+
+  (void) wrkmem;
+  lzo_stream_init(&stream, src, src_len, *dst_len);
+  for (;;) {
+    lzo_uint n = step < *dst_len - done ? step : *dst_len - done;
+
+    err = lzo_stream_decode(&stream, dst + done, &n);
+    done += n;
+    if (err != LZO_E_OK || lzo_stream_eof(&stream))
+      break;
+    if (n == 0) {
+      err = LZO_E_ERROR;
+      break;
+    }
+    step = step < 4096 ? step * 3 + 1 : 1;
+  }
+  *dst_len = done;
+  return err;
+}
+
+static const struct variant variants[] = {
+  {"lzo1x_decompress", lzo1x_decompress, 0},
+  {"lzo_stream_decode", stream_decompress, 1},
+  {NULL, NULL, 0}
+};
+
+static lzo_bytep ref_buf;
+static lzo_bytep var_buf;
+static lzo_bytep cmp_buf;
+static lzo_bytep seg_buf;
+static lzo_bytep inplace_buf;
+static lzo_voidp wrkmem;
+
+static void
+fail(const char *variant, const char *what)
+{
+  fprintf(stderr, "fuzz_decompress: %s: %s\n", variant, what);
+  abort();
+}
+
+static void
+setup(void)
+{
+  if (ref_buf)
+    return;
+  if (lzo_init() != LZO_E_OK)
+    fail("lzo_init", "failed");
+  ref_buf = (lzo_bytep) malloc(MAX_OUT);
+  var_buf = (lzo_bytep) malloc(MAX_OUT + MAX_OUT / 16 + 67 * 8);
+  cmp_buf = (lzo_bytep) malloc(MAX_OUT + MAX_OUT / 16 + 64 + 3);
+  seg_buf = (lzo_bytep) malloc(lzo_segment_join_bound(MAX_OUT, 8));
+  inplace_buf = (lzo_bytep) malloc(lzo_segment_join_bound(MAX_OUT, 8));
+  wrkmem = malloc(LZO1X_1_MEM_COMPRESS);
+  if (!ref_buf || !var_buf || !cmp_buf || !seg_buf || !inplace_buf || !wrkmem)
+    fail("setup", "out of memory");
+}
+
+/* decode src in place in a buffer of dst_len plus margin bytes, must give
+   what ref_buf holds if ref_err is LZO_E_OK */
+static void
+fuzz_inplace(const lzo_bytep src, lzo_uint src_len, lzo_uint dst_len,
+             lzo_uint margin, int ref_err, int must_fit)
+{
+  lzo_uint size = dst_len + margin;
+  int err;
+
+  if (src_len == dst_len || src_len > size)
+    return;
+  memcpy(inplace_buf + size - src_len, src, src_len);
+  err = lzo_inplace_decompress(inplace_buf, size - src_len, src_len, dst_len);
+  if (err == LZO_E_OK && (ref_err != LZO_E_OK || memcmp(inplace_buf, ref_buf, dst_len) != 0))
+    fail("lzo_inplace_decompress", "output differs from lzo1x_decompress_safe");
+  if (err != LZO_E_OK && must_fit)
+    fail("lzo_inplace_decompress", "compressor output does not fit the margin");
+}
+
+static void
+fuzz_raw(const lzo_bytep src, lzo_uint src_len, lzo_uint dst_len)
+{
+  const struct variant *v;
+  lzo_uint ref_len = dst_len;
+  int ref_err;
+
+  ref_err = lzo1x_decompress_safe(src, src_len, ref_buf, &ref_len, NULL);
+
+  for (v = variants; v->name; v++) {
+    lzo_uint len = dst_len;
+    int err;
+
+    if (!v->checked)
+      continue;
+    err = v->fn(src, src_len, var_buf, &len, NULL);
+    if ((err == LZO_E_OK) != (ref_err == LZO_E_OK))
+      fail(v->name, "disagrees with lzo1x_decompress_safe on validity");
+    if (err == LZO_E_OK &&
+        (len != ref_len || memcmp(var_buf, ref_buf, len) != 0))
+      fail(v->name, "output differs from lzo1x_decompress_safe");
+  }
+
+  if (ref_err == LZO_E_OK)
+    dst_len = ref_len;
+  fuzz_inplace(src, src_len, dst_len, 0, ref_err, 0);
+  fuzz_inplace(src, src_len, dst_len, lzo_inplace_margin(dst_len), ref_err, 0);
+}
+
+/* compress data in segments of seg_size bytes, join them and decode */
+static void
+fuzz_segments(const lzo_bytep data, lzo_uint size, lzo_uint seg_size)
+{
+  lzo_segment_t segs[8];
+  lzo_uint cmp_len = lzo_segment_join_bound(size, 8);
+  lzo_uint len = size;
+  lzo_uint off = 0;
+  int n = 0;
+  int i, last;
+
+  while (off < size && n < 8) {
+    segs[n].in = data + off;
+    segs[n].in_len = n < 7 && seg_size < size - off ? seg_size : size - off;
+    segs[n].out = var_buf + off + off / 16 + 67 * n;
+    if (lzo_segment_compress(&segs[n], wrkmem) != LZO_E_OK)
+      fail("lzo_segment_compress", "failed");
+    off += segs[n++].in_len;
+  }
+
+  if (lzo_segment_join(segs, n, seg_buf, &cmp_len) != LZO_E_OK)
+    fail("lzo_segment_join", "failed");
+  if (lzo1x_decompress_safe(seg_buf, cmp_len, ref_buf, &len, NULL) != LZO_E_OK
+      || len != size || memcmp(ref_buf, data, size) != 0)
+    fail("lzo_segment_join", "round trip mismatch");
+  fuzz_inplace(seg_buf, cmp_len, size, lzo_inplace_margin(size), LZO_E_OK, 1);
+
+  /* and piece by piece from the restart points */
+  memset(ref_buf, 0, size);
+  for (i = 0, last = -1; i < n || (last >= 0 && i == n); i++) {
+    if (i < n && segs[i].c_off == LZO_SEGMENT_NO_RESTART)
+      continue;
+    if (last >= 0 &&
+        lzo_segment_decode(seg_buf + segs[last].c_off, cmp_len - segs[last].c_off,
+                           ref_buf + segs[last].d_off,
+                           (i < n ? segs[i].d_off : size) - segs[last].d_off,
+                           i == n) != LZO_E_OK)
+      fail("lzo_segment_decode", "failed");
+    last = i;
+  }
+  if (last == n && memcmp(ref_buf, data, size) != 0)
+    fail("lzo_segment_decode", "round trip mismatch");
+}
+
+/* compress data as messages of msg_size bytes through a context */
+static void
+fuzz_messages(const lzo_bytep data, lzo_uint size, lzo_uint msg_size)
+{
+  lzo_uint off = 0;
+
+  lzo_ctx_init(&ctx);
+  lzo_dctx_init(&dctx);
+  do {
+    lzo_uint n = msg_size < size - off ? msg_size : size - off;
+    lzo_uint cmp_len = 0;
+    lzo_uint len = n;
+
+    if (lzo_ctx_compress(&ctx, data + off, n, cmp_buf, &cmp_len) != LZO_E_OK)
+      fail("lzo_ctx_compress", "failed");
+    if (cmp_len > lzo_ctx_bound(n))
+      fail("lzo_ctx_compress", "output over lzo_ctx_bound");
+    if (lzo_dctx_decompress(&dctx, cmp_buf, cmp_len, ref_buf + off, &len) != LZO_E_OK
+        || memcmp(ref_buf + off, data + off, n) != 0)
+      fail("lzo_dctx_decompress", "round trip mismatch");
+    off += n;
+  } while (off < size);
+}
+
+/* the optimal parse must give a stream every decoder reads */
+static void
+fuzz_optimal(const lzo_bytep data, lzo_uint size)
+{
+  const struct variant *v;
+  lzo_uint cmp_len = 0;
+  lzo_uint len;
+
+  if (lzo1x_opt_compress(data, size, cmp_buf, &cmp_len) != LZO_E_OK)
+    fail("lzo1x_opt_compress", "failed");
+  if (cmp_len > size + size / 64 + 16 + 3)
+    fail("lzo1x_opt_compress", "output over bound");
+  for (v = variants; v->name; v++) {
+    len = size;
+    if (v->fn(cmp_buf, cmp_len, var_buf, &len, NULL) != LZO_E_OK
+        || len != size || memcmp(var_buf, data, size) != 0)
+      fail(v->name, "optimal round trip mismatch");
+  }
+  fuzz_inplace(cmp_buf, cmp_len, size, lzo_inplace_margin(size), LZO_E_OK, 1);
+}
+
+static void
+fuzz_roundtrip(const lzo_bytep data, lzo_uint size, lzo_uint seg_size)
+{
+  const struct variant *v;
+  lzo_uint cmp_len = 0;
+  lzo_uint len = size;
+
+  if (lzo1x_1_compress(data, size, cmp_buf, &cmp_len, wrkmem) != LZO_E_OK)
+    fail("lzo1x_1_compress", "failed");
+
+  if (lzo1x_decompress_safe(cmp_buf, cmp_len, ref_buf, &len, NULL) != LZO_E_OK
+      || len != size || memcmp(ref_buf, data, size) != 0)
+    fail("lzo1x_decompress_safe", "round trip mismatch");
+  fuzz_inplace(cmp_buf, cmp_len, size, lzo_inplace_margin(size), LZO_E_OK, 1);
+  fuzz_inplace(cmp_buf, cmp_len, size, 0, LZO_E_OK, 0);
+
+  for (v = variants; v->name; v++) {
+    len = size;
+    if (v->fn(cmp_buf, cmp_len, var_buf, &len, NULL) != LZO_E_OK
+        || len != size || memcmp(var_buf, data, size) != 0)
+      fail(v->name, "round trip mismatch");
+  }
+
+  fuzz_segments(data, size, seg_size ? seg_size : 1);
+  fuzz_messages(data, size, seg_size ? seg_size : 1);
+  fuzz_optimal(data, size);
+}
+
+int
+LLVMFuzzerTestOneInput(const unsigned char *data, size_t size)
+{
+  lzo_uint dst_len;
+
+  setup();
+  if (size < 4)
+    return 0;
+
+  dst_len = ((lzo_uint)data[1] << 16) | ((lzo_uint)data[2] << 8) | data[3];
+  if (dst_len > MAX_OUT)
+    dst_len = MAX_OUT;
+
+  if (data[0] & 1) {
+    if (size - 4 <= MAX_OUT)
+      fuzz_roundtrip(data + 4, (lzo_uint)(size - 4), dst_len);
+  }
+  else
+    fuzz_raw(data + 4, (lzo_uint)(size - 4), dst_len);
+
+  return 0;
+}
+
+#ifdef FUZZ_STANDALONE
+static int
+run_file(FILE *fp)
+{
+  unsigned char *buf = NULL;
+  size_t len = 0, cap = 0, n;
+
+  do {
+    if (len == cap) {
+      cap = cap ? cap * 2 : 65536;
+      buf = (unsigned char *) realloc(buf, cap);
+      if (!buf)
+        return 1;
+    }
+    n = fread(buf + len, 1, cap - len, fp);
+    len += n;
+  } while (n > 0);
+
+  LLVMFuzzerTestOneInput(buf, len);
+  free(buf);
+  return 0;
+}
+
+int
+main(int argc, char *argv[])
+{
+  int i;
+
+  if (argc < 2)
+    return run_file(stdin);
+
+  for (i = 1; i < argc; i++) {
+    FILE *fp = fopen(argv[i], "rb");
+    if (!fp) {
+      perror(argv[i]);
+      return 1;
+    }
+    if (run_file(fp))
+      return 1;
+    fclose(fp);
+  }
+  return 0;
+}
+#endif
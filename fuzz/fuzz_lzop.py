@@ -0,0 +1,93 @@
+'''Mutation fuzzer for the lzop framing parser in lzo.py.
+
+Seeds are lzop files (see make_corpus.py).  Each iteration mutates a seed
+(truncation, bit flips, byte overwrites, splices of another seed) and reads
+it back with LzoFile.  A malformed file must be rejected with IOError,
+lzo.error or a failed checksum assertion; anything else is a parser bug and
+the input is saved as crash-<n>.lzo.
+'''
+
+import argparse
+import io
+import os
+import random
+import sys
+import traceback
+
+sys.path.insert(0, os.path.join(os.path.dirname(os.path.abspath(__file__)), '..'))
+import lzo
+
+EXPECTED = (IOError, lzo.error, AssertionError)
+
+
+def mutate(data, seeds, rng):
+    data = bytearray(data)
+    op = rng.randrange(5)
+    if op == 0 or not data:
+        del data[rng.randrange(len(data) + 1):]
+    elif op == 1:
+        for i in range(rng.randint(1, 4)):
+            pos = rng.randrange(len(data))
+            data[pos] ^= 1 << rng.randrange(8)
+    elif op == 2:
+        for i in range(rng.randint(1, 4)):
+            data[rng.randrange(len(data))] = rng.choice([0, 1, 0x11, 0x7f, 0xff])
+    elif op == 3:
+        other = rng.choice(seeds)
+        cut = rng.randrange(len(data))
+        data[cut:] = other[rng.randrange(len(other) + 1):]
+    else:
+        pos = rng.randrange(len(data))
+        data[pos:pos] = bytearray(rng.getrandbits(8) for i in range(rng.randint(1, 8)))
+    return bytes(data)
+
+
+def parse(data):
+    f = lzo.LzoFile(fileobj=io.BytesIO(data), mode='rb')
+    f.read()
+
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__.split('\n')[0])
+    parser.add_argument('-n', '--iterations', type=int, default=10000)
+    parser.add_argument('-s', '--seed', type=int, default=0)
+    parser.add_argument('corpus')
+    args = parser.parse_args()
+
+    seeds = []
+    for name in sorted(os.listdir(args.corpus)):
+        with open(os.path.join(args.corpus, name), 'rb') as f:
+            seeds.append(f.read())
+    if not seeds:
+        sys.exit('empty corpus')
+
+    # every truncation of every seed first, then random mutations
+    truncated = (s[:i] for s in seeds for i in range(len(s)) if i < 256 or i % 97 == 0)
+    rng = random.Random(args.seed)
+    crashes = 0
+    for data in truncated:
+        crashes += run_case(data, crashes)
+    for i in range(args.iterations):
+        crashes += run_case(mutate(rng.choice(seeds), seeds, rng), crashes)
+
+    print('%d crashes' % crashes)
+    sys.exit(1 if crashes else 0)
+
+
+def run_case(data, crashes):
+    try:
+        parse(data)
+    except EXPECTED:
+        pass
+    except Exception:
+        name = 'crash-%d.lzo' % crashes
+        with open(name, 'wb') as f:
+            f.write(data)
+        print('%s:' % name)
+        traceback.print_exc()
+        return 1
+    return 0
+
+
+if __name__ == '__main__':
+    main()
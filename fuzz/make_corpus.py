@@ -0,0 +1,49 @@
+'''Write the seed corpus for the fuzzers.
+
+corpus/block/  inputs for fuzz_decompress (raw LZO1X blocks and round-trip
+               payloads, see the layout in fuzz_decompress.c)
+corpus/lzop/   complete lzop files for fuzz_lzop.py
+'''
+
+import io
+import os
+import random
+import struct
+import sys
+
+sys.path.insert(0, os.path.join(os.path.dirname(os.path.abspath(__file__)), '..'))
+import lzo
+from bench import KINDS, sample_data
+
+
+SIZES = [0, 1, 3, 4, 17, 18, 19, 238, 239, 300, 4096, 70000]
+
+
+def main():
+    rng = random.Random(0x4c5a4f)
+    here = os.path.dirname(os.path.abspath(__file__))
+    block_dir = os.path.join(here, 'corpus', 'block')
+    lzop_dir = os.path.join(here, 'corpus', 'lzop')
+    for d in (block_dir, lzop_dir):
+        if not os.path.isdir(d):
+            os.makedirs(d)
+
+    for kind in KINDS:
+        for size in SIZES:
+            data = sample_data(kind, size, rng)
+            name = '%s-%d' % (kind, size)
+
+            compressed = lzo.compress_block(data, 1, 1)
+            with open(os.path.join(block_dir, name + '.raw'), 'wb') as f:
+                f.write(b'\0' + struct.pack('>I', size)[1:] + compressed)
+            with open(os.path.join(block_dir, name + '.rt'), 'wb') as f:
+                f.write(b'\1\0\0\0' + data)
+
+            buf = io.BytesIO()
+            lzo.LzoFile(filename=name, fileobj=buf, mode='wb').write(data)
+            with open(os.path.join(lzop_dir, name + '.lzo'), 'wb') as f:
+                f.write(buf.getvalue())
+
+
+if __name__ == '__main__':
+    main()
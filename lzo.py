@@ -1,10 +1,14 @@
 
 import struct
 import io
+import mmap
+import bisect
+import itertools
+import zlib
 import __builtin__
 from _lzo import *
 
-__all__ = ["LzoFile", "open"]
+__all__ = ["LzoFile", "LzoIndex", "open", "compress_file", "decompress_file"]
 
 MAGIC = b"\x89\x4C\x5A\x4F\x00\x0D\x0A\x1A\x0A"
 
@@ -21,6 +25,37 @@ LZO_LIB_VERSION = 0x0940
 BLOCK_SIZE = (128*1024L)
 MAX_BLOCK_SIZE = (64*1024l*1024L)
 
+# LZO1X-999 level of the suffix array encoder, the best ratio
+OPT_LEVEL = 10
+
+# blocks larger than this are decoded incrementally, STREAM_CHUNK_SIZE
+# bytes at a time, rather than all at once
+STREAM_THRESHOLD = (1024*1024L)
+STREAM_CHUNK_SIZE = (64*1024L)
+
+INDEX_MAGIC = b"LZOIDX\x00\x01"
+INDEX_SUFFIX = ".idx"
+
+# recompress keeps a block unless the new one is at least this much smaller
+RECOMPRESS_MIN_GAIN = 0.03
+# and re-encodes at most about this many uncompressed bytes at a time
+RECOMPRESS_BATCH = (32*1024*1024L)
+
+# block reads and writes kept in flight by compress_file and
+# decompress_file with aio
+AIO_DEPTH = 32
+# and with nocache, the files leave the page cache this much at a time
+NOCACHE_WINDOW = (8*1024*1024L)
+
+# LzoReader keeps this many decoded blocks, and once PREFETCH_TRIGGER
+# block changes in a row had the same stride decodes the next
+# PREFETCH_BLOCKS along it in the background
+READER_CACHE_BLOCKS = 64
+PREFETCH_BLOCKS = 8
+PREFETCH_TRIGGER = 2
+# slots of the cache set_shared_cache makes, lzop writes 256 KiB blocks
+SHARED_CACHE_SLOT = (256*1024L)
+
 
 F_ADLER32_D     = 0x00000001L
 F_ADLER32_C     = 0x00000002L
@@ -38,19 +73,30 @@ F_H_CRC32       = 0x00001000L
 F_H_PATH        = 0x00002000L
 F_MASK          = 0x00003FFFL
 
+def _method_level(compresslevel):
+    '''the (method, level) of the blocks for a compresslevel of LzoFile'''
+    if compresslevel is not None and compresslevel >= 7:
+        return 3, min(compresslevel, OPT_LEVEL)
+    return 1, 1
+
 def open(filename, mode):
     return LzoFile(filename = filename, mode = mode)
 
 class LzoFile(io.BufferedIOBase):
 
     def __init__(self, filename=None, mode=None,
-                 compresslevel=None, fileobj=None, mtime=None, verify_checksum=True):
+                 compresslevel=None, fileobj=None, mtime=None, verify_checksum=True,
+                 stream_threshold=STREAM_THRESHOLD, block_size=None, threads=1,
+                 restart_interval=None, index=None):
         """Constructor for the LzoFile class.
 
         At least one of fileobj and filename must be given a
         non-trivial value.
 
-        The compresslevel and mtime attribute is not supported so far
+        compresslevel picks the method when writing, as in lzop: up to 6
+        is LZO1X-1, 7 to 9 LZO1X-999 and 10 the in-tree suffix array
+        encoder (see OPT_LEVEL), which gives the smallest files.  The mtime
+        attribute is not supported so far
 
         The new class instance is based on fileobj, which can be a regular
         file, a StringIO object, or any other object which simulates a file.
@@ -63,6 +109,21 @@ class LzoFile(io.BufferedIOBase):
         fileobj, if discernible; otherwise, it defaults to the empty string,
         and in this case the original filename is not included in the header.
 
+        Blocks that decompress to more than stream_threshold bytes are
+        decoded incrementally, so read() returns as soon as enough of the
+        block is available and a whole huge block is never held in memory.
+
+        When writing, content is cut into blocks of block_size bytes
+        (BLOCK_SIZE by default, at most MAX_BLOCK_SIZE).  With threads > 1
+        each large block is compressed by that many threads at once; the
+        result is still one ordinary LZO1X block.
+
+        With restart_interval, no match crosses a multiple of that many
+        bytes within a block and the points where decoding can restart
+        are recorded in self.index, which is saved to the path index on
+        close.  The file itself stays an ordinary lzop file.  When
+        reading, index is an LzoIndex or the path of one; blocks with
+        restart points are then decoded by up to threads threads.
 
         """
 
@@ -98,10 +159,25 @@ class LzoFile(io.BufferedIOBase):
         self.fileobj = fileobj
         self.offset = 0
         self.verify_checksum = verify_checksum
+        self.stream_threshold = stream_threshold
+        self.block_size = block_size or BLOCK_SIZE
+        self.threads = threads
+        self.restart_interval = restart_interval
+        if not 0 < self.block_size <= MAX_BLOCK_SIZE:
+            raise ValueError("block_size out of range")
+        if isinstance(index, basestring):
+            self._index_path = index
+            index = LzoIndex.load(index) if self.mode == READ else None
+        else:
+            self._index_path = None
+        self.index = index
 
         if self.mode == READ:
             self._buf = []
             self._buf_len = 0
+            self._decoder = None
+            self._eof = False
+            self._block = -1
             self._read_magic()
             self._read_header()
 
@@ -109,8 +185,7 @@ class LzoFile(io.BufferedIOBase):
             self.version = LZOP_VERSION
             self.libver = LZO_LIB_VERSION
 
-            self.method = 1             # TODO: three methods
-            self.level = 1
+            self.method, self.level = _method_level(compresslevel)
 
             self.flags = 0
             #self.flags|= F_OS & F_OS_MASK
@@ -128,38 +203,29 @@ class LzoFile(io.BufferedIOBase):
             self._write_magic()
             self._write_header()
 
+            if self.index is None:
+                self.index = LzoIndex()
+            self._data_offset = 0
+
     def _clear_buf(self):
         self._buf = []
         self._buf_len = 0
 
     def _read_from_buf(self, size):
+        '''take the first size bytes of the buffered chunks'''
         assert self._buf_len >= size
         buf_read = 0
         result = []
-        while self._buf:
+        while buf_read < size:
             block = self._buf.pop(0)
-
-            if buf_read + len(block) < size:
-                buf_read += len(block)
-                result.append(block)
-
-            elif buf_read + len(block) == size:
-                buf_read += len(block)
-                result.append(block)
-                break
-
-            else:
-                need = block[:size - buf_read]
-                remain = block[size - buf_read:]
-
-                result.append(need)
-
-                self._clear_buf()
-                self._buf.append(remain)
-                self._buf_len += len(remain)
-                
-                break
-
+            if buf_read + len(block) > size:
+                # keep the rest, in front of the chunks after it
+                self._buf.insert(0, block[size - buf_read:])
+                block = block[:size - buf_read]
+            buf_read += len(block)
+            result.append(block)
+
+        self._buf_len -= size
         return b"".join(result)
     
 
@@ -223,10 +289,17 @@ class LzoFile(io.BufferedIOBase):
             if self.verify_checksum:
                 assert checksum == self._read32_c()
 
-    def _read_block(self):
+    def _read_block_header(self):
+        '''Parse the next block header. Returns (dst_len, src_len, d_adler32,
+        c_adler32), with None for checksums not in the file, or None at the
+        end of the stream.'''
+        if self._eof:
+            return None
+
         dst_len = self._read32()
 
         if dst_len == 0:
+            self._eof = True
             return None
 
         if dst_len > MAX_BLOCK_SIZE:
@@ -234,6 +307,13 @@ class LzoFile(io.BufferedIOBase):
 
         src_len = self._read32()
 
+        if src_len > dst_len:
+            raise error, 'compressed larger than uncompressed'
+
+        self._block += 1
+
+        d_adler32 = d_crc32 = c_adler32 = c_crc32 = None
+
         if self.flags & F_ADLER32_D:
             d_adler32 = self._read32()
 
@@ -252,29 +332,90 @@ class LzoFile(io.BufferedIOBase):
             else:
                 c_crc32 = d_crc32
 
-        block = self.fileobj.read(src_len)
+        # XXX TODO: CRC checksum, only kept for recompress
+        self._block_crc32 = (d_crc32, c_crc32)
+        return dst_len, src_len, d_adler32, c_adler32
+
+    def _check(self, data, expected, offset=0, length=-1):
+        '''verify the adler32 of data[offset:offset+length]'''
+        if self.verify_checksum and expected is not None:
+            checksum = lzo_adler32(data, ADLER32_INIT_VALUE, offset, length)
+            assert checksum == expected
 
+    def _read_block(self):
+        if self._decoder is not None:
+            return self._read_decoder()
+
+        header = self._read_block_header()
+        if header is None:
+            return None
+
+        block = self._read(header[1])
+        self._check(block, header[3])
+        return self._decode_block(header, block)
+
+    def _decode_block(self, header, block):
+        '''Decode a block, or start decoding it incrementally if it is
+        large, returns the (first part of the) uncompressed data.'''
+        dst_len, src_len, d_adler32, c_adler32 = header
+
+        restarts = self._restarts(header)
+        if restarts:
+            uncompressed = bytearray(dst_len)
+            decompress_into(block, uncompressed, dst_len, 0, restarts, self.threads)
+            self._check(uncompressed, d_adler32)
+            return bytes(uncompressed)
+
+        if src_len < dst_len and dst_len > self.stream_threshold:
+            self._decoder = BlockDecoder(block, dst_len)
+            self._decoder_adler32 = ADLER32_INIT_VALUE
+            self._decoder_d_adler32 = d_adler32
+            return self._read_decoder()
 
         if src_len < dst_len:
             uncompressed = decompress_block(block, dst_len)
         else:
             uncompressed = block
 
-        if self.verify_checksum:
-            if self.flags & F_ADLER32_C:
-                checksum = lzo_adler32(block, ADLER32_INIT_VALUE);
-                assert checksum == c_adler32
+        self._check(uncompressed, d_adler32)
+        return uncompressed
 
-            if self.flags & F_ADLER32_D:
-                checksum = lzo_adler32(uncompressed, ADLER32_INIT_VALUE);
-                assert checksum == d_adler32
+    def _restarts(self, header):
+        '''restart points of the current block from the index, if it has
+        some and they are worth using'''
+        if self.index is None or self.threads <= 1:
+            return None
+        if self._block >= len(self.index.blocks):
+            return None
+        entry = self.index.blocks[self._block]
+        if (entry[2], entry[3]) != header[:2] or len(entry[4]) < 2:
+            return None
+        return entry[4]
 
-            # XXX TODO: CRC checksum
+    def _read_decoder(self):
+        '''next chunk of a block that is decoded incrementally'''
+        chunk = self._decoder.read(STREAM_CHUNK_SIZE)
+        check = self.verify_checksum and self.flags & F_ADLER32_D
+        if check:
+            self._decoder_adler32 = lzo_adler32(chunk, self._decoder_adler32)
 
-        return uncompressed
+        if self._decoder.eof:
+            self._decoder = None
+            if check:
+                assert self._decoder_adler32 == self._decoder_d_adler32
+            if not chunk:
+                return self._read_block()
 
-    def _read_c(self, n):
+        return chunk
+
+    def _read(self, n):
         bytes = self.fileobj.read(n)
+        if len(bytes) < n:
+            raise IOError, 'Truncated lzo file'
+        return bytes
+
+    def _read_c(self, n):
+        bytes = self._read(n)
         #print self.adler32
         self.adler32 = lzo_adler32(bytes, self.adler32)
         return bytes
@@ -289,13 +430,13 @@ class LzoFile(io.BufferedIOBase):
         return ord(self._read_c(1))
 
     def _read32(self):
-        return struct.unpack(">I", self.fileobj.read(4))[0]
+        return struct.unpack(">I", self._read(4))[0]
 
     def _read16(self):
-        return struct.unpack(">H", self.fileobj.read(2))[0]
+        return struct.unpack(">H", self._read(2))[0]
         
     def _read8(self):
-        return ord(self.fileobj.read(1))
+        return ord(self._read(1))
 
     def _write_c(self, bytes):
         '''write with checksum, using in write header'''
@@ -363,25 +504,83 @@ class LzoFile(io.BufferedIOBase):
         d_adler32 = lzo_adler32(block, ADLER32_INIT_VALUE)
 
         #print self.method, self.level
-        compressed = compress_block(block, self.method, self.level)
+        restarts = []
+        if self.restart_interval and self.method == 1:
+            compressed, restarts = compress_block_restarts(block, self.restart_interval,
+                                                           self.threads)
+        else:
+            compressed = compress_block(block, self.method, self.level, self.threads)
         c_adler32 = lzo_adler32(compressed, ADLER32_INIT_VALUE)
 
+        if len(compressed) >= len(block):
+            compressed = block
+            c_adler32 = None
+            restarts = []
+
+        self._index_block(bytes_write, len(block), len(compressed), restarts)
+        return bytes_write + self._write_block_data(d_adler32, compressed, c_adler32)
 
-        if len(compressed) < len(block):
-            self._write32(len(compressed))
+    def _index_block(self, header_len, dst_len, src_len, restarts):
+        '''add the block whose header was just begun to the index'''
+        if self.index is None:
+            return
+        try:
+            pos = self.fileobj.tell() - header_len
+        except (AttributeError, IOError):
+            # not seekable, no index
+            self.index = None
+            return
+        self.index.add(pos, self._data_offset, dst_len, src_len, restarts)
+        self._data_offset += dst_len
+
+    def _write_block_data(self, d_adler32, data, c_adler32):
+        '''Write the rest of a block after its uncompressed length. data is
+        the compressed block, or the block itself (c_adler32 None) if it did
+        not shrink.'''
+        if c_adler32 is not None:
+            self._write32(len(data))
             self._write32(d_adler32)
             self._write32(c_adler32)
-            
-            self.fileobj.write(compressed)
-            bytes_write += len(compressed) + 8
-            return bytes_write
+            self.fileobj.write(data)
+            return len(data) + 12
 
         else:
-            self._write32(len(block))
+            self._write32(len(data))
             self._write32(d_adler32)
-            self.fileobj.write(block)
-            bytes_write += len(compressed) + 8
-            return bytes_write
+            self.fileobj.write(data)
+            return len(data) + 8
+
+    def _copy_header(self, src):
+        '''Take the flags, mtime and name of src, an lzo file being read,
+        and write the header again with them. Only for a file written
+        from its start that has no blocks yet.'''
+        self.flags = src.flags & ~(F_H_FILTER | F_H_EXTRA_FIELD)
+        self.mtime_low = src.mtime_low
+        self.mtime_high = getattr(src, 'mtime_high', 0)
+        self.name = src.name
+        self.fileobj.seek(0)
+        self.fileobj.truncate()
+        self._write_magic()
+        self._write_header()
+
+    def _write_block_sums(self, dst_len, data, d_sums, c_sums):
+        '''Write a whole block with the checksums self.flags asks for. data
+        is the compressed block, or the block itself if as long as dst_len;
+        d_sums and c_sums are the (adler32, crc32) of the uncompressed and
+        the compressed data.'''
+        self._write32(dst_len)
+        self._index_block(4, dst_len, len(data), [])
+        self._write32(len(data))
+        if self.flags & F_ADLER32_D:
+            self._write32(d_sums[0])
+        if self.flags & F_CRC32_D:
+            self._write32(d_sums[1])
+        if len(data) < dst_len:
+            if self.flags & F_ADLER32_C:
+                self._write32(c_sums[0])
+            if self.flags & F_CRC32_C:
+                self._write32(c_sums[1])
+        self.fileobj.write(data)
 
 
     @property
@@ -394,6 +593,57 @@ class LzoFile(io.BufferedIOBase):
         if self.closed:
             raise ValueError('I/O operation on closed file.')
 
+    def readinto(self, b):
+        '''Read up to len(b) bytes into the writable buffer b.
+
+        Whole blocks that fit in the room left in b are decoded straight
+        into it, without intermediate strings.'''
+        self._check_closed()
+
+        if self.mode != READ:
+            import errno
+            raise IOError(errno.EBADF, "readinto() on write-only LzoFile object")
+
+        size = len(b)
+        n = 0
+        if self._buf_len:
+            data = self.read(min(size, self._buf_len))
+            b[:len(data)] = data
+            n = len(data)
+
+        while n < size and self._decoder is None:
+            header = self._read_block_header()
+            if header is None:
+                break
+
+            dst_len, src_len, d_adler32, c_adler32 = header
+            block = self._read(src_len)
+            self._check(block, c_adler32)
+
+            if dst_len <= size - n:
+                decompress_into(block, b, dst_len, n, self._restarts(header),
+                                self.threads)
+                self._check(b, d_adler32, n, dst_len)
+                n += dst_len
+                self.offset += dst_len
+                continue
+
+            # does not fit, keep the rest for the next read
+            block = self._decode_block(header, block)
+            if block:
+                self._buf.append(block)
+                self._buf_len += len(block)
+            data = self.read(size - n)
+            b[n:n + len(data)] = data
+            n += len(data)
+
+        if n < size and self._decoder is not None:
+            data = self.read(size - n)
+            b[n:n + len(data)] = data
+            n += len(data)
+
+        return n
+
     def read(self, size=-1):
         self._check_closed()
 
@@ -409,7 +659,7 @@ class LzoFile(io.BufferedIOBase):
             else:
                 break
 
-        to_read = self._buf_len if size == -1 else size
+        to_read = self._buf_len if size == -1 else min(size, self._buf_len)
         self.offset += to_read
         return self._read_from_buf(to_read)
 
@@ -417,9 +667,9 @@ class LzoFile(io.BufferedIOBase):
         bytes_write = 0
         off = 0
 
-        while off + BLOCK_SIZE < len(content):
-            block = content[off:off+BLOCK_SIZE]
-            off += BLOCK_SIZE
+        while off + self.block_size < len(content):
+            block = content[off:off+self.block_size]
+            off += self.block_size
             self._write_block(block)
             #print 1
         self._write_block(content[off:])
@@ -436,6 +686,9 @@ class LzoFile(io.BufferedIOBase):
         if self.fileobj is None:
             return
         
+        if self.mode == WRITE and self._index_path and self.index is not None:
+            self.index.save(self._index_path)
+
         if self.need_close:
             self.fileobj.close()
 
@@ -498,6 +751,9 @@ class LzoFile(io.BufferedIOBase):
         self._read_header()
 
         self._clear_buf()
+        self._decoder = None
+        self._eof = False
+        self._block = -1
         self.offset = 0
 
 
@@ -506,8 +762,1125 @@ class LzoFile(io.BufferedIOBase):
         return '<gzip ' + s[1:-1] + ' ' + hex(id(self)) + '>'
 
 
+class LzoIndex(object):
+    '''Where the blocks of an lzo file are. For every block: the offset of
+    its header in the file, the offset of its data in the uncompressed
+    content, dst_len, src_len and the list of (compressed offset,
+    uncompressed offset) restart points within the block, see
+    compress_block_restarts.
+
+    The index lives in a sidecar file (conventionally the .lzo name plus
+    INDEX_SUFFIX), so lzop and other readers never see it.'''
+
+    def __init__(self):
+        self.blocks = []
+        self._starts = []
+
+    def add(self, file_offset, data_offset, dst_len, src_len, restarts=()):
+        self.blocks.append((file_offset, data_offset, dst_len, src_len,
+                            list(restarts)))
+        self._starts.append(data_offset)
+
+    @property
+    def size(self):
+        '''uncompressed size of the whole file'''
+        if not self.blocks:
+            return 0
+        return self.blocks[-1][1] + self.blocks[-1][2]
+
+    def find(self, offset):
+        '''number of the block holding uncompressed offset'''
+        if not 0 <= offset < self.size:
+            raise IndexError('offset out of range')
+        return bisect.bisect_right(self._starts, offset) - 1
+
+    def save(self, filename):
+        out = [INDEX_MAGIC, struct.pack('>I', len(self.blocks))]
+        for file_offset, data_offset, dst_len, src_len, restarts in self.blocks:
+            out.append(struct.pack('>QQIII', file_offset, data_offset,
+                                   dst_len, src_len, len(restarts)))
+            for point in restarts:
+                out.append(struct.pack('>II', *point))
+        with __builtin__.open(filename, 'wb') as f:
+            f.write(b''.join(out))
+
+    @classmethod
+    def load(cls, filename):
+        with __builtin__.open(filename, 'rb') as f:
+            data = f.read()
+        if data[:len(INDEX_MAGIC)] != INDEX_MAGIC:
+            raise IOError('Wrong lzo index signature')
+        index = cls()
+        try:
+            pos = len(INDEX_MAGIC)
+            count, = struct.unpack_from('>I', data, pos)
+            pos += 4
+            for i in range(count):
+                entry = struct.unpack_from('>QQIII', data, pos)
+                pos += 28
+                restarts = [struct.unpack_from('>II', data, pos + 8 * j)
+                            for j in range(entry[4])]
+                pos += 8 * entry[4]
+                index.add(entry[0], entry[1], entry[2], entry[3], restarts)
+        except struct.error:
+            raise IOError('Truncated lzo index')
+        return index
+
+    @classmethod
+    def build(cls, filename):
+        '''index an existing lzo file by walking its block headers; there
+        are no restart points then'''
+        index = cls()
+        f = LzoFile(filename, 'rb', verify_checksum=False)
+        try:
+            data_offset = 0
+            while True:
+                pos = f.fileobj.tell()
+                header = f._read_block_header()
+                if header is None:
+                    break
+                f.fileobj.seek(header[1], 1)
+                index.add(pos, data_offset, header[0], header[1])
+                data_offset += header[0]
+        finally:
+            f.close()
+        return index
+
+def map(path, index=None, lazy=True):
+    '''The uncompressed content of the lzop file path as one read-only
+    buffer, an LzoMap: len(), indexing, slices, memoryview() and buffer()
+    work on it as on an mmap, and close() unmaps it.
+
+    With lazy, on Linux where a userfaultfd is allowed, only address space
+    is reserved and a block is decoded the first time one of its pages is
+    touched, so looking at a few places of a huge file is cheap. Elsewhere
+    everything is decoded into it at once on the thread pool; m.lazy
+    tells which. A bad block makes map() raise lzo.error when everything is
+    decoded at once; in a lazy map, indexing and slices that touch it raise
+    lzo.error. Read through memoryview() or buffer() its bytes are zeros,
+    as those can't report errors, and only m.stats['errors'] counts it.
+
+    A process forked after the map is made shares a map decoded at once,
+    copy on write, as a pre-forking server wants. A lazy map is not
+    inherited: touching it in the child is a segmentation fault, open the
+    map there instead, or with lazy=False before forking.
+
+    index is an LzoIndex or the path of one, by default path +
+    INDEX_SUFFIX if there is such a file, else the block headers are
+    walked.'''
+    index = _find_index(path, index)
+    with __builtin__.open(path, 'rb') as fileobj:
+        f = LzoFile(fileobj=fileobj, mode='rb')
+        return LzoMap(fileobj.fileno(), [entry[:4] for entry in index.blocks],
+                      f.flags, lazy)
+
+def _find_index(path, index):
+    '''the LzoIndex of the lzo file path: index itself, the one saved at
+    the path index, at path + INDEX_SUFFIX, or one built by walking it'''
+    import os
+    if index is None:
+        if os.path.exists(path + INDEX_SUFFIX):
+            index = path + INDEX_SUFFIX
+        else:
+            index = LzoIndex.build(path)
+    if isinstance(index, basestring):
+        index = LzoIndex.load(index)
+    return index
+
+# the BlockCache the LzoReaders of this process share with others
+_shared_cache = None
+
+def set_shared_cache(size, slot_size=SHARED_CACHE_SLOT, name=None):
+    '''Make LzoReader look for blocks in a BlockCache of size bytes in
+    shared memory before decoding them, and put there the ones it decodes.
+    Without name the cache is shared with the processes forked after this
+    call (the workers of a pre-fork server), with a name (like '/lzo') by
+    all that open it. Blocks larger than slot_size are not shared. Returns
+    the cache; size 0 stops sharing.'''
+    global _shared_cache
+    _shared_cache = BlockCache(size, slot_size, 0, name) if size else None
+    return _shared_cache
+
+def _file_id(fileobj):
+    '''64 bit id of an open file for a BlockCache, changes when the file
+    is replaced or modified'''
+    import hashlib
+    import os
+    st = os.fstat(fileobj.fileno())
+    key = '%d:%d:%d:%r' % (st.st_dev, st.st_ino, st.st_size, st.st_mtime)
+    return struct.unpack('>Q', hashlib.sha1(key).digest()[:8])[0]
+
+class ReaderStats(object):
+    '''Counters of an LzoReader. Block lookups are hits, found decoded in
+    the cache, or misses, decoded on demand; prefetch_hits are the hits on
+    a block the prefetcher decoded, and waits the lookups that waited for
+    it to finish one. Prefetched blocks that leave the cache, or are still
+    there at close, without having been read are wasted. shared_hits are
+    the misses another process had decoded, found in the shared cache.'''
+
+    def __init__(self):
+        self.hits = 0
+        self.misses = 0
+        self.shared_hits = 0
+        self.waits = 0
+        self.prefetched = 0
+        self.prefetch_hits = 0
+        self.wasted = 0
+
+    @property
+    def hit_rate(self):
+        lookups = self.hits + self.misses
+        return float(self.hits) / lookups if lookups else 0.0
+
+    @property
+    def waste_rate(self):
+        '''share of the prefetched blocks that were wasted'''
+        return float(self.wasted) / self.prefetched if self.prefetched else 0.0
+
+    def __repr__(self):
+        return ('<reader: %d hits, %d misses, %d shared hits, %d prefetched, '
+                '%d prefetch hits, %d wasted, %d waits>' % (
+                    self.hits, self.misses, self.shared_hits, self.prefetched,
+                    self.prefetch_hits, self.wasted, self.waits))
+
+class LzoReader(object):
+    '''Random access to the uncompressed content of an lzo file by its
+    index (see _find_index): read(offset, size) decodes only the blocks it
+    touches, and the last cache_blocks of them are kept.
+
+    The blocks read are watched for a pattern. Once PREFETCH_TRIGGER block
+    changes in a row have the same stride (1 for a sequential scan, more
+    for every nth record), the next prefetch blocks along it are decoded
+    by a thread of the reader on the pool, and kept that far ahead while
+    the pattern holds. A read off the pattern drops the prefetches not
+    started yet. stats (a ReaderStats) tells how well prefetch and
+    cache_blocks fit the workload.
+
+    Blocks missing from the cache are looked up in shared, a BlockCache
+    other processes fill as well, before they are decoded: True means the
+    one of set_shared_cache, if any, None none. The checksums of a block
+    are verified by the process that decodes it.'''
+
+    def __init__(self, filename, index=None, cache_blocks=READER_CACHE_BLOCKS,
+                 prefetch=PREFETCH_BLOCKS, verify_checksum=True, shared=True):
+        import collections
+        import threading
+        self.index = _find_index(filename, index)
+        self.size = self.index.size
+        self.cache_blocks = max(cache_blocks, 1)
+        self.prefetch = max(0, min(prefetch, self.cache_blocks - 1))
+        self.stats = ReaderStats()
+        self._filename = filename
+        self._verify_checksum = verify_checksum
+        self._file = LzoFile(filename, 'rb', verify_checksum=verify_checksum)
+        self._shared = _shared_cache if shared is True else shared
+        if self._shared is not None:
+            self._file_id = _file_id(self._file.fileobj)
+        self._cache = collections.OrderedDict()
+        self._unused = set()        # prefetched and not read yet
+        self._busy = set()          # being decoded by the prefetcher
+        self._queue = collections.deque()
+        self._cond = threading.Condition()
+        self._thread = None
+        self._closed = False
+        self._last = None
+        self._stride = 0
+        self._run = 0
+
+    def __len__(self):
+        return self.size
+
+    def __enter__(self):
+        return self
+
+    def __exit__(self, *exc):
+        self.close()
+
+    def read(self, offset, size=-1):
+        '''size bytes of the content from offset on, all the rest if size
+        is -1, fewer at the end'''
+        if self._closed:
+            raise ValueError('I/O operation on closed LzoReader')
+        end = self.size if size < 0 else min(offset + size, self.size)
+        parts = []
+        while offset < end:
+            k = self.index.find(offset)
+            start = offset - self.index.blocks[k][1]
+            part = self._block(k)[start:start + end - offset]
+            parts.append(part)
+            offset += len(part)
+        return b''.join(parts)
+
+    def close(self):
+        if self._closed:
+            return
+        with self._cond:
+            self._closed = True
+            self._queue.clear()
+            self._cond.notify_all()
+        if self._thread is not None:
+            self._thread.join()
+        self.stats.wasted += len(self._unused)
+        self._unused.clear()
+        self._cache.clear()
+        self._file.close()
+
+    def _block(self, k):
+        '''the decoded block k'''
+        with self._cond:
+            self._observe(k)
+            if k in self._busy:
+                self.stats.waits += 1
+                while k in self._busy:
+                    self._cond.wait()
+            data = self._cache.pop(k, None)
+            if data is not None:
+                self._cache[k] = data       # the newest now
+                self.stats.hits += 1
+                if k in self._unused:
+                    self._unused.discard(k)
+                    self.stats.prefetch_hits += 1
+                return data
+            self.stats.misses += 1
+            if k in self._queue:
+                self._queue.remove(k)   # not worth waiting for
+
+        data = self._shared_get(k)
+        if data is not None:
+            self.stats.shared_hits += 1
+        else:
+            header, block = self._fetch(self._file, k)
+            data = decompress_block(block, header[0]) if header[1] < header[0] else block
+            self._file._check(data, header[2])
+            self._shared_put(k, data)
+        with self._cond:
+            self._insert(k, data)
+        return data
+
+    def _fetch(self, f, k):
+        '''(header, compressed block) of block k, read with the LzoFile f'''
+        file_offset, data_offset, dst_len, src_len = self.index.blocks[k][:4]
+        f.fileobj.seek(file_offset)
+        f._eof = False
+        header = f._read_block_header()
+        if header is None or header[:2] != (dst_len, src_len):
+            raise IOError('lzo index does not match the file')
+        block = f._read(src_len)
+        f._check(block, header[3])
+        return header, block
+
+    def _shared_get(self, k):
+        if self._shared is None:
+            return None
+        return self._shared.get(self._file_id, k, self.index.blocks[k][2])
+
+    def _shared_put(self, k, data):
+        if self._shared is not None:
+            self._shared.put(self._file_id, k, data)
+
+    def _insert(self, k, data, prefetched=False):
+        self._cache[k] = data
+        if prefetched:
+            self._unused.add(k)
+        while len(self._cache) > self.cache_blocks:
+            # blocks read go first, the prefetched ones are still ahead
+            old = next((j for j in self._cache if j not in self._unused), None)
+            if old is None:
+                old = next(iter(self._cache))
+                self._unused.discard(old)
+                self.stats.wasted += 1
+            del self._cache[old]
+
+    def _observe(self, k):
+        '''follow the stride between the blocks read, queue the blocks
+        ahead along it once it repeats'''
+        if k == self._last:
+            return
+        stride = k - self._last if self._last is not None else 0
+        self._last = k
+        if stride and stride == self._stride:
+            self._run += 1
+        else:
+            self._stride = stride
+            self._run = 1 if stride else 0
+            self._queue.clear()     # the pattern broke
+        if not self.prefetch or self._run < PREFETCH_TRIGGER:
+            return
+
+        for i in range(1, self.prefetch + 1):
+            j = k + i * stride
+            if not 0 <= j < len(self.index.blocks):
+                break
+            if j not in self._cache and j not in self._busy and j not in self._queue:
+                self._queue.append(j)
+        if self._queue:
+            if self._thread is None:
+                import threading
+                self._thread = threading.Thread(target=self._prefetcher)
+                self._thread.daemon = True
+                self._thread.start()
+            self._cond.notify_all()
+
+    def _prefetcher(self):
+        f = LzoFile(self._filename, 'rb', verify_checksum=self._verify_checksum)
+        try:
+            while True:
+                with self._cond:
+                    while not self._queue and not self._closed:
+                        self._cond.wait()
+                    if self._closed:
+                        return
+                    batch = []
+                    while self._queue and len(batch) < self.prefetch:
+                        k = self._queue.popleft()
+                        if k not in self._cache and k not in self._busy:
+                            batch.append(k)
+                    self._busy.update(batch)
+
+                try:
+                    datas = [self._shared_get(k) for k in batch]
+                    todo = [i for i, data in enumerate(datas) if data is None]
+                    fetched = [self._fetch(f, batch[i]) for i in todo]
+                    packed = [(header, block) for header, block in fetched
+                              if header[1] < header[0]]
+                    decoded = iter(decompress_many([block for header, block in packed],
+                                                   [header[0] for header, block in packed]))
+                    for i, (header, block) in zip(todo, fetched):
+                        data = next(decoded) if header[1] < header[0] else block
+                        f._check(data, header[2])
+                        datas[i] = data
+                        self._shared_put(batch[i], data)
+                except Exception:
+                    # a bad block raises when it is read on demand
+                    datas = []
+
+                with self._cond:
+                    self._busy.difference_update(batch)
+                    for k, data in zip(batch, datas):
+                        if k not in self._cache:
+                            self._insert(k, data, prefetched=True)
+                            self.stats.prefetched += 1
+                    self._cond.notify_all()
+        finally:
+            f.close()
+
+
+# Process pool backend for compress_file/decompress_file. Blocks travel
+# through shared anonymous mmaps (or the mmap of the destination) that the
+# workers inherit when the pool forks; only offsets, lengths and checksums
+# are pickled.
+
+_mp_in = None
+_mp_out = None
+
+def _mp_compress(args):
+    off, length, out_off, method, level = args
+    block = buffer(_mp_in, off, length)
+    compressed = compress_block(block, method, level)
+    if len(compressed) < length:
+        _mp_out[out_off:out_off + len(compressed)] = compressed
+    return (len(compressed), lzo_adler32(block, ADLER32_INIT_VALUE),
+            lzo_adler32(compressed, ADLER32_INIT_VALUE))
+
+def _mp_decompress(args):
+    off, src_len, dst_off, dst_len, d_adler32, c_adler32, verify = args
+    block = buffer(_mp_in, off, src_len)
+    if verify and c_adler32 is not None:
+        assert lzo_adler32(block, ADLER32_INIT_VALUE) == c_adler32
+    decompress_into(block, _mp_out, dst_len, dst_off)
+    if verify and d_adler32 is not None:
+        assert lzo_adler32(_mp_out, ADLER32_INIT_VALUE, dst_off, dst_len) == d_adler32
+
+def _mp_run(processes, slots, submit, complete):
+    '''Feed tasks from submit(slot) to a pool of processes, at most slots at
+    once, and hand the results to complete(slot, result) in submission
+    order. submit returns None when there is no more work.'''
+    import collections
+    import multiprocessing
+
+    pool = multiprocessing.Pool(processes)
+    try:
+        pending = collections.deque()
+        slot = 0
+        while True:
+            if len(pending) == slots:
+                done_slot, result = pending.popleft()
+                complete(done_slot, result.get())
+            task = submit(slot)
+            if task is None:
+                break
+            pending.append((slot, pool.apply_async(task[0], (task[1],))))
+            slot = (slot + 1) % slots
+        while pending:
+            done_slot, result = pending.popleft()
+            complete(done_slot, result.get())
+        pool.close()
+    finally:
+        pool.terminate()
+        pool.join()
+
+class _Holes(object):
+    '''The holes of a sparse file, found with lseek(SEEK_DATA/SEEK_HOLE)
+    one data extent at a time as the blocks go by. Where the system or
+    the file system can't tell, the whole file is data.'''
+
+    END = 1 << 63
+
+    def __init__(self, fd):
+        self.fd = fd
+        # no data in [queried offset, data), then data up to hole
+        self.data = self.hole = 0
+
+    def cover(self, offset, end):
+        '''whether [offset, end) lies in a hole'''
+        import errno
+        import os
+        if offset >= self.hole:
+            try:
+                self.data = os.lseek(self.fd, offset, SEEK_DATA)
+                self.hole = os.lseek(self.fd, self.data, SEEK_HOLE)
+            except OSError, e:
+                if e.errno == errno.ENXIO:
+                    # only a hole from offset on
+                    self.data = self.hole = self.END
+                elif e.errno == errno.EINVAL:
+                    self.data, self.hole = offset, self.END
+                else:
+                    raise
+        return end <= self.data
+
+def _file_blocks(fin):
+    '''(length, block) for the BLOCK_SIZE blocks of fin, block None for
+    those that lie in a hole and are not read'''
+    import os
+    holes = None
+    size = 0
+    if 'SEEK_DATA' in globals():
+        holes = _Holes(fin.fileno())
+        size = os.fstat(fin.fileno()).st_size
+    offset = 0
+    while True:
+        length = min(BLOCK_SIZE, size - offset)
+        if length > 0 and holes.cover(offset, offset + length):
+            yield length, None
+            offset += length
+            continue
+        if holes is not None:
+            fin.seek(offset)    # lseek moved the descriptor
+        block = fin.read(BLOCK_SIZE)
+        if not block:
+            return
+        yield len(block), block
+        offset += len(block)
+
+def _write_hole(out, length, holes):
+    '''write length zero bytes as a block, compressed once per length into
+    the dict holes'''
+    if length not in holes:
+        zeros = b'\0' * length
+        compressed = compress_block(zeros, out.method, out.level)
+        if len(compressed) >= length:
+            compressed = zeros
+        holes[length] = (compressed,
+                         (lzo_adler32(zeros, ADLER32_INIT_VALUE), zlib.crc32(zeros) & 0xffffffffL),
+                         (lzo_adler32(compressed, ADLER32_INIT_VALUE),
+                          zlib.crc32(compressed) & 0xffffffffL))
+    compressed, d_sums, c_sums = holes[length]
+    out._write_block_sums(length, compressed, d_sums, c_sums)
+
+def compress_file(src, dst, processes=None, threads=None, level=None, aio=False,
+                  nocache=False):
+    '''Compress the file src into the lzop file dst, with the compresslevel
+    level of LzoFile.
+
+    With processes > 1, blocks are compressed by a pool of worker processes
+    and written in order.  With threads > 1, batches of blocks are
+    compressed by the thread pool of _lzo instead (see set_pool_size).
+
+    Without processes or aio, the holes of a sparse src are found with
+    lseek(SEEK_DATA/SEEK_HOLE): blocks that lie in one are not read but
+    written as a zero block compressed once, the same bytes a full read
+    would give.
+
+    With aio, the blocks are read and written by compress_fd, AIO_DEPTH at
+    a time on an io_uring where there is one (aio='pread' never uses it),
+    and compressed on threads threads of the pool (all of it by default)
+    meanwhile. Levels 7-9 with liblzo are not supported there and take the
+    paths above.
+
+    nocache keeps a large conversion from filling the page cache: src and
+    dst are written back and dropped from it NOCACHE_WINDOW bytes at a
+    time behind the blocks in flight. It implies aio='pread' unless aio is
+    given; levels 7-9 with liblzo ignore it.'''
+    import os
+    if nocache and not aio:
+        aio = 'pread'
+    with __builtin__.open(src, 'rb') as fin:
+        with LzoFile(filename=dst, mode='wb', compresslevel=level) as out:
+            if aio and (out.method == 1 or out.level >= OPT_LEVEL):
+                out.fileobj.flush()
+                end = compress_fd(fin.fileno(), out.fileobj.fileno(),
+                                  os.fstat(fin.fileno()).st_size, out.fileobj.tell(),
+                                  BLOCK_SIZE, out.method, out.level, threads or pool_size(),
+                                  AIO_DEPTH, aio != 'pread', NOCACHE_WINDOW if nocache else 0)
+                out.fileobj.seek(end)
+            elif processes and processes > 1:
+                _compress_file_mp(fin, out, processes)
+            elif threads and threads > 1:
+                _compress_file_threads(fin, out, threads)
+            else:
+                holes = {}
+                for length, block in _file_blocks(fin):
+                    if block is None:
+                        _write_hole(out, length, holes)
+                    else:
+                        out._write_block(block)
+            out._write32(0)
+
+def _compress_file_threads(fin, out, threads):
+    batch = 4 * threads
+    source = _file_blocks(fin)
+    holes = {}
+    while True:
+        blocks = list(itertools.islice(source, batch))
+        if not blocks:
+            break
+
+        data = [block for length, block in blocks if block is not None]
+        packed = iter(compress_many(data, out.method, out.level, threads))
+        for length, block in blocks:
+            if block is None:
+                _write_hole(out, length, holes)
+                continue
+            compressed = next(packed)
+            out._write32(len(block))
+            d_adler32 = lzo_adler32(block, ADLER32_INIT_VALUE)
+            if len(compressed) < len(block):
+                out._write_block_data(d_adler32, compressed,
+                                      lzo_adler32(compressed, ADLER32_INIT_VALUE))
+            else:
+                out._write_block_data(d_adler32, block, None)
+
+def _compress_file_mp(fin, out, processes):
+    global _mp_in, _mp_out
+
+    slots = 2 * processes
+    out_size = BLOCK_SIZE + BLOCK_SIZE // 16 + 64 + 3
+    lengths = [0] * slots
+
+    def submit(slot):
+        block = fin.read(BLOCK_SIZE)
+        if not block:
+            return None
+        _mp_in[slot * BLOCK_SIZE:slot * BLOCK_SIZE + len(block)] = block
+        lengths[slot] = len(block)
+        return _mp_compress, (slot * BLOCK_SIZE, len(block), slot * out_size,
+                              out.method, out.level)
+
+    def complete(slot, result):
+        c_len, d_adler32, c_adler32 = result
+        length = lengths[slot]
+        out._write32(length)
+        if c_len < length:
+            out._write_block_data(d_adler32, buffer(_mp_out, slot * out_size, c_len),
+                                  c_adler32)
+        else:
+            out._write_block_data(d_adler32, buffer(_mp_in, slot * BLOCK_SIZE, length),
+                                  None)
+
+    _mp_in = mmap.mmap(-1, slots * BLOCK_SIZE)
+    _mp_out = mmap.mmap(-1, slots * out_size)
+    try:
+        _mp_run(processes, slots, submit, complete)
+    finally:
+        _mp_in.close()
+        _mp_out.close()
+        _mp_in = _mp_out = None
+
+def decompress_file(src, dst, verify_checksum=True, processes=None, aio=False,
+                    threads=None, nocache=False):
+    '''Decompress the lzop file src into the file dst, returns its size.
+
+    Block headers are scanned first to size dst, which is then written
+    through an mmap: every block is read into one reusable buffer and
+    decoded straight into the mapping, so memory use is about one
+    compressed block plus the destination pages.
+
+    With processes > 1, blocks are decoded by a pool of worker processes
+    that write into the same mapping.
+
+    With aio, the scan also lists the blocks and decompress_fd reads,
+    decodes (on threads threads of the pool, all of it by default) and
+    writes them, AIO_DEPTH at a time, with plain file I/O instead of the
+    mapping; on an io_uring where there is one, aio='pread' never uses
+    it. nocache is as for compress_file, and takes that path too.'''
+    if nocache and not aio:
+        aio = 'pread'
+    with __builtin__.open(src, 'rb') as fileobj:
+        f = LzoFile(fileobj=fileobj, mode='rb', verify_checksum=verify_checksum)
+
+        start = fileobj.tell()
+        total = 0
+        max_src_len = 0
+        blocks = []
+        while True:
+            header = f._read_block_header()
+            if header is None:
+                break
+            if aio:
+                dst_len, src_len, d_adler32, c_adler32 = header
+                if not verify_checksum:
+                    d_adler32 = c_adler32 = None
+                blocks.append((fileobj.tell(), src_len, total, dst_len,
+                               c_adler32, d_adler32))
+            total += header[0]
+            max_src_len = max(max_src_len, header[1])
+            fileobj.seek(header[1], 1)
+        fileobj.seek(start)
+        f._eof = False
+
+        with __builtin__.open(dst, 'w+b') as out:
+            if total == 0:
+                return 0
+            out.truncate(total)
+            if aio:
+                decompress_fd(fileobj.fileno(), out.fileno(), blocks,
+                              threads or pool_size(), AIO_DEPTH, aio != 'pread',
+                              NOCACHE_WINDOW if nocache else 0)
+                return total
+            mm = mmap.mmap(out.fileno(), total)
+            try:
+                if processes and processes > 1:
+                    _decompress_file_mp(f, mm, max_src_len, processes)
+                    return total
+
+                buf = bytearray(max_src_len)
+                offset = 0
+                while True:
+                    header = f._read_block_header()
+                    if header is None:
+                        break
+
+                    dst_len, src_len, d_adler32, c_adler32 = header
+                    block = memoryview(buf)[:src_len]
+                    if fileobj.readinto(block) != src_len:
+                        raise IOError, 'Truncated lzo file'
+                    f._check(block, c_adler32)
+
+                    decompress_into(block, mm, dst_len, offset)
+                    f._check(mm, d_adler32, offset, dst_len)
+                    offset += dst_len
+            finally:
+                mm.close()
+
+    return total
+
+def _decompress_file_mp(f, mm, max_src_len, processes):
+    global _mp_in, _mp_out
+
+    slots = 2 * processes
+    offset = [0]
+
+    def submit(slot):
+        header = f._read_block_header()
+        if header is None:
+            return None
+        dst_len, src_len, d_adler32, c_adler32 = header
+        _mp_in[slot * max_src_len:slot * max_src_len + src_len] = f._read(src_len)
+        task = (slot * max_src_len, src_len, offset[0], dst_len,
+                d_adler32, c_adler32, f.verify_checksum)
+        offset[0] += dst_len
+        return _mp_decompress, task
+
+    def complete(slot, result):
+        pass
+
+    _mp_in = mmap.mmap(-1, slots * max_src_len)
+    _mp_out = mm
+    try:
+        _mp_run(processes, slots, submit, complete)
+    finally:
+        _mp_in.close()
+        _mp_in = _mp_out = None
+
+# Directory batch compression. Files up to TREE_PIECE_SIZE are one task
+# each, larger ones are cut into pieces of that size whose blocks come back
+# to the parent to be written in order. The largest files are started
+# first, so the pool drains evenly instead of ending on one big file, and
+# the pieces of a file are queued together so few are open at a time.
+
+TREE_PIECE_SIZE = (4*1024*1024L)
+
+def _tree_compress(task):
+    '''compress a whole file, or return the blocks of a piece of one as
+    (dst_len, data, d_adler32, c_adler32)'''
+    src, dst, off, length, size, level = task
+    if off is None:
+        compress_file(src, dst, level=level)
+        return task, None
+    method, level = _method_level(level)
+    blocks = []
+    with __builtin__.open(src, 'rb') as f:
+        f.seek(off)
+        while length > 0:
+            block = f.read(min(BLOCK_SIZE, length))
+            if not block:
+                break
+            length -= len(block)
+            compressed = compress_block(block, method, level)
+            if len(compressed) >= len(block):
+                compressed = block
+            blocks.append((len(block), compressed, lzo_adler32(block, ADLER32_INIT_VALUE),
+                           lzo_adler32(compressed, ADLER32_INIT_VALUE)))
+    return task, blocks
+
+def compress_tree(src, dst=None, processes=None, level=None):
+    '''Compress every file under the directory src, except .lzo files, into
+    a .lzo file of its own: next to it, or at the same place under dst.
+    All files share one pool of processes (one per CPU by default); big
+    files are cut into TREE_PIECE_SIZE pieces and small ones are whole
+    tasks, largest first. level is the compresslevel of LzoFile. Returns
+    the paths written.'''
+    tasks, outputs = _tree_tasks(src, dst, level)
+    _tree_run(tasks, processes)
+    return outputs
+
+def _tree_tasks(src, dst, level):
+    '''the tasks of compress_tree in the order they are queued, and the
+    paths they write'''
+    import os
+
+    tasks = []
+    outputs = []
+    for root, dirs, files in os.walk(src):
+        dirs.sort()
+        out_dir = root if dst is None else os.path.join(dst, os.path.relpath(root, src))
+        for name in sorted(files):
+            path = os.path.join(root, name)
+            if name.endswith('.lzo') or not os.path.isfile(path):
+                continue
+            if not os.path.isdir(out_dir):
+                os.makedirs(out_dir)
+            out = os.path.join(out_dir, name + '.lzo')
+            size = os.path.getsize(path)
+            outputs.append(out)
+            if size <= TREE_PIECE_SIZE:
+                tasks.append((path, out, None, size, size, level))
+                continue
+            for off in range(0, size, TREE_PIECE_SIZE):
+                tasks.append((path, out, off, min(TREE_PIECE_SIZE, size - off),
+                              size, level))
+    # largest file first; the sort is stable, so the pieces of a file stay
+    # together and in order
+    tasks.sort(key=lambda task: -task[4])
+    return tasks, outputs
+
+def _tree_run(tasks, processes):
+    '''run the tasks of _tree_tasks and write the pieces of split files; a
+    file is finished at the size it had when it was scanned, even if it
+    grew since'''
+    import multiprocessing
+
+    writers = {}
+    pending = {}
+    pool = multiprocessing.Pool(processes)
+    try:
+        results = pool.imap_unordered(_tree_compress, tasks)
+        for task, blocks in results:
+            path, out, off, length, size, level = task
+            if off is None:
+                continue
+            if out not in writers:
+                writers[out] = [LzoFile(filename=out, mode='wb', compresslevel=level), 0, size]
+            pending[out, off] = blocks
+            writer = writers[out]
+            while (out, writer[1]) in pending:
+                for dst_len, data, d_adler32, c_adler32 in pending.pop((out, writer[1])):
+                    writer[0]._write_block_sums(dst_len, data, (d_adler32, None),
+                                                (c_adler32, None))
+                writer[1] += TREE_PIECE_SIZE
+            if writer[1] >= writer[2]:
+                writer[0]._write32(0)
+                writer[0].close()
+                del writers[out]
+        pool.close()
+    finally:
+        pool.terminate()
+        pool.join()
+        for writer in writers.values():
+            writer[0].close()
+
+def recompress(src, dst, level=OPT_LEVEL, threads=None,
+               min_gain=RECOMPRESS_MIN_GAIN, index=None, verify_checksum=True):
+    '''Re-encode the lzo file src, say one written fast with LZO1X-1, into
+    dst with the compresslevel level of LzoFile; returns the sizes of src
+    and dst.
+
+    Blocks are read and decoded in batches of about RECOMPRESS_BATCH bytes
+    and compressed again by threads threads of the pool (all of it by
+    default). A block is only replaced when the new one is at least
+    min_gain smaller, otherwise its bytes and checksums are copied as
+    they are. dst keeps the flags of src, so every checksum src has is
+    written, and its index (see LzoIndex) is saved to index, dst plus
+    INDEX_SUFFIX by default.'''
+    import os
+
+    if threads is None:
+        threads = pool_size()
+    if index is None:
+        index = dst + INDEX_SUFFIX
+    with __builtin__.open(src, 'rb') as fin:
+        f = LzoFile(fileobj=fin, mode='rb', verify_checksum=verify_checksum)
+        with LzoFile(filename=dst, mode='wb', compresslevel=level,
+                     index=index) as out:
+            out._copy_header(f)
+            while _recompress_batch(f, out, threads, min_gain):
+                pass
+            out._write32(0)
+            out_size = out.fileobj.tell()
+        return os.fstat(fin.fileno()).st_size, out_size
+
+def _recompress_batch(f, out, threads, min_gain):
+    '''re-encode the next blocks of f into out, returns False at the end'''
+    batch = []
+    size = 0
+    while size < RECOMPRESS_BATCH:
+        header = f._read_block_header()
+        if header is None:
+            break
+        dst_len, src_len, d_adler32, c_adler32 = header
+        block = f._read(src_len)
+        if len(block) != src_len:
+            raise IOError, 'Truncated lzo file'
+        f._check(block, c_adler32)
+        data = decompress_block(block, dst_len) if src_len < dst_len else block
+        f._check(data, d_adler32)
+        batch.append((header, f._block_crc32, block, data))
+        size += dst_len
+    if not batch:
+        return False
+
+    blocks = [data for header, crc32s, block, data in batch]
+    for (header, crc32s, block, data), compressed in zip(
+            batch, compress_many(blocks, out.method, out.level, threads)):
+        dst_len, src_len, d_adler32, c_adler32 = header
+        if len(compressed) <= src_len * (1 - min_gain) and len(compressed) < dst_len:
+            block = compressed
+            c_adler32 = lzo_adler32(compressed, ADLER32_INIT_VALUE)
+            crc32s = (crc32s[0], zlib.crc32(compressed) & 0xffffffffL)
+        out._write_block_sums(dst_len, block, (d_adler32, crc32s[0]),
+                              (c_adler32, crc32s[1]))
+    return True
+
+# Transcoding between gzip and lzop: zlib runs on one thread and the lzo
+# side on the thread pool, with batches of blocks passing between them
+# through bounded queues, so only a few batches are ever in memory.
+
+TRANSCODE_CHUNK = (1024*1024L)
+
+class TranscodeStage(object):
+    '''One stage of a transcode: the uncompressed bytes it handled and the
+    seconds it spent working rather than waiting on its neighbours. The
+    stage with the lowest rate is the bottleneck.'''
+
+    def __init__(self, name):
+        self.name = name
+        self.bytes = 0
+        self.busy = 0.0
+
+    @property
+    def rate(self):
+        '''bytes per second of work'''
+        return self.bytes / self.busy if self.busy else 0.0
+
+    def __repr__(self):
+        return '<%s: %d bytes in %.3fs, %.1f MB/s>' % (
+            self.name, self.bytes, self.busy, self.rate / 1e6)
+
+def _pipeline(source, steps, depth):
+    '''Run source, a (name, iterator) pair, and steps, (name, function)
+    pairs, each on a thread of its own with queues of depth items between
+    them. Items are (size, payload), every function maps a payload to the
+    next one. Returns the TranscodeStages, re-raises the first error.'''
+    import Queue
+    import sys
+    import threading
+    import time
+
+    end = object()
+    errors = []
+    stages = [TranscodeStage(name) for name, fn in [source] + steps]
+    queues = [Queue.Queue(depth) for step in steps]
+
+    def produce():
+        items = iter(source[1])
+        try:
+            while not errors:
+                start = time.time()
+                item = next(items, end)
+                stages[0].busy += time.time() - start
+                if item is end:
+                    break
+                stages[0].bytes += item[0]
+                queues[0].put(item)
+        except Exception:
+            errors.append(sys.exc_info())
+        queues[0].put(end)
+
+    def consume(k):
+        fn = steps[k][1]
+        while True:
+            item = queues[k].get()
+            if item is end:
+                break
+            if errors:
+                continue        # drain, so the stage before never blocks
+            try:
+                start = time.time()
+                payload = fn(item[1])
+                stages[k + 1].busy += time.time() - start
+                stages[k + 1].bytes += item[0]
+                if k + 1 < len(steps):
+                    queues[k + 1].put((item[0], payload))
+            except Exception:
+                errors.append(sys.exc_info())
+        if k + 1 < len(steps):
+            queues[k + 1].put(end)
+
+    threads = [threading.Thread(target=produce)]
+    threads += [threading.Thread(target=consume, args=(k,))
+                for k in range(len(steps))]
+    for t in threads:
+        t.daemon = True
+        t.start()
+    for t in threads:
+        t.join()
+    if errors:
+        raise errors[0][0], errors[0][1], errors[0][2]
+    return stages
+
+def _inflate_blocks(fin, batch):
+    '''the content of the gzip file fin, which may have several members,
+    as batches of batch blocks of BLOCK_SIZE bytes'''
+    d = zlib.decompressobj(16 + zlib.MAX_WBITS)
+    blocks = []
+    block = b''
+    chunk = fin.read(TRANSCODE_CHUNK)
+    member = bool(chunk)                # a member has been started
+    while True:
+        if chunk:
+            block += d.decompress(chunk, BLOCK_SIZE - len(block))
+            if d.unused_data:           # another member follows
+                # (checked first, unconsumed_tail may hold it as well)
+                chunk = d.unused_data
+                d = zlib.decompressobj(16 + zlib.MAX_WBITS)
+            elif d.unconsumed_tail:
+                chunk = d.unconsumed_tail
+            else:
+                chunk = fin.read(TRANSCODE_CHUNK)
+        if not chunk and member:
+            # no d.eof before Python 3.3: input past the end of a member is
+            # left in unused_data, in a member cut short it is taken in.
+            # This also returns what max_length held back
+            try:
+                block += d.decompress(b'\0')
+            except zlib.error:
+                pass
+            if not d.unused_data:
+                raise IOError, 'Truncated gzip file'
+        while len(block) >= BLOCK_SIZE or block and not chunk:
+            blocks.append(block[:BLOCK_SIZE])
+            block = block[BLOCK_SIZE:]
+        if len(blocks) >= batch or blocks and not chunk:
+            yield sum(len(b) for b in blocks), blocks
+            blocks = []
+        if not chunk:
+            return
+
+def gzip_to_lzo(src, dst, threads=None, level=None, depth=4):
+    '''Transcode the gzip file src into the lzop file dst, with the
+    compresslevel level of LzoFile. Inflating runs on one thread while the
+    blocks are compressed on threads threads of the pool (all of it by
+    default). Returns the TranscodeStages inflate, compress and write.'''
+    if threads is None:
+        threads = pool_size()
+    batch = 4 * max(threads, 1)
+    with __builtin__.open(src, 'rb') as fin:
+        with LzoFile(filename=dst, mode='wb', compresslevel=level) as out:
+            def compress(blocks):
+                return zip(blocks, compress_many(blocks, out.method, out.level,
+                                                 threads))
+
+            def write(pairs):
+                for block, compressed in pairs:
+                    d_adler32 = lzo_adler32(block, ADLER32_INIT_VALUE)
+                    if len(compressed) >= len(block):
+                        compressed = block
+                    out._write_block_sums(len(block), compressed, (d_adler32, None),
+                                          (lzo_adler32(compressed, ADLER32_INIT_VALUE), None))
+
+            stages = _pipeline(('inflate', _inflate_blocks(fin, batch)),
+                               [('compress', compress), ('write', write)], depth)
+            out._write32(0)
+    return stages
+
+def _read_blocks(f, batch):
+    '''the blocks of the lzo file f, being read, as batches of batch
+    (header, block) pairs'''
+    while True:
+        blocks = []
+        while len(blocks) < batch:
+            header = f._read_block_header()
+            if header is None:
+                break
+            block = f._read(header[1])
+            if len(block) != header[1]:
+                raise IOError, 'Truncated lzo file'
+            blocks.append((header, block))
+        if not blocks:
+            return
+        yield sum(header[0] for header, block in blocks), blocks
+
+def lzo_to_gzip(src, dst, threads=None, level=6, depth=4, verify_checksum=True):
+    '''Transcode the lzop file src into the gzip file dst, deflating at
+    zlib level level on one thread while blocks are decompressed on
+    threads threads of the pool. Returns the TranscodeStages read,
+    decompress and deflate.'''
+    if threads is None:
+        threads = pool_size()
+    batch = 4 * max(threads, 1)
+    with __builtin__.open(src, 'rb') as fin:
+        f = LzoFile(fileobj=fin, mode='rb', verify_checksum=verify_checksum)
+        with __builtin__.open(dst, 'wb') as fout:
+            c = zlib.compressobj(level, zlib.DEFLATED, 16 + zlib.MAX_WBITS)
+
+            def decompress(blocks):
+                packed = [(header, block) for header, block in blocks
+                          if header[1] < header[0]]
+                for header, block in packed:
+                    f._check(block, header[3])
+                decoded = iter(decompress_many([block for header, block in packed],
+                                               [header[0] for header, block in packed],
+                                               threads))
+                datas = []
+                for header, block in blocks:
+                    data = next(decoded) if header[1] < header[0] else block
+                    f._check(data, header[2])
+                    datas.append(data)
+                return datas
+
+            def deflate(datas):
+                for data in datas:
+                    fout.write(c.compress(data))
+
+            stages = _pipeline(('read', _read_blocks(f, batch)),
+                               [('decompress', decompress), ('deflate', deflate)], depth)
+            fout.write(c.flush())
+    return stages
+
 def test():
     import os
+    import time
     data = os.urandom(2*1024*1024)
 
     f = LzoFile(filename = 'test.lzo', mode='wb')
@@ -522,6 +1895,543 @@ def test():
     f.close()
     assert data == b''.join([part1, part2, part3])
 
+    # streaming: a match whose source wraps the 64 KiB window, read in
+    # one go and in uneven pieces, then a file fed a few bytes at a time
+    # so the reads split block headers and matches
+    noise = data[:40000]
+    sample = data[100000:130000] + noise + noise + b''.join(b'%d,' % i for i in range(50000))
+    block = compress_block(sample, 3, OPT_LEVEL)
+    d = BlockDecoder(block, len(sample))
+    assert d.read(70001) + d.read() == sample and d.eof
+    d = BlockDecoder(block, len(sample))
+    parts = []
+    n = 1
+    while not d.eof:
+        parts.append(d.read(n))
+        n = n * 7 % 1000 + 1
+    assert b''.join(parts) == sample
+
+    class Trickle(io.RawIOBase):
+        def __init__(self, raw):
+            self.raw = raw
+            self.n = 0
+        def readable(self):
+            return True
+        def readinto(self, b):
+            self.n = self.n % 13 + 1
+            chunk = self.raw.read(min(len(b), self.n))
+            b[:len(chunk)] = chunk
+            return len(chunk)
+
+    f = LzoFile(filename='test.lzo', mode='wb', block_size=300000)
+    f.write(sample + data[:5000] + sample)
+    f.close()
+    for threshold in (STREAM_THRESHOLD, 1000):
+        with __builtin__.open('test.lzo', 'rb') as raw:
+            f = LzoFile(fileobj=io.BufferedReader(Trickle(raw), 16), mode='rb',
+                        stream_threshold=threshold)
+            parts = []
+            n = 1
+            while True:
+                part = f.read(n)
+                if not part:
+                    break
+                parts.append(part)
+                n = n * 7 % 1000 + 1
+            assert b''.join(parts) == sample + data[:5000] + sample
+    print('stream done')
+
+    # decompress_into: exact room, at an offset, through a memoryview,
+    # a stored block; too little room raises and leaves the buffer alone
+    block = compress_block(sample, 1, 1)
+    buf = bytearray(len(sample))
+    assert decompress_into(block, buf, len(sample)) == len(sample)
+    assert buf == sample
+    buf = bytearray(b'-' * (len(sample) + 7))
+    decompress_into(block, memoryview(buf), len(sample), 5)
+    assert buf[:5] == b'-' * 5 and buf[5:-2] == sample and buf[-2:] == b'--'
+    decompress_into(data[:1000], buf, 1000, 3)
+    assert buf[3:1003] == data[:1000]
+    for room, offset in ((len(sample) - 1, 0), (len(sample) + 10, 11)):
+        buf = bytearray(b'-' * room)
+        try:
+            decompress_into(block, buf, len(sample), offset)
+        except ValueError:
+            assert buf == b'-' * room
+        else:
+            raise AssertionError('decoded past the end of the buffer')
+    try:
+        decompress_into(block, bytearray(len(sample)), len(sample) - 1)
+    except error:
+        pass
+    else:
+        raise AssertionError('wrong dst_len accepted')
+
+    # LzoFile.readinto: the whole file in one exact buffer, then in uneven
+    # pieces through memoryview slices, the last one short
+    expected = sample + data[:5000] + sample
+    f = LzoFile(filename='test.lzo', mode='rb')
+    buf = bytearray(len(expected))
+    assert f.readinto(buf) == len(expected) and buf == expected
+    assert f.readinto(bytearray(10)) == 0
+    f.close()
+    f = LzoFile(filename='test.lzo', mode='rb')
+    buf = bytearray(400000)
+    view = memoryview(buf)
+    parts = []
+    size = 1
+    while True:
+        n = f.readinto(view[:size])
+        if not n:
+            break
+        parts.append(bytes(buf[:n]))
+        size = size * 37 % 400000 + 1
+    f.close()
+    assert b''.join(parts) == expected
+    print('readinto done')
+
+    # in-place decoding, the tails of these blocks barely compress
+    for size in (0, 1, 100, 4096, 65536, 300000):
+        noise = data[:size]
+        half = size // 2
+        for sample in (noise, b'\0' * half + noise[half:],
+                       b''.join(noise[i:i + 5] + b'abcd' for i in range(0, size, 9))[:size]):
+            for threads in (1, 4):
+                block = compress_block(sample, 1, 1, threads)
+                if len(block) >= size:
+                    block = sample   # stored, as LzoFile writes it
+                buf = bytearray(size + inplace_margin(size))
+                buf[len(buf) - len(block):] = block
+                assert decompress_inplace(buf, len(block), size) == size
+                assert buf[:size] == sample
+                # with less room the block either still decodes or is refused
+                # and the buffer left as it was; down to the least room that
+                # decodes, one byte less is refused
+                lo, hi = max(size, len(block)), size + inplace_margin(size)
+                while lo < hi:
+                    mid = (lo + hi) // 2
+                    buf = bytearray(mid)
+                    buf[mid - len(block):] = block
+                    try:
+                        decompress_inplace(buf, len(block), size)
+                        assert buf[:size] == sample
+                        hi = mid
+                    except error:
+                        assert buf[:mid - len(block)] == b'\0' * (mid - len(block))
+                        assert buf[mid - len(block):] == block
+                        lo = mid + 1
+                for room in (lo - 1, lo):
+                    if room < max(size, len(block)):
+                        continue
+                    buf = bytearray(room)
+                    buf[room - len(block):] = block
+                    before = bytes(buf)
+                    try:
+                        decompress_inplace(buf, len(block), size)
+                        assert room == lo and buf[:size] == sample
+                    except error:
+                        assert room < lo and buf == before
+    print('in-place done')
+
+    # segments joined where literal runs merge: runs at the 18/19 and
+    # 255/256 steps of their headers, and runs across whole segments of
+    # literals, on one thread and several
+    seg = 49152
+    pieces = []
+    for k, (head, tail) in enumerate(((4, 3), (18, 19), (19, 18), (255, 273), (274, 530),
+                                      (20000, 256), (seg, 0), (seg, 0), (1, 20000))):
+        noise = data[k * seg:(k + 1) * seg]
+        if head == seg:
+            pieces.append(noise)
+        else:
+            pieces.append(noise[:head] + b'\0' * (seg - head - tail) + noise[head:head + tail])
+    sample = b''.join(pieces) + data[:100]
+    for threads in (1, 4):
+        block, restarts = compress_block_restarts(sample, seg, threads)
+        assert decompress_block(block, len(sample)) == sample
+        buf = bytearray(len(sample))
+        decompress_into(block, buf, len(sample), 0, restarts, 4)
+        assert buf == sample
+    print('segments done')
+
+    # the suffix array encoder, through LzoFile and the thread pool
+    text = b''.join(b'%d lines of %x\n' % (i, i * i) for i in range(100000))
+    f = LzoFile(filename='test.lzo', mode='wb', compresslevel=OPT_LEVEL)
+    f.write(text)
+    f.close()
+    f = LzoFile(filename='test.lzo', mode='rb')
+    assert f.method == 3 and f.read() == text
+    f.close()
+    blocks = [text[i:i + 65536] for i in range(0, 300000, 65536)] + [b'', data[:1000]]
+    for block, compressed in zip(blocks, compress_many(blocks, 3, OPT_LEVEL, 4)):
+        assert compressed == compress_block(block, 3, OPT_LEVEL)
+        assert decompress_block(compressed, len(block)) == block
+    assert len(compress_block(text, 3, OPT_LEVEL)) < len(compress_block(text, 1, 1))
+    print('level %d done' % OPT_LEVEL)
+
+    # restart points: the block decodes from each of them on its own, the
+    # same on any number of threads, the index keeps them through save and
+    # load, and LzoFile decodes its blocks from them in parallel
+    sample = text[:700000] + data[:100000]
+    block, restarts = compress_block_restarts(sample, 49152, 4)
+    assert (block, restarts) == compress_block_restarts(sample, 49152, 1)
+    assert len(restarts) > 4 and restarts[0] == (0, 0)
+    for c_off, d_off in restarts:
+        assert decompress_block(block[c_off:], len(sample) - d_off) == sample[d_off:]
+    buf = bytearray(len(sample))
+    decompress_into(block, buf, len(sample), 0, restarts, 4)
+    assert buf == decompress_block(block, len(sample)) == sample
+
+    content = sample * 3
+    with LzoFile(filename='test.lzo', mode='wb', block_size=1024*1024, threads=2,
+                 restart_interval=65536, index='test.lzo.idx') as f:
+        f.write(content)
+        written = f.index.blocks
+    index = LzoIndex.load('test.lzo.idx')
+    assert index.blocks == written and index.size == len(content)
+    assert all(len(entry[4]) > 1 for entry in index.blocks[:-1])
+    assert [entry[:4] for entry in LzoIndex.build('test.lzo').blocks] == \
+        [entry[:4] for entry in index.blocks]
+    for threads in (1, 4):
+        with LzoFile(filename='test.lzo', mode='rb', threads=threads,
+                     index='test.lzo.idx') as f:
+            assert f.read() == content
+        with LzoFile(filename='test.lzo', mode='rb', threads=threads, index=index) as f:
+            buf = bytearray(len(content))
+            assert f.readinto(buf) == len(content) and buf == content
+    os.remove('test.lzo.idx')
+    print('restarts done')
+
+    # the thread pool: one thread and several give the blocks compress_block
+    # gives, resizing it restarts the workers, and compress_file uses it
+    blocks = [text[i:i + 30000] for i in range(0, 600000, 30000)] + [b'', data[:5000]]
+    assert compress_many([], 1, 1) == [] and compress_many([], 1, 1, 4) == []
+    for threads in (1, 4):
+        packed = compress_many(blocks, 1, 1, threads)
+        assert packed == [compress_block(block, 1, 1) for block in blocks]
+        assert decompress_many(packed, [len(block) for block in blocks], threads) == blocks
+    size = pool_size()
+    set_pool_size(3)
+    assert pool_size() == 3
+    compress_many(blocks * 4, 1, 1, 3)
+    stats = pool_stats()
+    assert len(stats) == 3 and sum(s['tasks'] for s in stats) > 0
+    assert all(sorted(s) == ['busy', 'latency', 'steals', 'tasks', 'uptime'] for s in stats)
+    set_pool_size(size)
+    assert pool_size() == size
+    with __builtin__.open('test.bin', 'wb') as f:
+        f.write(text + data[:300000])
+    compress_file('test.bin', 'test.lzo')
+    with __builtin__.open('test.lzo', 'rb') as f:
+        serial = f.read()
+    for threads in (1, 3):
+        compress_file('test.bin', 'test.lzo', threads=threads)
+        with __builtin__.open('test.lzo', 'rb') as f:
+            assert f.read() == serial
+    os.remove('test.bin')
+    print('pool done')
+
+    # messages: repeats, empty ones and one too big for the window, enough
+    # of them that the history moves along; a decompressor that missed the
+    # message a block refers to fails, and stays failed
+    messages = [text[i * 700:i * 700 + 300 + i * 37 % 900] for i in range(200)]
+    messages[5:5] = [b'', messages[3], messages[3], b'', text[:20000], messages[4]]
+    mc, md = MessageCompressor(), MessageDecompressor()
+    blocks = [mc.compress(m) for m in messages]
+    assert sum(len(b) for b in blocks) < sum(len(compress_block(m, 1, 1)) for m in messages)
+    assert [md.decompress(b, len(m)) for b, m in zip(blocks, messages)] == messages
+    # the tail of a message too big for the window is history all the same
+    mc, md = MessageCompressor(), MessageDecompressor()
+    big = mc.compress(text[:20000])
+    tail = mc.compress(text[16000:20000])
+    assert len(tail) < 100
+    assert md.decompress(big, 20000) == text[:20000]
+    assert md.decompress(tail, 4000) == text[16000:20000]
+    mc, md = MessageCompressor(), MessageDecompressor()
+    first, second = mc.compress(text[:8000]), mc.compress(text[:8000])
+    assert len(second) < 100
+    for block in (second, first):
+        try:
+            md.decompress(block, 8000)
+            raise AssertionError('out of sync decompress did not fail')
+        except error:
+            pass
+    md = MessageDecompressor()
+    try:
+        md.decompress(first, 7999)
+        raise AssertionError('wrong dst_len accepted')
+    except error:
+        pass
+    print('messages done')
+
+    # scatter/gather: empty fragments and buffers anywhere, small fragments
+    # copied together, large ones compressed in place; too little room in
+    # the buffers fails before any of them is written
+    frags = [b'', text[:100], b'', text[100:200000], text[:7], data[:70000], b'',
+             text[5000:5300]]
+    joined = b''.join(frags)
+    assert compress_v([], 1, 1) == compress_v([b'', b''], 1, 1) == compress_block(b'', 1, 1)
+    for threads in (1, 4):
+        block = compress_v(frags, 1, 1, threads)
+        assert decompress_block(block, len(joined)) == joined
+        for sizes in ([len(joined)], [0, 1, 65536, 0, len(joined)], [3] * 3 + [len(joined) + 10]):
+            bufs = [bytearray(size) for size in sizes]
+            dsts = [memoryview(buf) if k % 2 else buf for k, buf in enumerate(bufs)]
+            assert decompress_into_v(block, dsts, len(joined)) == len(joined)
+            assert b''.join(bytes(buf) for buf in bufs)[:len(joined)] == joined
+        bufs = [bytearray(500), bytearray(), bytearray(2500)]
+        assert decompress_into_v(data[:3000], bufs, 3000) == 3000   # stored
+        assert b''.join(bytes(buf) for buf in bufs) == data[:3000]
+        for sizes in ([], [len(joined) - 1], [0, 1000, len(joined) - 1001]):
+            bufs = [bytearray(b'x' * size) for size in sizes]
+            try:
+                decompress_into_v(block, bufs, len(joined))
+                raise AssertionError('too small buffers accepted')
+            except ValueError:
+                assert all(buf == b'x' * size for buf, size in zip(bufs, sizes))
+        try:
+            decompress_into_v(block, [bytearray(len(joined) + 1)], len(joined) + 1)
+            raise AssertionError('wrong dst_len accepted')
+        except error:
+            pass
+    print('vectors done')
+
+    # recompress: text shrinks, noise is copied, the content stays
+    with __builtin__.open('test.bin', 'wb') as f:
+        f.write(text + data[:300000] + text[:1000])
+    compress_file('test.bin', 'test.lzo')
+    before, after = recompress('test.lzo', 'test2.lzo')
+    assert after < before
+    f = LzoFile(filename='test2.lzo', mode='rb', index='test2.lzo.idx')
+    assert f.read() == text + data[:300000] + text[:1000]
+    assert f.index.size == len(text) + 301000
+    f.close()
+    for name in ('test.bin', 'test2.lzo', 'test2.lzo.idx'):
+        os.remove(name)
+    print('recompress done')
+
+    # gzip -> lzo -> gzip, with a second gzip member
+    import gzip
+    g = gzip.open('test.gz', 'wb')
+    g.write(text)
+    g.close()
+    with __builtin__.open('test.gz', 'ab') as g:
+        c = zlib.compressobj(6, zlib.DEFLATED, 16 + zlib.MAX_WBITS)
+        g.write(c.compress(data[:1000]) + c.flush())
+    stages = gzip_to_lzo('test.gz', 'test.lzo', threads=2, depth=1)
+    assert [s.bytes for s in stages] == [len(text) + 1000] * 3
+    stages = lzo_to_gzip('test.lzo', 'test.gz', threads=2)
+    assert gzip.open('test.gz').read() == text + data[:1000]
+    # a file cut anywhere, even in the trailer of its last member, fails;
+    # an empty one is empty
+    with __builtin__.open('test.gz', 'rb') as g:
+        whole = g.read()
+    for cut in (len(whole) // 2, len(whole) - 1, len(whole) - 8, 10):
+        with __builtin__.open('test.gz', 'wb') as g:
+            g.write(whole[:cut])
+        try:
+            gzip_to_lzo('test.gz', 'test.lzo', threads=2, depth=1)
+            raise AssertionError('truncated gzip file accepted')
+        except IOError:
+            pass
+    with __builtin__.open('test.gz', 'wb') as g:
+        pass
+    assert [s.bytes for s in gzip_to_lzo('test.gz', 'test.lzo')] == [0] * 3
+    os.remove('test.gz')
+    print('transcode done')
+
+    # a directory: one big file in pieces, one small file whole
+    import shutil
+    import tempfile
+    tree = tempfile.mkdtemp()
+    with __builtin__.open(os.path.join(tree, 'big'), 'wb') as f:
+        f.write(data * 3)
+    with __builtin__.open(os.path.join(tree, 'small'), 'wb') as f:
+        f.write(text[:1000])
+    try:
+        assert len(compress_tree(tree, processes=2)) == 2
+        for name, content in (('big', data * 3), ('small', text[:1000])):
+            f = LzoFile(filename=os.path.join(tree, name + '.lzo'), mode='rb')
+            assert f.read() == content
+            f.close()
+        # the pieces of a file are queued together, and a file that grows
+        # after the scan is written as it was then, end marker included
+        with __builtin__.open(os.path.join(tree, 'big2'), 'wb') as f:
+            f.write(data * 5)
+        tasks, outputs = _tree_tasks(tree, None, None)
+        order = [task[0] for task in tasks]
+        assert len(order) == 6
+        assert all(order.count(path) == len(order) - order[::-1].index(path) - order.index(path)
+                   for path in order)
+        with __builtin__.open(os.path.join(tree, 'big'), 'ab') as f:
+            f.write(text)
+        _tree_run(tasks, 2)
+        f = LzoFile(filename=os.path.join(tree, 'big.lzo'), mode='rb')
+        assert f.read() == data * 3
+        f.close()
+    finally:
+        shutil.rmtree(tree)
+    print('tree done')
+
+    # worker processes give the same file as one process, and decode it
+    if hasattr(os, 'fork'):
+        content = text + data[:300000]
+        with __builtin__.open('test.bin', 'wb') as f:
+            f.write(content)
+        compress_file('test.bin', 'test.lzo')
+        with __builtin__.open('test.lzo', 'rb') as f:
+            serial = f.read()
+        compress_file('test.bin', 'test.lzo', processes=2)
+        with __builtin__.open('test.lzo', 'rb') as f:
+            assert f.read() == serial
+        assert decompress_file('test.lzo', 'test.out', processes=2) == len(content)
+        with __builtin__.open('test.out', 'rb') as f:
+            assert f.read() == content
+        for name in ('test.bin', 'test.out'):
+            os.remove(name)
+        print('processes done')
+
+    # the aio queues, both kinds, and a damaged block
+    with __builtin__.open('test.bin', 'wb') as f:
+        f.write(text + data[:300000])
+    for aio in ('pread', True):
+        for level in (1, OPT_LEVEL):
+            compress_file('test.bin', 'test.lzo', threads=2, level=level, aio=aio)
+            assert decompress_file('test.lzo', 'test.out', aio=aio) == len(text) + 300000
+            with __builtin__.open('test.out', 'rb') as f:
+                assert f.read() == text + data[:300000]
+    with __builtin__.open('test.lzo', 'r+b') as f:
+        f.seek(-1000, 2)
+        f.write(b'\0' * 8)
+    try:
+        decompress_file('test.lzo', 'test.out', aio=True)
+        raise AssertionError('damaged block decoded')
+    except error:
+        pass
+    compress_file('test.bin', 'test.lzo', nocache=True)
+    assert decompress_file('test.lzo', 'test.out', nocache=True) == len(text) + 300000
+    with __builtin__.open('test.out', 'rb') as f:
+        assert f.read() == text + data[:300000]
+    for name in ('test.bin', 'test.out'):
+        os.remove(name)
+    print('aio done (io_uring %s)' % ('on' if aio_uring() else 'off'))
+
+    # a sparse file, its holes come out as zero blocks
+    size = 5 * BLOCK_SIZE + 100
+    with __builtin__.open('test.bin', 'wb') as f:
+        f.write(text[:1000])
+        f.seek(3 * BLOCK_SIZE)
+        f.write(text[:1000])
+        f.truncate(size)
+    for threads in (None, 2):
+        compress_file('test.bin', 'test.lzo', threads=threads)
+        assert decompress_file('test.lzo', 'test.out') == size
+        with __builtin__.open('test.out', 'rb') as f:
+            assert f.read() == __builtin__.open('test.bin', 'rb').read()
+    for name in ('test.bin', 'test.out'):
+        os.remove(name)
+    print('sparse done')
+
+    # a lazily decoded map, touched in the middle first, and an eager one;
+    # the kernel reads pages not decoded yet, and a child reads the eager one
+    with __builtin__.open('test.bin', 'wb') as f:
+        f.write(text + data[:300000])
+    compress_file('test.bin', 'test.lzo')
+    content = text + data[:300000]
+    for lazy in (True, False):
+        m = map('test.lzo', lazy=lazy)
+        assert len(m) == len(content)
+        assert m[1000000:1000100] == content[1000000:1000100]
+        assert m[len(m) - 1] == content[-1]
+        assert memoryview(m).tobytes() == content
+        assert m.stats['errors'] == 0
+        m.close()
+        with map('test.lzo', lazy=lazy) as m:
+            fd = os.open('test.out', os.O_WRONLY | os.O_CREAT | os.O_TRUNC)
+            try:
+                assert os.write(fd, buffer(m, 1000000)) == len(content) - 1000000
+                assert os.write(fd, buffer(m)) == len(content)
+            finally:
+                os.close(fd)
+            with __builtin__.open('test.out', 'rb') as f:
+                assert f.read() == content[1000000:] + content
+            if not lazy and hasattr(os, 'fork'):
+                pid = os.fork()
+                if pid == 0:
+                    ok = False
+                    try:
+                        ok = m[5:100] == content[5:100] and buffer(m)[:] == content
+                    finally:
+                        os._exit(0 if ok else 1)
+                assert os.waitpid(pid, 0)[1] == 0
+    for name in ('test.bin', 'test.out'):
+        os.remove(name)
+    # a bad block: map() fails when decoding at once, a lazy map raises
+    # for reads of it, each time, and not for those of the other blocks
+    blocks = LzoIndex.build('test.lzo').blocks
+    with __builtin__.open('test.lzo', 'rb') as f:
+        broken = bytearray(f.read())
+    broken[blocks[2][0] - 1] ^= 0xff
+    with __builtin__.open('test.bad', 'wb') as f:
+        f.write(broken)
+    for lazy in (True, False):
+        try:
+            m = map('test.bad', lazy=lazy)
+        except error:
+            assert not lazy or not map('test.lzo').lazy
+            continue
+        with m:
+            assert m[:100] == content[:100]
+            for i in range(2):
+                try:
+                    m[blocks[1][1] + 10]
+                    raise AssertionError('bad block read from a lazy map')
+                except error:
+                    pass
+            try:
+                m[blocks[1][1] - 10:blocks[1][1] + 10]
+                raise AssertionError('bad block read from a lazy map')
+            except error:
+                pass
+            assert m.stats['errors'] == 1
+            assert m[blocks[2][1]:blocks[2][1] + 100] == content[blocks[2][1]:blocks[2][1] + 100]
+    os.remove('test.bad')
+    print('map done (lazy %s)' % map('test.lzo').lazy)
+
+    # random access by the index, a sequential scan gets prefetched
+    with LzoReader('test.lzo', cache_blocks=4) as r:
+        assert r.size == len(content)
+        assert r.read(1000000, 100) == content[1000000:1000100]
+        assert r.read(len(content) - 10) == content[-10:]
+        step = 65536
+        chunks = []
+        for offset in range(0, r.size, step):
+            chunks.append(r.read(offset, step))
+            time.sleep(0.001)
+        assert ''.join(chunks) == content
+        stats = r.stats
+    assert stats.prefetched and stats.prefetch_hits, stats
+    print('reader done %r' % stats)
+
+    # a forked process finds the blocks decoded by its parent
+    if hasattr(os, 'fork'):
+        cache = BlockCache(16*1024*1024, SHARED_CACHE_SLOT, 1)
+        with LzoReader('test.lzo', shared=cache) as r:
+            assert r.read(0) == content
+        pid = os.fork()
+        if pid == 0:
+            ok = False
+            try:
+                with LzoReader('test.lzo', prefetch=0, shared=cache) as r:
+                    ok = (r.read(0) == content and
+                          r.stats.shared_hits == len(r.index.blocks))
+            finally:
+                os._exit(0 if ok else 1)
+        assert os.waitpid(pid, 0)[1] == 0
+        print('shared cache done %r' % cache.stats)
+        cache.close()
+    os.remove('test.lzo')
+
     print('test complete')
 
 def main():
@@ -529,26 +2439,68 @@ def main():
     import os
     parser = argparse.ArgumentParser(description='Compress or decompress like lzop')
     parser.add_argument('-d', '--decompress', dest='decompress', action='store_true')
+    parser.add_argument('-z', '--gzip', action='store_true',
+                        help='transcode: PATH.gz to lzo, or with -d an lzo file to gzip')
+    parser.add_argument('-r', '--recompress', action='store_true',
+                        help='re-encode an lzo file at --level (default %d)' % OPT_LEVEL)
     #parser.add_argument('-t', '--test', dest='test', action='store_true')
+    parser.add_argument('-j', '--jobs', type=int, default=1,
+                        help='worker processes')
+    parser.add_argument('-T', '--threads', type=int, default=1,
+                        help='compress on the thread pool')
+    parser.add_argument('-a', '--aio', action='store_true',
+                        help='keep block reads and writes in flight on an io_uring')
+    parser.add_argument('--aio-pread', dest='aio', action='store_const', const='pread',
+                        help='the same with pread/pwrite')
+    parser.add_argument('--nocache', action='store_true',
+                        help='keep the files out of the page cache (for backups)')
+    parser.add_argument('-l', '--level', type=int, default=None,
+                        help='1-6 LZO1X-1, 7-9 LZO1X-999, %d smallest' % OPT_LEVEL)
+    parser.add_argument('-g', '--min-gain', type=float, default=RECOMPRESS_MIN_GAIN,
+                        help='keep blocks that shrink less than this when recompressing')
+    parser.add_argument('-o', '--output',
+                        help='recompressed file (PATH.new by default), or output directory')
     parser.add_argument('path')
     args = parser.parse_args()
 
     filename = os.path.basename(args.path)
-    if args.decompress:
-        with LzoFile(filename = args.path) as f:
-            name, ext = os.path.splitext(filename)
-            if ext == '.lzo':
-                de_name = name
-            else:
-                de_name = filename + '.uncompressed'
+    if args.gzip:
+        name, ext = os.path.splitext(args.path)
+        threads = args.threads if args.threads > 1 else None
+        if args.decompress:
+            stages = lzo_to_gzip(args.path, name + '.gz', threads)
+        else:
+            stages = gzip_to_lzo(args.path, name + '.lzo', threads, args.level)
+        for stage in stages:
+            print('%-10s %8.1f MB/s  %6.2fs busy' % (stage.name, stage.rate / 1e6,
+                                                   stage.busy))
+
+    elif args.recompress:
+        dst = args.output or args.path + '.new'
+        before, after = recompress(args.path, dst, args.level or OPT_LEVEL,
+                                   args.threads if args.threads > 1 else None,
+                                   args.min_gain)
+        print('%s: %d -> %d bytes' % (dst, before, after))
+
+    elif args.decompress:
+        name, ext = os.path.splitext(filename)
+        if ext == '.lzo':
+            de_name = name
+        else:
+            de_name = filename + '.uncompressed'
+
+        decompress_file(args.path, de_name, processes=args.jobs, aio=args.aio,
+                        threads=args.threads if args.threads > 1 else None,
+                        nocache=args.nocache)
 
-            with __builtin__.open(de_name, 'wb') as de:
-                de.write(f.read())
+    elif os.path.isdir(args.path):
+        compress_tree(args.path, args.output,
+                      args.jobs if args.jobs > 1 else None, args.level)
 
     else:
-        with __builtin__.open(args.path, 'rb') as f:
-            with LzoFile(filename = args.path + ".lzo", mode = 'wb') as com:
-                com.write(f.read())
+        compress_file(args.path, args.path + ".lzo", processes=args.jobs,
+                      threads=args.threads, level=args.level, aio=args.aio,
+                      nocache=args.nocache)
 
 
 if __name__ == '__main__':
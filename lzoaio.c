@@ -0,0 +1,440 @@
+/*
+ * Queue of asynchronous file reads and writes, see lzoaio.h.
+ *
+ * Every request has a slot; its index is the user_data of the io_uring
+ * entries.  A slot is queued (an entry to fill at the next submit), in
+ * flight, or done and waiting to be reported.  The io_uring part follows
+ * the kernel's io_uring_setup(2) layout: the submission ring indexes an
+ * array of entries, the completion ring holds the results, head and tail
+ * are shared with the kernel and read/written with acquire/release.
+ */
+
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE
+#endif
+
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+#include "lzoaio.h"
+
+#ifdef _WIN32
+#  include <io.h>
+#else
+#  include <fcntl.h>
+#  include <sys/types.h>
+#  include <sys/uio.h>
+#  include <unistd.h>
+#endif
+
+#if defined(__linux__) && defined(__GNUC__)
+#  include <sys/mman.h>
+#  include <sys/syscall.h>
+#  include <linux/io_uring.h>
+#  if defined(__NR_io_uring_setup) && defined(__NR_io_uring_enter)
+#    define LZO_AIO_URING 1
+#  endif
+#endif
+
+enum { FREE, QUEUED, FLIGHT, DONE };
+
+struct buf {
+  void *base;
+  size_t len;
+};
+
+typedef struct {
+  int state;
+  int write;
+  int fd;
+  int n;
+  struct buf buf[2];
+  size_t done;                  /* bytes transferred so far */
+  long long off;
+  unsigned long tag;
+  int err;
+#ifdef LZO_AIO_URING
+  struct iovec iov[2];          /* what is left, for the kernel */
+#endif
+} req_t;
+
+struct lzo_aio {
+  int depth;
+  int pending;
+  req_t *req;
+  int *done;                    /* slots done, oldest first */
+  int done_head;
+  int done_len;
+#ifdef LZO_AIO_URING
+  int ring;                     /* -1 without io_uring */
+  void *sq_map;
+  void *cq_map;
+  size_t sq_size;
+  size_t cq_size;
+  struct io_uring_sqe *sqes;
+  size_t sqes_size;
+  unsigned *sq_head;
+  unsigned *sq_tail;
+  unsigned *sq_mask;
+  unsigned *sq_array;
+  unsigned *cq_head;
+  unsigned *cq_tail;
+  unsigned *cq_mask;
+  struct io_uring_cqe *cqes;
+  unsigned to_submit;
+#endif
+};
+
+static void
+finish(lzo_aio_t *q, int i, int err)
+{
+  q->req[i].state = DONE;
+  q->req[i].err = err;
+  q->done[(q->done_head + q->done_len++) % q->depth] = i;
+}
+
+static size_t
+req_len(const req_t *r)
+{
+  return r->buf[0].len + (r->n > 1 ? r->buf[1].len : 0);
+}
+
+/* do request i at once with positional I/O */
+static void
+run_sync(lzo_aio_t *q, int i)
+{
+  req_t *r = &q->req[i];
+  size_t total = req_len(r);
+
+  while (r->done < total) {
+    size_t skip = r->done;
+    int k = 0;
+    long n;
+
+    if (skip >= r->buf[0].len) {
+      skip -= r->buf[0].len;
+      k = 1;
+    }
+#ifdef _WIN32
+    if (_lseeki64(r->fd, r->off + (long long) r->done, SEEK_SET) < 0)
+      n = -1;
+    else if (r->write)
+      n = _write(r->fd, (char *) r->buf[k].base + skip, (unsigned) (r->buf[k].len - skip));
+    else
+      n = _read(r->fd, (char *) r->buf[k].base + skip, (unsigned) (r->buf[k].len - skip));
+#else
+    if (r->write)
+      n = (long) pwrite(r->fd, (char *) r->buf[k].base + skip, r->buf[k].len - skip,
+                        (off_t) (r->off + (long long) r->done));
+    else
+      n = (long) pread(r->fd, (char *) r->buf[k].base + skip, r->buf[k].len - skip,
+                       (off_t) (r->off + (long long) r->done));
+#endif
+    if (n < 0 && errno == EINTR)
+      continue;
+    if (n <= 0) {
+      finish(q, i, n < 0 ? -errno : -EIO);      /* EIO: unexpected end of file */
+      return;
+    }
+    r->done += (size_t) n;
+  }
+  finish(q, i, 0);
+}
+
+#ifdef LZO_AIO_URING
+
+static int
+uring_setup(lzo_aio_t *q)
+{
+  struct io_uring_params p;
+  char *sq;
+  char *cq;
+
+  memset(&p, 0, sizeof(p));
+  q->ring = (int) syscall(__NR_io_uring_setup, (unsigned) q->depth, &p);
+  if (q->ring < 0)
+    return -1;
+
+  q->sq_size = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+  q->cq_size = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+  if (p.features & IORING_FEAT_SINGLE_MMAP) {
+    if (q->cq_size > q->sq_size)
+      q->sq_size = q->cq_size;
+    q->cq_size = 0;
+  }
+  q->sq_map = mmap(NULL, q->sq_size, PROT_READ | PROT_WRITE,
+                   MAP_SHARED | MAP_POPULATE, q->ring, IORING_OFF_SQ_RING);
+  q->cq_map = q->cq_size == 0 ? q->sq_map
+    : mmap(NULL, q->cq_size, PROT_READ | PROT_WRITE,
+           MAP_SHARED | MAP_POPULATE, q->ring, IORING_OFF_CQ_RING);
+  q->sqes_size = p.sq_entries * sizeof(struct io_uring_sqe);
+  q->sqes = (struct io_uring_sqe *) mmap(NULL, q->sqes_size, PROT_READ | PROT_WRITE,
+                                         MAP_SHARED | MAP_POPULATE, q->ring,
+                                         IORING_OFF_SQES);
+  if (q->sq_map == MAP_FAILED || q->cq_map == MAP_FAILED || q->sqes == MAP_FAILED)
+    return -1;
+
+  sq = (char *) q->sq_map;
+  cq = (char *) q->cq_map;
+  q->sq_head = (unsigned *) (sq + p.sq_off.head);
+  q->sq_tail = (unsigned *) (sq + p.sq_off.tail);
+  q->sq_mask = (unsigned *) (sq + p.sq_off.ring_mask);
+  q->sq_array = (unsigned *) (sq + p.sq_off.array);
+  q->cq_head = (unsigned *) (cq + p.cq_off.head);
+  q->cq_tail = (unsigned *) (cq + p.cq_off.tail);
+  q->cq_mask = (unsigned *) (cq + p.cq_off.ring_mask);
+  q->cqes = (struct io_uring_cqe *) (cq + p.cq_off.cqes);
+  return 0;
+}
+
+static void
+uring_teardown(lzo_aio_t *q)
+{
+  if (q->sqes != NULL && q->sqes != MAP_FAILED)
+    munmap(q->sqes, q->sqes_size);
+  if (q->cq_map != NULL && q->cq_map != MAP_FAILED && q->cq_map != q->sq_map)
+    munmap(q->cq_map, q->cq_size);
+  if (q->sq_map != NULL && q->sq_map != MAP_FAILED)
+    munmap(q->sq_map, q->sq_size);
+  if (q->ring >= 0)
+    close(q->ring);
+  q->ring = -1;
+}
+
+/* put the rest of request i on the submission ring */
+static void
+uring_queue(lzo_aio_t *q, int i)
+{
+  req_t *r = &q->req[i];
+  unsigned tail = *q->sq_tail;
+  unsigned k = tail & *q->sq_mask;
+  struct io_uring_sqe *sqe = &q->sqes[k];
+  size_t skip = r->done;
+  int n = 0, j;
+
+  for (j = 0; j < r->n; j++) {
+    if (skip >= r->buf[j].len) {
+      skip -= r->buf[j].len;
+      continue;
+    }
+    r->iov[n].iov_base = (char *) r->buf[j].base + skip;
+    r->iov[n].iov_len = r->buf[j].len - skip;
+    skip = 0;
+    n++;
+  }
+
+  memset(sqe, 0, sizeof(*sqe));
+  sqe->opcode = r->write ? IORING_OP_WRITEV : IORING_OP_READV;
+  sqe->fd = r->fd;
+  sqe->addr = (unsigned long) r->iov;
+  sqe->len = (unsigned) n;
+  sqe->off = (unsigned long long) (r->off + (long long) r->done);
+  sqe->user_data = (unsigned long long) i;
+  q->sq_array[k] = k;
+  __atomic_store_n(q->sq_tail, tail + 1, __ATOMIC_RELEASE);
+  r->state = FLIGHT;
+  q->to_submit++;
+}
+
+/* move the completions off the ring, requeueing short transfers */
+static void
+uring_reap(lzo_aio_t *q)
+{
+  unsigned head = *q->cq_head;
+
+  while (head != __atomic_load_n(q->cq_tail, __ATOMIC_ACQUIRE)) {
+    struct io_uring_cqe *cqe = &q->cqes[head & *q->cq_mask];
+    int i = (int) cqe->user_data;
+    req_t *r = &q->req[i];
+
+    if (cqe->res == -EINTR || cqe->res == -EAGAIN)
+      uring_queue(q, i);
+    else if (cqe->res < 0)
+      finish(q, i, cqe->res);
+    else if (cqe->res == 0)
+      finish(q, i, -EIO);
+    else if ((r->done += (size_t) cqe->res) < req_len(r))
+      uring_queue(q, i);
+    else
+      finish(q, i, 0);
+    head++;
+  }
+  __atomic_store_n(q->cq_head, head, __ATOMIC_RELEASE);
+}
+
+#endif
+
+lzo_aio_t *
+lzo_aio_new(int depth, int uring)
+{
+  lzo_aio_t *q = (lzo_aio_t *) calloc(1, sizeof(lzo_aio_t));
+
+  if (q == NULL)
+    return NULL;
+  q->depth = depth > 0 ? depth : 1;
+  q->req = (req_t *) calloc((size_t) q->depth, sizeof(req_t));
+  q->done = (int *) calloc((size_t) q->depth, sizeof(int));
+  if (q->req == NULL || q->done == NULL) {
+    lzo_aio_free(q);
+    return NULL;
+  }
+#ifdef LZO_AIO_URING
+  q->ring = -1;
+  if (uring && uring_setup(q) != 0)
+    uring_teardown(q);
+#else
+  (void) uring;
+#endif
+  return q;
+}
+
+void
+lzo_aio_free(lzo_aio_t *q)
+{
+  if (q == NULL)
+    return;
+#ifdef LZO_AIO_URING
+  if (q->ring >= 0) {
+    /* the kernel may still write into buffers of requests in flight */
+    unsigned long tag;
+    int err;
+
+    while (q->pending > 0 && lzo_aio_next(q, 1, &tag, &err) >= 0)
+      ;
+  }
+  uring_teardown(q);
+#endif
+  free(q->req);
+  free(q->done);
+  free(q);
+}
+
+int
+lzo_aio_uring(const lzo_aio_t *q)
+{
+#ifdef LZO_AIO_URING
+  return q->ring >= 0;
+#else
+  (void) q;
+  return 0;
+#endif
+}
+
+static int
+add(lzo_aio_t *q, int write, int fd, void *const *buf, const size_t *len,
+    int n, long long off, unsigned long tag)
+{
+  req_t *r;
+  int i, j;
+
+  if (q->pending == q->depth)
+    return -1;
+  for (i = 0; q->req[i].state != FREE; i++)
+    ;
+  r = &q->req[i];
+  r->write = write;
+  r->fd = fd;
+  r->n = n;
+  for (j = 0; j < n; j++) {
+    r->buf[j].base = buf[j];
+    r->buf[j].len = len[j];
+  }
+  r->done = 0;
+  r->off = off;
+  r->tag = tag;
+  q->pending++;
+#ifdef LZO_AIO_URING
+  if (q->ring >= 0) {
+    uring_queue(q, i);
+    return 0;
+  }
+#endif
+  r->state = QUEUED;
+  run_sync(q, i);
+  return 0;
+}
+
+int
+lzo_aio_read(lzo_aio_t *q, int fd, void *buf, size_t len,
+             long long off, unsigned long tag)
+{
+  return add(q, 0, fd, &buf, &len, 1, off, tag);
+}
+
+int
+lzo_aio_write(lzo_aio_t *q, int fd, void *const *buf, const size_t *len,
+              int n, long long off, unsigned long tag)
+{
+  return add(q, 1, fd, buf, len, n, off, tag);
+}
+
+int
+lzo_aio_pending(const lzo_aio_t *q)
+{
+  return q->pending;
+}
+
+int
+lzo_aio_next(lzo_aio_t *q, int wait, unsigned long *tag, int *err)
+{
+  int i;
+
+#ifdef LZO_AIO_URING
+  while (q->ring >= 0 && q->done_len == 0 && q->pending > 0) {
+    unsigned flags = wait ? IORING_ENTER_GETEVENTS : 0;
+    long n;
+
+    n = syscall(__NR_io_uring_enter, q->ring, q->to_submit, wait ? 1 : 0, flags,
+                NULL, 0);
+    if (n < 0 && errno != EINTR)
+      return -1;
+    if (n > 0)
+      q->to_submit -= (unsigned) n;
+    uring_reap(q);
+    if (!wait)
+      break;
+  }
+#else
+  (void) wait;
+#endif
+  if (q->done_len == 0)
+    return 0;
+  i = q->done[q->done_head];
+  q->done_head = (q->done_head + 1) % q->depth;
+  q->done_len--;
+  q->pending--;
+  q->req[i].state = FREE;
+  *tag = q->req[i].tag;
+  *err = q->req[i].err;
+  return 1;
+}
+
+void
+lzo_aio_flush(int fd, long long off, long long len)
+{
+#if defined(__linux__) && defined(SYNC_FILE_RANGE_WRITE)
+  sync_file_range(fd, (off_t) off, (off_t) len, SYNC_FILE_RANGE_WRITE);
+#else
+  (void) fd;
+  (void) off;
+  (void) len;
+#endif
+}
+
+void
+lzo_aio_drop(int fd, long long off, long long len)
+{
+  if (len <= 0)
+    return;
+#if defined(__linux__) && defined(SYNC_FILE_RANGE_WRITE)
+  /* dirty pages are not dropped, write them out first */
+  sync_file_range(fd, (off_t) off, (off_t) len, SYNC_FILE_RANGE_WAIT_BEFORE
+                  | SYNC_FILE_RANGE_WRITE | SYNC_FILE_RANGE_WAIT_AFTER);
+#endif
+#if !defined(_WIN32) && defined(POSIX_FADV_DONTNEED)
+  posix_fadvise(fd, (off_t) off, (off_t) len, POSIX_FADV_DONTNEED);
+#else
+  (void) fd;
+  (void) off;
+#endif
+}
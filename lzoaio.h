@@ -0,0 +1,54 @@
+/*
+ * Queue of asynchronous file reads and writes for the bulk conversions.
+ *
+ * On Linux the requests go to an io_uring, set up with the raw system
+ * calls (no liburing), so up to depth of them are in flight at once and
+ * the disk sees a deep queue while the caller compresses.  Where there is
+ * no io_uring (another OS, an old kernel, a seccomp filter refusing it)
+ * or it is not wanted, every request is done with pread/pwrite when it
+ * is queued and simply completes at the next wait; the caller is the
+ * same either way.
+ *
+ * Short transfers are continued inside the queue, a completion reports
+ * the whole length or an error.  Not thread safe, one queue per thread.
+ */
+
+#ifndef LZOAIO_H
+#define LZOAIO_H
+
+#include <stddef.h>
+
+typedef struct lzo_aio lzo_aio_t;
+
+/* a queue for up to depth requests, on an io_uring if uring is nonzero
+ * and the kernel has one.  NULL if out of memory */
+lzo_aio_t *lzo_aio_new(int depth, int uring);
+void lzo_aio_free(lzo_aio_t *q);
+
+/* nonzero if q runs on an io_uring */
+int lzo_aio_uring(const lzo_aio_t *q);
+
+/* queue a read or write at offset off of the buffers buf[0..n) (n <= 2),
+ * tag comes back with its completion.  Returns 0, or -1 if depth
+ * requests are pending already */
+int lzo_aio_read(lzo_aio_t *q, int fd, void *buf, size_t len,
+                 long long off, unsigned long tag);
+int lzo_aio_write(lzo_aio_t *q, int fd, void *const *buf, const size_t *len,
+                  int n, long long off, unsigned long tag);
+
+/* requests queued and not yet reported by lzo_aio_next */
+int lzo_aio_pending(const lzo_aio_t *q);
+
+/* submit what is queued and report one completed request: its tag and
+ * 0 or -errno.  Waits if wait is nonzero, else returns 0 when none has
+ * completed yet.  Returns 1 with a completion, 0 without, -1 if the
+ * queue failed (errno set) */
+int lzo_aio_next(lzo_aio_t *q, int wait, unsigned long *tag, int *err);
+
+/* page cache hints for the bytes [off, off + len) of fd, which the caller
+ * is done with: start writing them back, or wait for that and drop their
+ * pages.  No-ops where the system has no such calls */
+void lzo_aio_flush(int fd, long long off, long long len);
+void lzo_aio_drop(int fd, long long off, long long len);
+
+#endif
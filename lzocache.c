@@ -0,0 +1,530 @@
+/*
+ * Shared cache of decoded blocks, see lzocache.h.
+ *
+ * The segment starts with a header giving its geometry, then the shards
+ * (lock, clock hand, counters), the slot table, the hash buckets of every
+ * shard and, page aligned, the slot data.  Everything in it refers to
+ * slots by number, the processes map it at different addresses.  Shard s
+ * owns the slots [s * per_shard, (s + 1) * per_shard) and the buckets
+ * [s * nbuckets, (s + 1) * nbuckets); a slot is chained into the bucket
+ * of its key while it is used.
+ */
+
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE             /* robust mutexes */
+#endif
+
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+#include "lzocache.h"
+
+#ifdef _WIN32
+
+lzo_cache_t *
+lzo_cache_open(const char *name, size_t size, size_t slot_size, int shards, int *err)
+{
+  (void) name; (void) size; (void) slot_size; (void) shards;
+  *err = ENOSYS;
+  return NULL;
+}
+
+void
+lzo_cache_close(lzo_cache_t *c)
+{
+  (void) c;
+}
+
+int
+lzo_cache_unlink(const char *name)
+{
+  (void) name;
+  return ENOSYS;
+}
+
+size_t
+lzo_cache_slot_size(const lzo_cache_t *c)
+{
+  (void) c;
+  return 0;
+}
+
+size_t
+lzo_cache_slots(const lzo_cache_t *c)
+{
+  (void) c;
+  return 0;
+}
+
+int
+lzo_cache_get(lzo_cache_t *c, unsigned long long file, unsigned long long block,
+              void *out, size_t len)
+{
+  (void) c; (void) file; (void) block; (void) out; (void) len;
+  return 0;
+}
+
+int
+lzo_cache_put(lzo_cache_t *c, unsigned long long file, unsigned long long block,
+              const void *data, size_t len)
+{
+  (void) c; (void) file; (void) block; (void) data; (void) len;
+  return 0;
+}
+
+void
+lzo_cache_stats(lzo_cache_t *c, lzo_cache_stats_t *s)
+{
+  (void) c;
+  memset(s, 0, sizeof(*s));
+}
+
+#else
+
+#include <fcntl.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <time.h>
+#include <unistd.h>
+
+#if defined(__linux__)
+#  define LZO_CACHE_ROBUST 1
+#endif
+
+#define CACHE_MAGIC     0x4c5a4f43u     /* "LZOC" */
+#define CACHE_SHARDS    16
+#define CACHE_NIL       0xffffffffu
+#define CACHE_ALIGN     64
+
+/* how long an opener waits for the creator of a named cache, in ms */
+#define CACHE_OPEN_WAIT 2000
+
+struct cache_head {
+  unsigned int magic;
+  volatile int ready;
+  unsigned long long slot_size;
+  unsigned int nshards;
+  unsigned int per_shard;       /* slots of a shard */
+  unsigned int nbuckets;        /* hash buckets of a shard, a power of 2 */
+};
+
+struct cache_shard {
+  pthread_mutex_t lock;
+  unsigned int hand;
+  unsigned int used;
+  unsigned long hits, misses, inserts, evictions;
+};
+
+struct cache_slot {
+  unsigned long long file;
+  unsigned long long block;
+  unsigned int len;
+  unsigned int next;            /* in the hash chain */
+  unsigned char used;
+  unsigned char ref;            /* read since the clock hand last passed */
+};
+
+struct lzo_cache {
+  unsigned char *base;
+  size_t len;
+  struct cache_head *head;
+  struct cache_shard *shards;
+  struct cache_slot *slots;
+  unsigned int *buckets;
+  unsigned char *data;
+};
+
+static size_t
+align_up(size_t n, size_t a)
+{
+  return (n + a - 1) / a * a;
+}
+
+/* offsets of the parts of a segment of geometry h, returns its size */
+static size_t
+layout(const struct cache_head *h, size_t *shards, size_t *slots,
+       size_t *buckets, size_t *data)
+{
+  size_t nslots = (size_t) h->nshards * h->per_shard;
+
+  *shards = align_up(sizeof(struct cache_head), CACHE_ALIGN);
+  *slots = align_up(*shards + h->nshards * sizeof(struct cache_shard), CACHE_ALIGN);
+  *buckets = align_up(*slots + nslots * sizeof(struct cache_slot), CACHE_ALIGN);
+  *data = align_up(*buckets + (size_t) h->nshards * h->nbuckets * sizeof(unsigned int),
+                   (size_t) sysconf(_SC_PAGESIZE));
+  return *data + nslots * (size_t) h->slot_size;
+}
+
+static void
+attach(lzo_cache_t *c)
+{
+  size_t shards, slots, buckets, data;
+
+  c->head = (struct cache_head *) c->base;
+  layout(c->head, &shards, &slots, &buckets, &data);
+  c->shards = (struct cache_shard *) (c->base + shards);
+  c->slots = (struct cache_slot *) (c->base + slots);
+  c->buckets = (unsigned int *) (c->base + buckets);
+  c->data = c->base + data;
+}
+
+static unsigned long long
+key_hash(unsigned long long file, unsigned long long block)
+{
+  unsigned long long h = file ^ (block * 0x9e3779b97f4a7c15ull);
+
+  h ^= h >> 33;
+  h *= 0xff51afd7ed558ccdull;
+  h ^= h >> 33;
+  h *= 0xc4ceb9fe1a85ec53ull;
+  return h ^ (h >> 33);
+}
+
+/* empty shard s, it has to be locked */
+static void
+shard_reset(lzo_cache_t *c, unsigned int s)
+{
+  struct cache_shard *sh = &c->shards[s];
+  unsigned int i;
+
+  for (i = 0; i < c->head->per_shard; i++) {
+    struct cache_slot *slot = &c->slots[s * c->head->per_shard + i];
+    slot->used = slot->ref = 0;
+    slot->next = CACHE_NIL;
+  }
+  for (i = 0; i < c->head->nbuckets; i++)
+    c->buckets[s * c->head->nbuckets + i] = CACHE_NIL;
+  sh->hand = sh->used = 0;
+}
+
+static void
+shard_lock(lzo_cache_t *c, unsigned int s)
+{
+#ifdef LZO_CACHE_ROBUST
+  if (pthread_mutex_lock(&c->shards[s].lock) == EOWNERDEAD) {
+    /* its owner died halfway through a change, start over */
+    shard_reset(c, s);
+    pthread_mutex_consistent(&c->shards[s].lock);
+  }
+#else
+  pthread_mutex_lock(&c->shards[s].lock);
+#endif
+}
+
+static void
+shard_unlock(lzo_cache_t *c, unsigned int s)
+{
+  pthread_mutex_unlock(&c->shards[s].lock);
+}
+
+static int
+init(lzo_cache_t *c)
+{
+  struct cache_head *h = c->head;
+  pthread_mutexattr_t attr;
+  unsigned int s;
+
+  if (pthread_mutexattr_init(&attr) != 0)
+    return ENOMEM;
+  pthread_mutexattr_setpshared(&attr, PTHREAD_PROCESS_SHARED);
+#ifdef LZO_CACHE_ROBUST
+  pthread_mutexattr_setrobust(&attr, PTHREAD_MUTEX_ROBUST);
+#endif
+  for (s = 0; s < h->nshards; s++) {
+    if (pthread_mutex_init(&c->shards[s].lock, &attr) != 0) {
+      pthread_mutexattr_destroy(&attr);
+      return ENOMEM;
+    }
+    shard_reset(c, s);
+  }
+  pthread_mutexattr_destroy(&attr);
+  h->magic = CACHE_MAGIC;
+  __sync_synchronize();
+  h->ready = 1;
+  return 0;
+}
+
+/* the geometry of a new cache, 0 or an errno */
+static int
+geometry(struct cache_head *h, size_t size, size_t slot_size, int shards)
+{
+  size_t nslots;
+
+  if (slot_size == 0 || shards < 0)
+    return EINVAL;
+  h->slot_size = align_up(slot_size, CACHE_ALIGN);
+  h->nshards = shards > 0 ? (unsigned int) shards : CACHE_SHARDS;
+  nslots = size / h->slot_size;
+  if (nslots < h->nshards)
+    nslots = h->nshards;
+  if (nslots >= CACHE_NIL)
+    return EINVAL;
+  h->per_shard = (unsigned int) (nslots / h->nshards);
+  h->nbuckets = 1;
+  while (h->nbuckets < h->per_shard)
+    h->nbuckets <<= 1;
+  return 0;
+}
+
+static void
+sleep_ms(void)
+{
+  struct timespec ts = {0, 1000000};
+  nanosleep(&ts, NULL);
+}
+
+/* map the named cache another process is creating or has created */
+static int
+open_existing(lzo_cache_t *c, const char *name)
+{
+  struct stat st;
+  size_t shards, slots, buckets, data;
+  int fd, waited, err;
+
+  fd = shm_open(name, O_RDWR, 0);
+  if (fd < 0)
+    return errno;
+  for (waited = 0; ; waited++) {
+    if (fstat(fd, &st) < 0) {
+      err = errno;
+      close(fd);
+      return err;
+    }
+    if ((size_t) st.st_size >= sizeof(struct cache_head))
+      break;
+    if (waited == CACHE_OPEN_WAIT) {
+      close(fd);
+      return EAGAIN;
+    }
+    sleep_ms();
+  }
+  c->len = (size_t) st.st_size;
+  c->base = (unsigned char *) mmap(NULL, c->len, PROT_READ | PROT_WRITE,
+                                   MAP_SHARED, fd, 0);
+  close(fd);
+  if (c->base == (unsigned char *) MAP_FAILED) {
+    c->base = NULL;
+    return errno;
+  }
+  c->head = (struct cache_head *) c->base;
+  for (waited = 0; !c->head->ready; waited++) {
+    if (waited == CACHE_OPEN_WAIT)
+      return EAGAIN;
+    sleep_ms();
+  }
+  __sync_synchronize();
+  if (c->head->magic != CACHE_MAGIC || c->head->nshards == 0
+      || layout(c->head, &shards, &slots, &buckets, &data) > c->len)
+    return EINVAL;
+  attach(c);
+  return 0;
+}
+
+lzo_cache_t *
+lzo_cache_open(const char *name, size_t size, size_t slot_size, int shards, int *err)
+{
+  struct cache_head h;
+  size_t off[4];
+  lzo_cache_t *c;
+  int fd = -1;
+
+  memset(&h, 0, sizeof(h));
+  *err = geometry(&h, size, slot_size, shards);
+  if (*err != 0)
+    return NULL;
+  c = (lzo_cache_t *) calloc(1, sizeof(*c));
+  if (c == NULL) {
+    *err = ENOMEM;
+    return NULL;
+  }
+  c->len = layout(&h, &off[0], &off[1], &off[2], &off[3]);
+
+  if (name != NULL) {
+    fd = shm_open(name, O_RDWR | O_CREAT | O_EXCL, 0600);
+    if (fd < 0) {
+      *err = errno == EEXIST ? open_existing(c, name) : errno;
+      if (*err != 0) {
+        lzo_cache_close(c);
+        return NULL;
+      }
+      return c;
+    }
+    if (ftruncate(fd, (off_t) c->len) < 0) {
+      *err = errno;
+      close(fd);
+      shm_unlink(name);
+      lzo_cache_close(c);
+      return NULL;
+    }
+  }
+
+  c->base = (unsigned char *) mmap(NULL, c->len, PROT_READ | PROT_WRITE,
+                                   fd < 0 ? MAP_SHARED | MAP_ANONYMOUS : MAP_SHARED,
+                                   fd, 0);
+  if (fd >= 0)
+    close(fd);
+  if (c->base == (unsigned char *) MAP_FAILED) {
+    c->base = NULL;
+    *err = errno;
+  } else {
+    memcpy(c->base, &h, sizeof(h));
+    attach(c);
+    *err = init(c);
+  }
+  if (*err != 0) {
+    if (name != NULL)
+      shm_unlink(name);
+    lzo_cache_close(c);
+    return NULL;
+  }
+  return c;
+}
+
+void
+lzo_cache_close(lzo_cache_t *c)
+{
+  if (c == NULL)
+    return;
+  if (c->base != NULL)
+    munmap(c->base, c->len);
+  free(c);
+}
+
+int
+lzo_cache_unlink(const char *name)
+{
+  return shm_unlink(name) < 0 ? errno : 0;
+}
+
+size_t
+lzo_cache_slot_size(const lzo_cache_t *c)
+{
+  return (size_t) c->head->slot_size;
+}
+
+size_t
+lzo_cache_slots(const lzo_cache_t *c)
+{
+  return (size_t) c->head->nshards * c->head->per_shard;
+}
+
+/* the slot holding a key in the chain at *bucket, or CACHE_NIL */
+static unsigned int
+find(lzo_cache_t *c, unsigned int *bucket, unsigned long long file,
+     unsigned long long block)
+{
+  unsigned int i;
+
+  for (i = *bucket; i != CACHE_NIL; i = c->slots[i].next)
+    if (c->slots[i].file == file && c->slots[i].block == block)
+      return i;
+  return CACHE_NIL;
+}
+
+static unsigned int *
+bucket_of(lzo_cache_t *c, unsigned long long h, unsigned int *shard)
+{
+  *shard = (unsigned int) (h % c->head->nshards);
+  return &c->buckets[*shard * c->head->nbuckets
+                     + ((unsigned int) (h >> 32) & (c->head->nbuckets - 1))];
+}
+
+int
+lzo_cache_get(lzo_cache_t *c, unsigned long long file, unsigned long long block,
+              void *out, size_t len)
+{
+  unsigned int s, i, *bucket = bucket_of(c, key_hash(file, block), &s);
+  int found = 0;
+
+  shard_lock(c, s);
+  i = find(c, bucket, file, block);
+  if (i != CACHE_NIL && c->slots[i].len == len) {
+    memcpy(out, c->data + (size_t) i * c->head->slot_size, len);
+    c->slots[i].ref = 1;
+    found = 1;
+    c->shards[s].hits++;
+  } else
+    c->shards[s].misses++;
+  shard_unlock(c, s);
+  return found;
+}
+
+/* a free slot of shard s, evicting the first one the clock hand finds
+ * not read since it last passed */
+static unsigned int
+victim(lzo_cache_t *c, unsigned int s)
+{
+  struct cache_shard *sh = &c->shards[s];
+  unsigned int i, same, *p;
+
+  for (;;) {
+    struct cache_slot *slot;
+
+    i = s * c->head->per_shard + sh->hand;
+    slot = &c->slots[i];
+    if (++sh->hand == c->head->per_shard)
+      sh->hand = 0;
+    if (!slot->used)
+      return i;
+    if (slot->ref) {
+      slot->ref = 0;
+      continue;
+    }
+    for (p = bucket_of(c, key_hash(slot->file, slot->block), &same); *p != i;
+         p = &c->slots[*p].next)
+      ;
+    *p = slot->next;
+    slot->used = 0;
+    sh->used--;
+    sh->evictions++;
+    return i;
+  }
+}
+
+int
+lzo_cache_put(lzo_cache_t *c, unsigned long long file, unsigned long long block,
+              const void *data, size_t len)
+{
+  unsigned int s, i, *bucket = bucket_of(c, key_hash(file, block), &s);
+
+  if (len > c->head->slot_size)
+    return 0;
+  shard_lock(c, s);
+  i = find(c, bucket, file, block);
+  if (i == CACHE_NIL) {
+    i = victim(c, s);
+    c->slots[i].file = file;
+    c->slots[i].block = block;
+    c->slots[i].next = *bucket;
+    c->slots[i].used = 1;
+    *bucket = i;
+    c->shards[s].used++;
+    c->shards[s].inserts++;
+  }
+  memcpy(c->data + (size_t) i * c->head->slot_size, data, len);
+  c->slots[i].len = (unsigned int) len;
+  c->slots[i].ref = 1;
+  shard_unlock(c, s);
+  return 1;
+}
+
+void
+lzo_cache_stats(lzo_cache_t *c, lzo_cache_stats_t *st)
+{
+  unsigned int s;
+
+  memset(st, 0, sizeof(*st));
+  for (s = 0; s < c->head->nshards; s++) {
+    shard_lock(c, s);
+    st->hits += c->shards[s].hits;
+    st->misses += c->shards[s].misses;
+    st->inserts += c->shards[s].inserts;
+    st->evictions += c->shards[s].evictions;
+    st->used += c->shards[s].used;
+    shard_unlock(c, s);
+  }
+}
+
+#endif
@@ -0,0 +1,59 @@
+/*
+ * Decoded blocks shared between processes.
+ *
+ * The cache is one shared memory segment: anonymous, so the children a
+ * process forks after creating it (pre-fork servers) all see it, or a
+ * named POSIX shm object any process can open.  It holds fixed size
+ * slots, each one a decoded block keyed by (file id, block number); the
+ * file id is the caller's, it should change whenever the file does.
+ *
+ * The slots are split into shards by the hash of the key, every shard
+ * with its own process-shared lock, hash chains and clock hand, so
+ * processes touching different blocks seldom wait for each other.  A
+ * block is copied in and out under the lock of its shard, no pointer
+ * into the segment is handed out.  When a process dies holding a lock
+ * (on Linux, where the locks are robust) the next one to take it empties
+ * that shard.  Not available on Windows.
+ */
+
+#ifndef LZOCACHE_H
+#define LZOCACHE_H
+
+#include <stddef.h>
+
+typedef struct lzo_cache lzo_cache_t;
+
+typedef struct {
+  unsigned long hits, misses;
+  unsigned long inserts, evictions;
+  unsigned long used;           /* slots holding a block */
+} lzo_cache_stats_t;
+
+/* a cache of about size bytes of blocks up to slot_size bytes each, in
+ * shards parts (0 for a default).  With name, open the shm object of that
+ * name, creating it if there is none; an existing one keeps the geometry
+ * it was created with.  Returns NULL with *err set to an errno */
+lzo_cache_t *lzo_cache_open(const char *name, size_t size, size_t slot_size,
+                            int shards, int *err);
+void lzo_cache_close(lzo_cache_t *c);
+
+/* remove the name of a named cache, those open keep it.  0 or an errno */
+int lzo_cache_unlink(const char *name);
+
+size_t lzo_cache_slot_size(const lzo_cache_t *c);
+size_t lzo_cache_slots(const lzo_cache_t *c);
+
+/* copy block (file, block) to out if it is cached with length len.
+ * Returns 1 if it was, else 0 */
+int lzo_cache_get(lzo_cache_t *c, unsigned long long file,
+                  unsigned long long block, void *out, size_t len);
+
+/* store a block, evicting one of its shard if needed.  Returns 1, or 0
+ * if it is larger than a slot */
+int lzo_cache_put(lzo_cache_t *c, unsigned long long file,
+                  unsigned long long block, const void *data, size_t len);
+
+/* counters summed over all processes using the cache */
+void lzo_cache_stats(lzo_cache_t *c, lzo_cache_stats_t *s);
+
+#endif
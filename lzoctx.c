@@ -0,0 +1,76 @@
+/*
+ * Compression contexts for small messages, see lzoctx.h.
+ *
+ * The history and the message being compressed sit next to each other in
+ * buf, so lzo1x_1_compress_window sees them as one buffer.  When the next
+ * message doesn't fit any more, buf drops all but the last LZO_CTX_WINDOW
+ * bytes and the dictionary is moved along with it.
+ */
+
+#include <string.h>
+#include "lzoctx.h"
+
+void
+lzo_ctx_init(lzo_ctx_t *c)
+{
+  c->len = 0;
+  memset(c->wrkmem, 0, sizeof(c->wrkmem));
+}
+
+void
+lzo_dctx_init(lzo_dctx_t *d)
+{
+  lzo_stream_init(&d->s, NULL, 0, 0);
+}
+
+/* make in[0..n) the history, with a dictionary of just that */
+static void
+set_history(lzo_ctx_t *c, const lzo_bytep in, lzo_uint n)
+{
+  memcpy(c->buf, in, n);
+  c->len = n;
+  memset(c->wrkmem, 0, sizeof(c->wrkmem));
+  lzo1x_1_window_fill(c->buf, n, c->wrkmem);
+}
+
+int
+lzo_ctx_compress(lzo_ctx_t *c, const lzo_bytep in, lzo_uint in_len,
+                 lzo_bytep out, lzo_uintp out_len)
+{
+  int err;
+
+  if (in_len > LZO_CTX_MAX) {
+    lzo_uint keep = in_len < LZO_CTX_WINDOW ? in_len : LZO_CTX_WINDOW;
+
+    err = lzo1x_1_compress(in, in_len, out, out_len, c->wrkmem);
+    set_history(c, in + in_len - keep, keep);
+    return err;
+  }
+
+  if (c->len + in_len > sizeof(c->buf)) {
+    lzo_uint shift = c->len - LZO_CTX_WINDOW;
+
+    memmove(c->buf, c->buf + shift, LZO_CTX_WINDOW);
+    c->len = LZO_CTX_WINDOW;
+    lzo1x_1_window_shift(c->wrkmem, shift);
+  }
+  memcpy(c->buf + c->len, in, in_len);
+  err = lzo1x_1_compress_window(c->buf, c->len + in_len, c->len,
+                                out, out_len, c->wrkmem);
+  c->len += in_len;
+  return err;
+}
+
+int
+lzo_dctx_decompress(lzo_dctx_t *d, const lzo_bytep in, lzo_uint in_len,
+                    lzo_bytep out, lzo_uintp out_len)
+{
+  lzo_uint dst_len = *out_len;
+  int err;
+
+  lzo_stream_reset(&d->s, in, in_len, dst_len);
+  err = lzo_stream_decode(&d->s, out, out_len);
+  if (err == LZO_E_OK && (*out_len != dst_len || !lzo_stream_eof(&d->s)))
+    err = LZO_E_ERROR;
+  return err;
+}
@@ -0,0 +1,54 @@
+/*
+ * Compression contexts for a sequence of small messages.
+ *
+ * Each message is compressed into a stream of its own, but its matches may
+ * reach back into the messages before it (up to LZO_CTX_WINDOW bytes), so
+ * a chatty protocol that repeats headers and field names across messages
+ * compresses far better than with one lzo1x_1_compress per message.  The
+ * receiver needs every message, in order, through one lzo_dctx_t: its
+ * decoder keeps the window of the previous messages.
+ *
+ * The compressor keeps its dictionary between messages instead of clearing
+ * it, so a message costs about what compressing it alone would.  Messages
+ * over LZO_CTX_MAX bytes are compressed on their own and only become
+ * history for the next ones.
+ */
+
+#ifndef LZOCTX_H
+#define LZOCTX_H
+
+#include "minilzo.h"
+#include "lzostream.h"
+
+/* how far back matches may reach, M4_MAX_OFFSET + 1 */
+#define LZO_CTX_WINDOW      49152
+#define LZO_CTX_MAX         16384
+
+typedef struct {
+  lzo_uint len;                 /* bytes of history in buf */
+  unsigned char buf[LZO_CTX_WINDOW + LZO_CTX_MAX];
+  lzo_align_t wrkmem[LZO1X_1_MEM_COMPRESS / sizeof(lzo_align_t) + 1];
+} lzo_ctx_t;
+
+typedef struct {
+  lzo_stream_t s;
+} lzo_dctx_t;
+
+/* start without history */
+void lzo_ctx_init(lzo_ctx_t *c);
+void lzo_dctx_init(lzo_dctx_t *d);
+
+/* compress the next message into out, which has room for
+ * lzo_ctx_bound(in_len) bytes */
+int lzo_ctx_compress(lzo_ctx_t *c, const lzo_bytep in, lzo_uint in_len,
+                     lzo_bytep out, lzo_uintp out_len);
+
+#define lzo_ctx_bound(n)    ((n) + (n) / 16 + 64 + 3)
+
+/* decompress the next message, which has to produce exactly *out_len
+ * bytes.  After an error the context is lost, start over with
+ * lzo_dctx_init on both ends */
+int lzo_dctx_decompress(lzo_dctx_t *d, const lzo_bytep in, lzo_uint in_len,
+                        lzo_bytep out, lzo_uintp out_len);
+
+#endif
@@ -0,0 +1,160 @@
+/*
+ * In-place LZO1X decompression, see lzoinplace.h.
+ *
+ * The instruction walk follows lzo1x_decompress_safe (and parse() in
+ * lzostream.c).  Positions are kept as offsets into the shared buffer:
+ * the block starts at off, the output at 0.  A literal run is copied
+ * forwards, chunks read before they are written, so it only needs its
+ * start at or before the input it copies; a match has to end before the
+ * first input byte not read yet.  Both keep two bytes more: after a match
+ * the decoder reads ip[-2] again for the count of literals that follow.
+ */
+
+#include <string.h>
+#include "lzoinplace.h"
+
+#define M2_MAX_OFFSET   0x0800
+
+#define NEED_IP(x) \
+  if (in_len - ip < (lzo_uint)(x)) return LZO_E_INPUT_OVERRUN
+#define TEST_IV(x) \
+  if ((x) > (lzo_uint)0 - 511) return LZO_E_INPUT_OVERRUN
+
+/* lzo_uint t = length of a run, extended by zero bytes and one more */
+#define RUN(t, base) \
+  if (t == 0) { \
+    NEED_IP(1); \
+    while (in[ip] == 0) { \
+      t += 255; \
+      ip++; \
+      TEST_IV(t); \
+      NEED_IP(1); \
+    } \
+    t += base + in[ip++]; \
+  }
+
+int
+lzo_inplace_check(const lzo_bytep in, lzo_uint in_len, lzo_uint off,
+                  lzo_uint dst_len)
+{
+  lzo_uint ip = 0, op = 0;
+  lzo_uint t, lit, mlen, moff;
+
+  NEED_IP(1);
+  if (in[0] > 17) {
+    lit = in[ip++] - 17;
+    if (lit >= 4)
+      goto first_literals;
+    goto literals;
+  }
+
+  for (;;) {
+    NEED_IP(1);
+    t = in[ip++];
+    if (t < 16) {
+      RUN(t, 15);
+      lit = t + 3;
+
+first_literals:
+      NEED_IP(lit);
+      if (lit > dst_len - op)
+        return LZO_E_OUTPUT_OVERRUN;
+      if (op + 2 > off + ip)
+        return LZO_E_ERROR;
+      op += lit;
+      ip += lit;
+
+      NEED_IP(1);
+      t = in[ip++];
+      if (t < 16) {
+        NEED_IP(1);
+        moff = 1 + M2_MAX_OFFSET + (t >> 2) + ((lzo_uint) in[ip++] << 2);
+        mlen = 3;
+        goto match_done;
+      }
+    }
+    else
+      goto match;
+
+    for (;;) {
+match:
+      if (t >= 64) {
+        NEED_IP(1);
+        moff = 1 + ((t >> 2) & 7) + ((lzo_uint) in[ip++] << 3);
+        mlen = (t >> 5) + 1;
+      }
+      else if (t >= 32) {
+        t &= 31;
+        RUN(t, 31);
+        NEED_IP(2);
+        moff = 1 + (in[ip] >> 2) + ((lzo_uint) in[ip + 1] << 6);
+        ip += 2;
+        mlen = t + 2;
+      }
+      else if (t >= 16) {
+        moff = (t & 8) << 11;
+        t &= 7;
+        RUN(t, 7);
+        NEED_IP(2);
+        moff += (in[ip] >> 2) + ((lzo_uint) in[ip + 1] << 6);
+        ip += 2;
+        if (moff == 0) {
+          if (op != dst_len)
+            return LZO_E_ERROR;
+          return ip == in_len ? LZO_E_OK : LZO_E_INPUT_NOT_CONSUMED;
+        }
+        moff += 0x4000;
+        mlen = t + 2;
+      }
+      else {
+        NEED_IP(1);
+        moff = 1 + (t >> 2) + ((lzo_uint) in[ip++] << 2);
+        mlen = 2;
+      }
+
+match_done:
+      if (moff > op)
+        return LZO_E_LOOKBEHIND_OVERRUN;
+      if (mlen > dst_len - op)
+        return LZO_E_OUTPUT_OVERRUN;
+      if (op + mlen + 2 > off + ip)
+        return LZO_E_ERROR;
+      op += mlen;
+
+      lit = in[ip - 2] & 3;
+      if (lit == 0)
+        break;
+
+literals:
+      NEED_IP(lit);
+      if (lit > dst_len - op)
+        return LZO_E_OUTPUT_OVERRUN;
+      if (op + 2 > off + ip)
+        return LZO_E_ERROR;
+      op += lit;
+      ip += lit;
+      NEED_IP(1);
+      t = in[ip++];
+    }
+  }
+}
+
+int
+lzo_inplace_decompress(lzo_bytep buf, lzo_uint off, lzo_uint in_len,
+                       lzo_uint dst_len)
+{
+  lzo_uint len = dst_len;
+  int err;
+
+  if (in_len == dst_len) {
+    memmove(buf, buf + off, dst_len);
+    return LZO_E_OK;
+  }
+  err = lzo_inplace_check(buf + off, in_len, off, dst_len);
+  if (err != LZO_E_OK)
+    return err;
+  err = lzo1x_decompress_safe(buf + off, in_len, buf, &len, NULL);
+  if (err == LZO_E_OK && len != dst_len)
+    err = LZO_E_ERROR;
+  return err;
+}
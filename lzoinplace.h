@@ -0,0 +1,37 @@
+/*
+ * In-place LZO1X decompression.
+ *
+ * A compressed block placed at the end of a buffer of dst_len +
+ * lzo_inplace_margin(dst_len) bytes can be decoded to the start of the
+ * same buffer: the output only catches up with the unread input if some
+ * tail of the block expands by more than the margin, and lzo1x_1_compress
+ * never does that.  Peak memory is then one buffer instead of the block
+ * plus its output.
+ *
+ * A block from elsewhere may not keep to that, so lzo_inplace_decompress
+ * first walks its instructions without copying anything and refuses it
+ * before the buffer is touched if a write would land on input still to
+ * be read.
+ */
+
+#ifndef LZOINPLACE_H
+#define LZOINPLACE_H
+
+#include "minilzo.h"
+
+/* the worst case expansion of lzo1x_1_compress */
+#define lzo_inplace_margin(n)   ((n) / 16 + 64 + 3)
+
+/* check that the in_len byte block at buf + off decodes to exactly dst_len
+ * bytes at buf without overwriting its own unread input. Returns LZO_E_OK,
+ * LZO_E_ERROR if the overlap is too small, or the lzo1x_decompress_safe
+ * error for a corrupt block */
+int lzo_inplace_check(const lzo_bytep in, lzo_uint in_len, lzo_uint off,
+                      lzo_uint dst_len);
+
+/* decode the in_len byte block at buf + off to buf[0..dst_len), after
+ * lzo_inplace_check. A block as long as dst_len is stored and moved */
+int lzo_inplace_decompress(lzo_bytep buf, lzo_uint off, lzo_uint in_len,
+                           lzo_uint dst_len);
+
+#endif
@@ -0,0 +1,561 @@
+/*
+ * Decoded view of a whole lzop file, see lzomap.h.
+ *
+ * A lazy map is an anonymous mapping registered with a userfaultfd for
+ * missing pages.  Its thread reads the fault messages and serves each
+ * with the pages of the faulting block still missing: they are put
+ * together in a scratch buffer and placed with UFFDIO_COPY, which also
+ * wakes the faulting thread.  A page on a block boundary takes its other
+ * part from the neighbouring block.  The last block decoded is kept, so
+ * a sequential reader decodes every block once.
+ *
+ * Only a full userfaultfd serves the faults the kernel takes on the map,
+ * as when a write(2) reads from it.  Where only one for user mode may be
+ * had, lzo_map_fault_in touches every page before the memory is handed
+ * to anyone who may pass it to a syscall.
+ */
+
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE
+#endif
+
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+#include "lzomap.h"
+#include "lzopool.h"
+
+#ifdef _WIN32
+#  include <io.h>
+#else
+#  include <sys/mman.h>
+#  include <sys/types.h>
+#  include <unistd.h>
+#endif
+
+#if defined(__linux__) && defined(__GNUC__)
+#  include <fcntl.h>
+#  include <poll.h>
+#  include <pthread.h>
+#  include <signal.h>
+#  include <sys/ioctl.h>
+#  include <sys/syscall.h>
+#  include <linux/userfaultfd.h>
+#  if defined(__NR_userfaultfd) && defined(UFFDIO_COPY)
+#    define LZO_MAP_UFFD 1
+#  endif
+#endif
+
+#ifndef UFFD_USER_MODE_ONLY
+#define UFFD_USER_MODE_ONLY 1
+#endif
+
+struct lzo_map {
+  int fd;
+  unsigned long flags;
+  lzo_map_block *blocks;
+  size_t nblocks;
+  size_t size;                  /* content bytes */
+  size_t len;                   /* mapped bytes, whole pages */
+  size_t page;
+  lzo_uint max_src;
+  lzo_uint max_dst;
+  lzo_bytep base;
+  int lazy;
+  unsigned long faults, decodes, errors;
+#ifdef LZO_MAP_UFFD
+  int uffd;
+  int user_only;                /* faults in the kernel are not served */
+  int wake[2];                  /* closing wake[1] stops the thread */
+  pthread_t thread;
+  unsigned char *present;       /* a byte per page */
+  lzo_bytep scratch;            /* the pages being served */
+  lzo_bytep in;                 /* a compressed block */
+  lzo_bytep out;                /* the last block decoded */
+  size_t cached;                /* its number, nblocks for none */
+  int cached_ok;
+  unsigned char *failed;        /* a byte per block, set if it is bad */
+#endif
+};
+
+static lzo_uint32_t
+get32(const unsigned char *p)
+{
+  return (lzo_uint32_t) p[0] << 24 | (lzo_uint32_t) p[1] << 16
+    | (lzo_uint32_t) p[2] << 8 | p[3];
+}
+
+/* read exactly len bytes at off, 0 or -1 */
+static int
+read_at(int fd, void *buf, size_t len, long long off)
+{
+  size_t done = 0;
+
+  while (done < len) {
+    long n;
+
+#ifdef _WIN32
+    if (_lseeki64(fd, off + (long long) done, SEEK_SET) < 0)
+      return -1;
+    n = _read(fd, (char *) buf + done, (unsigned) (len - done));
+#else
+    n = (long) pread(fd, (char *) buf + done, len - done, (off_t) (off + (long long) done));
+#endif
+    if (n < 0 && errno == EINTR)
+      continue;
+    if (n <= 0)
+      return -1;
+    done += (size_t) n;
+  }
+  return 0;
+}
+
+/* decode block k to out (dst_len bytes), checking the adler32 sums of
+   the file; in holds src_len bytes */
+static int
+decode_block(const lzo_map_t *m, size_t k, lzo_bytep in, lzo_bytep out)
+{
+  const lzo_map_block *b = &m->blocks[k];
+  int packed = b->src_len < b->dst_len;
+  unsigned char head[24];
+  size_t head_len = 8;
+  long d_adler32 = -1, c_adler32 = -1;
+  lzo_uint out_len = b->dst_len;
+  int err = LZO_E_OK;
+
+  if (m->flags & LZO_MAP_ADLER32_D)
+    head_len += 4;
+  if (m->flags & LZO_MAP_CRC32_D)
+    head_len += 4;
+  if (packed && (m->flags & LZO_MAP_ADLER32_C))
+    head_len += 4;
+  if (packed && (m->flags & LZO_MAP_CRC32_C))
+    head_len += 4;
+  if (read_at(m->fd, head, head_len, b->file_off) != 0
+      || get32(head) != b->dst_len || get32(head + 4) != b->src_len)
+    return LZO_E_ERROR;
+  if (m->flags & LZO_MAP_ADLER32_D)
+    d_adler32 = (long) get32(head + 8);
+  if (packed && (m->flags & LZO_MAP_ADLER32_C))
+    c_adler32 = (long) get32(head + head_len - ((m->flags & LZO_MAP_CRC32_C) ? 8 : 4));
+
+  if (!packed) {
+    if (read_at(m->fd, out, b->dst_len, b->file_off + (long long) head_len) != 0)
+      return LZO_E_ERROR;
+  }
+  else {
+    if (read_at(m->fd, in, b->src_len, b->file_off + (long long) head_len) != 0)
+      return LZO_E_ERROR;
+    if (c_adler32 >= 0 && lzo_adler32(1, in, b->src_len) != (lzo_uint32_t) c_adler32)
+      return LZO_E_ERROR;
+    err = lzo1x_decompress_safe(in, b->src_len, out, &out_len, NULL);
+    if (err == LZO_E_OK && out_len != b->dst_len)
+      err = LZO_E_ERROR;
+  }
+  if (err == LZO_E_OK && d_adler32 >= 0
+      && lzo_adler32(1, out, b->dst_len) != (lzo_uint32_t) d_adler32)
+    err = LZO_E_ERROR;
+  return err;
+}
+
+/* eager maps, every block straight into the mapping */
+static void
+fill_one(void *ctx, int k)
+{
+  lzo_map_t *m = (lzo_map_t *) ctx;
+  const lzo_map_block *b = &m->blocks[k];
+  lzo_bytep in = (lzo_bytep) malloc(b->src_len);
+
+  if (in == NULL || decode_block(m, (size_t) k, in, m->base + b->data_off) != LZO_E_OK) {
+#ifdef __GNUC__
+    __atomic_add_fetch(&m->errors, 1, __ATOMIC_RELAXED);
+#else
+    m->errors++;
+#endif
+  }
+  free(in);
+}
+
+#ifdef LZO_MAP_UFFD
+
+/* the last block starting at or before off */
+static size_t
+find_block(const lzo_map_t *m, size_t off)
+{
+  size_t lo = 0, hi = m->nblocks;
+
+  while (hi - lo > 1) {
+    size_t mid = lo + (hi - lo) / 2;
+
+    if ((size_t) m->blocks[mid].data_off <= off)
+      lo = mid;
+    else
+      hi = mid;
+  }
+  return lo;
+}
+
+static lzo_bytep
+block_data(lzo_map_t *m, size_t k)
+{
+  if (m->cached != k) {
+    m->cached = k;
+    m->cached_ok = decode_block(m, k, m->in, m->out) == LZO_E_OK;
+    __atomic_add_fetch(&m->decodes, 1, __ATOMIC_RELAXED);
+    if (!m->cached_ok) {
+      __atomic_store_n(&m->failed[k], 1, __ATOMIC_RELEASE);
+      __atomic_add_fetch(&m->errors, 1, __ATOMIC_RELAXED);
+    }
+  }
+  return m->cached_ok ? m->out : NULL;
+}
+
+/* serve a fault at offset at of the mapping */
+static void
+serve(lzo_map_t *m, size_t at)
+{
+  size_t page = m->page;
+  const lzo_map_block *b;
+  size_t first, last, lo, hi, j;
+  struct uffdio_copy copy;
+
+  at = at / page * page;
+  if (at >= m->len)
+    return;
+  if (m->nblocks > 0) {
+    b = &m->blocks[find_block(m, at)];
+    lo = (size_t) b->data_off / page * page;
+    hi = ((size_t) b->data_off + b->dst_len + page - 1) / page * page;
+  }
+  else
+    lo = hi = 0;
+  first = at;
+  last = at + page;
+  while (first > lo && !m->present[first / page - 1])
+    first -= page;
+  while (last < hi && last < m->len && !m->present[last / page])
+    last += page;
+
+  memset(m->scratch, 0, last - first);
+  for (j = m->nblocks > 0 ? find_block(m, first) : 0;
+       j < m->nblocks && (size_t) m->blocks[j].data_off < last; j++) {
+    size_t start = (size_t) m->blocks[j].data_off;
+    size_t s = start > first ? start : first;
+    size_t e = start + m->blocks[j].dst_len < last ? start + m->blocks[j].dst_len : last;
+    lzo_bytep data;
+
+    if (s >= e)
+      continue;
+    data = block_data(m, j);
+    if (data != NULL)
+      memcpy(m->scratch + (s - first), data + (s - start), e - s);
+  }
+
+  __atomic_add_fetch(&m->faults, 1, __ATOMIC_RELAXED);
+  copy.dst = (unsigned long) (m->base + first);
+  copy.src = (unsigned long) m->scratch;
+  copy.len = last - first;
+  copy.mode = 0;
+  copy.copy = 0;
+  if (ioctl(m->uffd, UFFDIO_COPY, &copy) != 0) {
+    /* pages there already (EEXIST): let the faulting thread retry */
+    struct uffdio_range range;
+
+    range.start = (unsigned long) (m->base + at);
+    range.len = page;
+    ioctl(m->uffd, UFFDIO_WAKE, &range);
+  }
+  memset(m->present + first / page, 1, (last - first) / page);
+}
+
+static void *
+serve_faults(void *arg)
+{
+  lzo_map_t *m = (lzo_map_t *) arg;
+  struct pollfd p[2];
+
+  p[0].fd = m->uffd;
+  p[0].events = POLLIN;
+  p[1].fd = m->wake[0];
+  p[1].events = POLLIN;
+  for (;;) {
+    struct uffd_msg msg;
+
+    if (poll(p, 2, -1) < 0) {
+      if (errno == EINTR)
+        continue;
+      break;
+    }
+    if (p[1].revents)
+      break;
+    if (read(m->uffd, &msg, sizeof(msg)) != (ssize_t) sizeof(msg))
+      continue;
+    if (msg.event == UFFD_EVENT_PAGEFAULT)
+      serve(m, (size_t) (msg.arg.pagefault.address - (unsigned long) m->base));
+  }
+  return NULL;
+}
+
+/* register m->base with a userfaultfd and start its thread, 0 or -1 */
+static int
+uffd_start(lzo_map_t *m)
+{
+  struct uffdio_api api;
+  struct uffdio_register reg;
+  sigset_t all, old;
+  int r;
+
+  m->uffd = (int) syscall(__NR_userfaultfd, O_CLOEXEC | O_NONBLOCK);
+  if (m->uffd < 0 && errno == EPERM) {  /* vm.unprivileged_userfaultfd = 0 */
+    m->uffd = (int) syscall(__NR_userfaultfd,
+                            O_CLOEXEC | O_NONBLOCK | UFFD_USER_MODE_ONLY);
+    m->user_only = 1;
+  }
+  if (m->uffd < 0)
+    return -1;
+  memset(&api, 0, sizeof(api));
+  api.api = UFFD_API;
+  memset(&reg, 0, sizeof(reg));
+  reg.range.start = (unsigned long) m->base;
+  reg.range.len = m->len;
+  reg.mode = UFFDIO_REGISTER_MODE_MISSING;
+  if (ioctl(m->uffd, UFFDIO_API, &api) != 0
+      || ioctl(m->uffd, UFFDIO_REGISTER, &reg) != 0
+      || !(reg.ioctls & ((__u64) 1 << _UFFDIO_COPY)))
+    return -1;
+
+  m->present = (unsigned char *) calloc(m->len / m->page, 1);
+  m->scratch = (lzo_bytep) malloc(m->max_dst + 2 * m->page);
+  m->in = (lzo_bytep) malloc(m->max_src + 1);
+  m->out = (lzo_bytep) malloc(m->max_dst + 1);
+  m->failed = (unsigned char *) calloc(m->nblocks + 1, 1);
+  m->cached = m->nblocks;
+  if (m->present == NULL || m->scratch == NULL || m->in == NULL || m->out == NULL
+      || m->failed == NULL || pipe(m->wake) != 0)
+    return -1;
+
+  /* signals are for the Python threads */
+  sigfillset(&all);
+  pthread_sigmask(SIG_BLOCK, &all, &old);
+  r = pthread_create(&m->thread, NULL, serve_faults, m);
+  pthread_sigmask(SIG_SETMASK, &old, NULL);
+  if (r != 0) {
+    close(m->wake[0]);
+    close(m->wake[1]);
+    m->wake[0] = m->wake[1] = -1;
+    return -1;
+  }
+  return 0;
+}
+
+static void
+uffd_stop(lzo_map_t *m)
+{
+  if (m->wake[1] >= 0) {
+    close(m->wake[1]);
+    pthread_join(m->thread, NULL);
+    close(m->wake[0]);
+  }
+  if (m->uffd >= 0)
+    close(m->uffd);
+  m->uffd = m->wake[0] = m->wake[1] = -1;
+  free(m->present);
+  free(m->scratch);
+  free(m->in);
+  free(m->out);
+  free(m->failed);
+  m->present = m->scratch = m->in = m->out = NULL;
+  m->failed = NULL;
+}
+
+#endif /* LZO_MAP_UFFD */
+
+lzo_map_t *
+lzo_map_open(int fd, const lzo_map_block *blocks, size_t n,
+             unsigned long flags, int lazy, int *err)
+{
+  lzo_map_t *m = (lzo_map_t *) calloc(1, sizeof(lzo_map_t));
+  size_t i;
+
+  if (m == NULL) {
+    *err = LZO_E_OUT_OF_MEMORY;
+    return NULL;
+  }
+  m->fd = -1;
+#ifdef LZO_MAP_UFFD
+  m->uffd = m->wake[0] = m->wake[1] = -1;
+#endif
+  m->flags = flags;
+  m->nblocks = n;
+  m->blocks = (lzo_map_block *) malloc((n + 1) * sizeof(lzo_map_block));
+  if (m->blocks == NULL) {
+    lzo_map_close(m);
+    *err = LZO_E_OUT_OF_MEMORY;
+    return NULL;
+  }
+  for (i = 0; i < n; i++) {
+    m->blocks[i] = blocks[i];
+    if (blocks[i].data_off != (long long) m->size || blocks[i].dst_len == 0
+        || blocks[i].src_len == 0 || blocks[i].src_len > blocks[i].dst_len) {
+      lzo_map_close(m);
+      *err = LZO_E_ERROR;
+      return NULL;
+    }
+    m->size += blocks[i].dst_len;
+    if (blocks[i].src_len > m->max_src)
+      m->max_src = blocks[i].src_len;
+    if (blocks[i].dst_len > m->max_dst)
+      m->max_dst = blocks[i].dst_len;
+  }
+
+#ifdef _WIN32
+  m->fd = _dup(fd);
+  m->page = 4096;
+#else
+  m->fd = dup(fd);
+  m->page = (size_t) sysconf(_SC_PAGESIZE);
+#endif
+  m->len = m->size > 0 ? (m->size + m->page - 1) / m->page * m->page : m->page;
+  if (m->fd < 0) {
+    *err = errno;
+    lzo_map_close(m);
+    return NULL;
+  }
+#ifdef _WIN32
+  m->base = (lzo_bytep) malloc(m->len);
+#else
+  m->base = (lzo_bytep) mmap(NULL, m->len, PROT_READ | PROT_WRITE,
+                             MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  if (m->base == (lzo_bytep) MAP_FAILED)
+    m->base = NULL;
+#endif
+  if (m->base == NULL) {
+    lzo_map_close(m);
+    *err = LZO_E_OUT_OF_MEMORY;
+    return NULL;
+  }
+
+#ifdef LZO_MAP_UFFD
+  if (lazy && uffd_start(m) == 0) {
+    /* a forked child would see zero pages, and no one serves its faults:
+       it gets no copy of a lazy map at all */
+    madvise(m->base, m->len, MADV_DONTFORK);
+    m->lazy = 1;
+    return m;
+  }
+  uffd_stop(m);
+  m->user_only = 0;
+#else
+  (void) lazy;
+#endif
+
+#ifdef _WIN32
+  /* read_at seeks the shared descriptor, one block at a time */
+  for (i = 0; i < n; i++)
+    fill_one(m, (int) i);
+#else
+  lzo_pool_run((int) n, fill_one, m, LZO_POOL_BULK);
+#endif
+  m->decodes = n;
+  if (m->errors > 0) {
+    lzo_map_close(m);
+    *err = LZO_E_ERROR;
+    return NULL;
+  }
+  return m;
+}
+
+void
+lzo_map_close(lzo_map_t *m)
+{
+  if (m == NULL)
+    return;
+#ifdef LZO_MAP_UFFD
+  uffd_stop(m);
+#endif
+  if (m->base != NULL) {
+#ifdef _WIN32
+    free(m->base);
+#else
+    munmap(m->base, m->len);
+#endif
+  }
+  if (m->fd >= 0) {
+#ifdef _WIN32
+    _close(m->fd);
+#else
+    close(m->fd);
+#endif
+  }
+  free(m->blocks);
+  free(m);
+}
+
+const void *
+lzo_map_addr(const lzo_map_t *m)
+{
+  return m->base;
+}
+
+size_t
+lzo_map_size(const lzo_map_t *m)
+{
+  return m->size;
+}
+
+int
+lzo_map_lazy(const lzo_map_t *m)
+{
+  return m->lazy;
+}
+
+void
+lzo_map_fault_in(lzo_map_t *m)
+{
+#ifdef LZO_MAP_UFFD
+  size_t at;
+
+  if (!__atomic_load_n(&m->user_only, __ATOMIC_ACQUIRE))
+    return;
+  for (at = 0; at < m->len; at += m->page)
+    (void) *(volatile unsigned char *) (m->base + at);
+  /* every page is there now, and stays */
+  __atomic_store_n(&m->user_only, 0, __ATOMIC_RELEASE);
+#else
+  (void) m;
+#endif
+}
+
+int
+lzo_map_failed(const lzo_map_t *m, size_t off, size_t len)
+{
+#ifdef LZO_MAP_UFFD
+  size_t j;
+
+  if (!m->lazy || len == 0 || m->nblocks == 0)
+    return 0;
+  for (j = find_block(m, off); j < m->nblocks && (size_t) m->blocks[j].data_off < off + len; j++)
+    if (__atomic_load_n(&m->failed[j], __ATOMIC_ACQUIRE))
+      return 1;
+#else
+  (void) m;
+  (void) off;
+  (void) len;
+#endif
+  return 0;
+}
+
+void
+lzo_map_stats(const lzo_map_t *m, unsigned long *faults,
+              unsigned long *decodes, unsigned long *errors)
+{
+#ifdef __GNUC__
+  *faults = __atomic_load_n(&m->faults, __ATOMIC_RELAXED);
+  *decodes = __atomic_load_n(&m->decodes, __ATOMIC_RELAXED);
+  *errors = __atomic_load_n(&m->errors, __ATOMIC_RELAXED);
+#else
+  *faults = m->faults;
+  *decodes = m->decodes;
+  *errors = m->errors;
+#endif
+}
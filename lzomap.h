@@ -0,0 +1,76 @@
+/*
+ * The whole uncompressed content of an lzop file as one block of memory.
+ *
+ * A lazy map only reserves the address space: on Linux it is registered
+ * with a userfaultfd, and a thread of the map decodes the block holding
+ * a page when that page is first touched, so a reader that looks at a
+ * few places of a large file decodes just those blocks.  Where the
+ * userfaultfd can't be had (another OS, a kernel or a seccomp filter
+ * refusing it, vm.unprivileged_userfaultfd), or when it is not asked
+ * for, the map is filled at once on the thread pool instead; the caller
+ * sees the same memory either way.
+ *
+ * The blocks come from an index of the file (see LzoIndex in lzo.py).
+ * Their adler32 checksums are verified as they are decoded.  A bad block
+ * makes lzo_map_open fail for a map filled at once.  In a lazy map its
+ * bytes read as zeros and it counts in the errors of lzo_map_stats; a
+ * reader that copies bytes out asks lzo_map_failed afterwards.  Plain
+ * loads through lzo_map_addr, like those of a buffer handed out, have no
+ * way to learn of it.
+ *
+ * A process forked after lzo_map_open shares a map filled at once, copy
+ * on write.  A lazy map is not inherited: no thread of the child would
+ * serve its faults, so touching it there is a segmentation fault.
+ */
+
+#ifndef LZOMAP_H
+#define LZOMAP_H
+
+#include <stddef.h>
+#include "minilzo.h"
+
+/* lzop header flags naming the checksums of a block */
+#define LZO_MAP_ADLER32_D   0x00000001L
+#define LZO_MAP_ADLER32_C   0x00000002L
+#define LZO_MAP_CRC32_D     0x00000100L
+#define LZO_MAP_CRC32_C     0x00000200L
+
+typedef struct {
+  long long file_off;           /* of the block header */
+  long long data_off;           /* of the block in the content */
+  lzo_uint dst_len;
+  lzo_uint src_len;
+} lzo_map_block;
+
+typedef struct lzo_map lzo_map_t;
+
+/* map the content of the lzop file fd, whose n blocks are blocks[] (in
+ * order, back to back) and header flags are flags.  The map keeps a
+ * duplicate of fd.  With lazy, decode on first touch where possible.
+ * Returns NULL with *err set to an LZO error (LZO_E_ERROR for a bad
+ * index or block, LZO_E_OUT_OF_MEMORY) or to a (positive) errno */
+lzo_map_t *lzo_map_open(int fd, const lzo_map_block *blocks, size_t n,
+                        unsigned long flags, int lazy, int *err);
+void lzo_map_close(lzo_map_t *m);
+
+const void *lzo_map_addr(const lzo_map_t *m);
+size_t lzo_map_size(const lzo_map_t *m);
+
+/* nonzero if m decodes on first touch */
+int lzo_map_lazy(const lzo_map_t *m);
+
+/* decode whatever is left of a lazy map whose userfaultfd only serves
+ * faults in user mode, so that syscalls can read it; nothing for other
+ * maps.  Call before the memory is handed out as a buffer */
+void lzo_map_fault_in(lzo_map_t *m);
+
+/* nonzero if a block holding content bytes [off, off + len) was found
+ * bad, which only happens in a lazy map and only once it was touched:
+ * call after reading them */
+int lzo_map_failed(const lzo_map_t *m, size_t off, size_t len);
+
+/* page faults served, blocks decoded and blocks that failed so far */
+void lzo_map_stats(const lzo_map_t *m, unsigned long *faults,
+                   unsigned long *decodes, unsigned long *errors);
+
+#endif
@@ -4,6 +4,15 @@
 #define PY_SSIZE_T_CLEAN
 #include <Python.h>
 #include "minilzo.h"
+#include "lzostream.h"
+#include "lzosegment.h"
+#include "lzopool.h"
+#include "lzoctx.h"
+#include "lzoinplace.h"
+#include "lzoopt.h"
+#include "lzoaio.h"
+#include "lzomap.h"
+#include "lzocache.h"
 
 /* Ensure we have updated versions 
 #if !defined(PY_VERSION_HEX) || (PY_VERSION_HEX < 0x010502f0)
@@ -19,21 +28,310 @@ static PyObject *LzoError;
 
 #define BLOCK_SIZE        (256*1024l)
 
+/* reads and writes in flight in compress_fd and decompress_fd */
+#define AIO_DEPTH         32
+
 #define M_LZO1X_1 1
 #define M_LZO1X_1_15 2
 #define M_LZO1X_999 3
 
+/* the LZO1X-999 level compressed by lzo1x_opt_compress; without liblzo it
+   does all of them */
+#define LZO_OPT_LEVEL 10
+#ifdef USE_LIBLZO
+#  define USE_OPT(method, level)  ((method) == M_LZO1X_999 && (level) >= LZO_OPT_LEVEL)
+#else
+#  define USE_OPT(method, level)  ((method) == M_LZO1X_999)
+#endif
+
 static /* const */ char compress__doc__[] =
 "compress one block, the block is splitted in python and should be lower than BLOCK_SIZE\n"
+"compress_block(block, method, level[, threads]): with threads > 1 a large\n"
+"LZO1X-1 block is cut into segments compressed in parallel and joined into\n"
+"one ordinary LZO1X stream. Method 3 (LZO1X-999) at level 10 is the in-tree\n"
+"suffix array encoder, the smallest output at a few MB/s, LZO1X-999 speed\n"
 ;
 static /* const */ char decompress__doc__[] =
 "decompress one block, the uncompressed size should be passed as second argument (which is know when parsing lzop structure)\n"
 ;
+static /* const */ char decompress_into__doc__[] =
+"decompress_into(block, dst, dst_len[, offset[, restarts[, threads]]])\n"
+"decompress one block into the writable buffer dst (bytearray, mmap, ...) at\n"
+"offset, returns dst_len. A block that is as long as dst_len is stored and\n"
+"just copied, like in lzop. With the restart points of the block, as from\n"
+"compress_block_restarts, its pieces are decoded on the thread pool if\n"
+"threads > 1\n"
+;
+static /* const */ char compress_block_restarts__doc__[] =
+"compress_block_restarts(block, segment_size[, threads]) -> (compressed, restarts)\n"
+"compress with LZO1X-1 so that no match crosses a multiple of segment_size\n"
+"(rounded up to 48 KiB), on the thread pool if threads > 1. restarts lists the\n"
+"(compressed offset, uncompressed offset) where decoding may begin afresh\n"
+;
+static /* const */ char decompress_many__doc__[] =
+"decompress_many(blocks, dst_lens[, threads]) decompress a list of blocks,\n"
+"returns the list of uncompressed strings. One call with the GIL released\n"
+"saves the per-call cost of decompress_block on small blocks; with\n"
+"threads > 1 the blocks are spread over the thread pool\n"
+;
+static /* const */ char compress_many__doc__[] =
+"compress_many(blocks, method, level[, threads]) compress a list of blocks,\n"
+"returns the list of compressed strings (like compress_block, a block that\n"
+"does not shrink comes back longer). With threads > 1 the blocks are\n"
+"compressed on the thread pool\n"
+;
+static /* const */ char compress_v__doc__[] =
+"compress_v(fragments, method, level[, threads]) compress a list of buffers\n"
+"as one block, like compress_block(b''.join(fragments), ...) but without\n"
+"joining them: large fragments are compressed in place, small neighbours\n"
+"are copied together. With threads > 1 fragments compress on the thread pool\n"
+;
+static /* const */ char decompress_into_v__doc__[] =
+"decompress_into_v(block, dsts, dst_len) decompress one block of dst_len\n"
+"bytes across the list of writable buffers dsts, filling each in turn (the\n"
+"last one used may stay partly unwritten); returns dst_len\n"
+;
+static /* const */ char decompress_inplace__doc__[] =
+"decompress_inplace(buf, src_len, dst_len) decompress the block in the last\n"
+"src_len bytes of the writable buffer buf to its first dst_len bytes, so no\n"
+"second buffer is needed; returns dst_len. buf must hold dst_len +\n"
+"inplace_margin(dst_len) bytes for any block from compress_block; a block\n"
+"that would overwrite its own input is refused before buf is changed\n"
+;
+static /* const */ char inplace_margin__doc__[] =
+"inplace_margin(dst_len) bytes beyond dst_len that decompress_inplace needs\n"
+"to decode a block of dst_len bytes in place\n"
+;
+static /* const */ char compress_fd__doc__[] =
+"compress_fd(src_fd, dst_fd, src_size, dst_off, block_size, method, level[,\n"
+"threads[, depth[, uring[, window]]]]) compress the first src_size bytes of\n"
+"src_fd as lzop blocks (with adler32 checksums) written to dst_fd from\n"
+"dst_off on, returns the offset after the last block. Up to depth blocks\n"
+"are read and written at once, on an io_uring unless uring is 0 or there is\n"
+"none, while the blocks read compress on threads threads of the pool. With\n"
+"a window, both files leave the page cache that many bytes at a time behind\n"
+"the blocks in flight (written back first)\n"
+;
+static /* const */ char decompress_fd__doc__[] =
+"decompress_fd(src_fd, dst_fd, blocks[, threads[, depth[, uring[, window]]]])\n"
+"decode the blocks (src_off, src_len, dst_off, dst_len, c_adler32, d_adler32)\n"
+"of src_fd into dst_fd, checking the checksums that are not None; reads,\n"
+"writes and the page cache as compress_fd\n"
+;
+static /* const */ char aio_uring__doc__[] =
+"aio_uring() whether compress_fd and decompress_fd can use an io_uring here\n"
+;
+static /* const */ char set_pool_size__doc__[] =
+"set_pool_size(n) number of worker threads of the pool, 0 for one per CPU\n"
+"the process may run on (the default). The pool starts on first use\n"
+;
+static /* const */ char set_pool_qos__doc__[] =
+"set_pool_qos(on) whether bulk work (calls on more than 256 KiB) leaves\n"
+"CPUs to latency work (smaller calls) while there is some; on by default\n"
+;
+static /* const */ char pool_size__doc__[] =
+"pool_size() number of worker threads of the pool\n"
+;
+static /* const */ char pool_stats__doc__[] =
+"pool_stats() list of per-worker counters: dicts with tasks, steals (tasks\n"
+"taken from another worker), latency (latency tasks), busy and uptime\n"
+"(seconds); busy / uptime is the utilization of the worker\n"
+;
 static /* const */ char lzo_adler32__doc__[] =
-"adler32 checksum.\n"
+"lzo_adler32(data[, value[, offset[, length]]]) adler32 checksum of\n"
+"data[offset:offset+length], which may be any buffer.\n"
+;
+static /* const */ char BlockDecoder__doc__[] =
+"BlockDecoder(block, dst_len)\n\n"
+"incremental decoder for one compressed block. read(n) returns the next n\n"
+"bytes (all remaining ones if n is omitted), so a huge block can be consumed\n"
+"while it is decoded; only a 64 KiB window of output is kept\n"
+;
+static /* const */ char LzoMap__doc__[] =
+"LzoMap(fd, blocks, flags[, lazy])\n\n"
+"the uncompressed content of the lzop file fd (blocks of its index as\n"
+"(file_offset, data_offset, dst_len, src_len), flags those of its header)\n"
+"as a read-only buffer. With lazy, on Linux where a userfaultfd is allowed,\n"
+"a block is decoded when one of its pages is first touched, otherwise all\n"
+"of them are at once on the pool. Supports len(), indexing, slices and the\n"
+"buffer protocol. A process forked later shares a map decoded at once, a\n"
+"lazy one is not there in the child. Indexing and slices of a lazy map\n"
+"raise error for a bad block, the buffer protocol can't: read through\n"
+"it, such a block is zeros and only stats['errors'] tells\n"
+;
+static /* const */ char BlockCache__doc__[] =
+"BlockCache(size, slot_size[, shards[, name]])\n\n"
+"decoded blocks of up to slot_size bytes, about size bytes of them, in\n"
+"shared memory keyed by (file, block) numbers. Anonymous, it is shared\n"
+"with the processes forked after it is made; with name it is the POSIX\n"
+"shm object of that name, made if there is none. Full shards evict by\n"
+"the clock algorithm. Not on Windows\n"
+;
+static /* const */ char MessageCompressor__doc__[] =
+"MessageCompressor()\n\n"
+"compresses a sequence of messages, e.g. those sent on one connection.\n"
+"compress(data) returns a block for one message whose matches may refer\n"
+"to the last 48 KiB of messages before it, so similar messages compress\n"
+"much better than with compress_block. The blocks only decompress, in\n"
+"order, through one MessageDecompressor\n"
+;
+static /* const */ char MessageDecompressor__doc__[] =
+"MessageDecompressor()\n\n"
+"decompress(block, dst_len) returns the next message of a\n"
+"MessageCompressor. After an error both ends have to start over with\n"
+"new objects\n"
 ;
 
 
+/* blocks are only split into segments of at least this size */
+#define SEGMENT_MIN       (4 * LZO_SEGMENT_ALIGN)
+
+/* calls on at most this many bytes are latency work for the pool */
+#define LATENCY_MAX       BLOCK_SIZE
+
+typedef lzo_pool_fn parallel_fn;
+
+/*
+  call fn(ctx, k) for k in [0, n), on the thread pool if threads > 1 (how
+  many run at once is up to the pool size). len is the number of bytes the
+  call works on, it decides the pool class. Must be called without the GIL
+*/
+static void
+run_parallel(int threads, int n, parallel_fn fn, void *ctx, Py_ssize_t len)
+{
+  int k;
+
+  if (threads > 1 && n > 1)
+    lzo_pool_run(n, fn, ctx, len <= LATENCY_MAX ? LZO_POOL_LATENCY : LZO_POOL_BULK);
+  else
+    for (k = 0; k < n; k++)
+      fn(ctx, k);
+}
+
+static void
+compress_segment(void *ctx, int k)
+{
+  lzo_segment_t *seg = (lzo_segment_t *) ctx + k;
+  lzo_voidp wrkmem = malloc(LZO1X_1_MEM_COMPRESS);
+
+  if (wrkmem)
+    lzo_segment_compress(seg, wrkmem);
+  else
+    seg->err = LZO_E_OUT_OF_MEMORY;
+  free(wrkmem);
+}
+
+/*
+  compress in as segments of seg_len bytes on up to threads threads and
+  join them. If restarts is not NULL it gets the list of restart points
+*/
+static PyObject *
+compress_segments(const lzo_bytep in, Py_ssize_t in_len, Py_ssize_t seg_len,
+                  int threads, PyObject **restarts)
+{
+  PyObject *result;
+  lzo_segment_t *segs;
+  lzo_bytep seg_out;
+  lzo_uint out_len;
+  int n, k;
+  int err;
+
+  n = in_len > 0 ? (int) ((in_len + seg_len - 1) / seg_len) : 1;
+
+  out_len = lzo_segment_join_bound((lzo_uint) in_len, n);
+  result = PyBytes_FromStringAndSize(NULL, out_len);
+  segs = (lzo_segment_t *) PyMem_Malloc(n * sizeof(lzo_segment_t));
+  seg_out = (lzo_bytep) PyMem_Malloc(n * lzo_segment_bound(seg_len));
+  if (result == NULL || segs == NULL || seg_out == NULL) {
+    Py_XDECREF(result);
+    PyMem_Free(segs);
+    PyMem_Free(seg_out);
+    return PyErr_NoMemory();
+  }
+
+  for (k = 0; k < n; k++) {
+    lzo_segment_t *seg = &segs[k];
+
+    seg->in = in + k * seg_len;
+    seg->in_len = (lzo_uint) (k < n - 1 ? seg_len : in_len - k * seg_len);
+    seg->out = seg_out + k * lzo_segment_bound(seg_len);
+    seg->err = LZO_E_OK;
+  }
+
+  Py_BEGIN_ALLOW_THREADS
+  run_parallel(threads, n, compress_segment, segs, in_len);
+  err = lzo_segment_join(segs, n, (lzo_bytep) PyString_AsString(result),
+                         &out_len);
+  Py_END_ALLOW_THREADS
+
+  PyMem_Free(seg_out);
+
+  if (err != LZO_E_OK) {
+    PyMem_Free(segs);
+    Py_DECREF(result);
+    PyErr_Format(LzoError, "Error %i while compressing data", err);
+    return NULL;
+  }
+  _PyString_Resize(&result, out_len);
+
+  if (result != NULL && restarts != NULL) {
+    *restarts = PyList_New(0);
+    for (k = 0; *restarts != NULL && k < n; k++) {
+      PyObject *point;
+
+      if (segs[k].c_off == LZO_SEGMENT_NO_RESTART)
+        continue;
+      point = Py_BuildValue("(nn)", (Py_ssize_t) segs[k].c_off,
+                            (Py_ssize_t) segs[k].d_off);
+      if (point == NULL || PyList_Append(*restarts, point) < 0)
+        Py_CLEAR(*restarts);
+      Py_XDECREF(point);
+    }
+    if (*restarts == NULL)
+      Py_CLEAR(result);
+  }
+  PyMem_Free(segs);
+  return result;
+}
+
+/* segment length for splitting in_len bytes among threads */
+static Py_ssize_t
+segment_length(Py_ssize_t in_len, int threads)
+{
+  Py_ssize_t seg_len = (in_len + threads - 1) / threads;
+
+  if (seg_len < SEGMENT_MIN)
+    seg_len = SEGMENT_MIN;
+  return (seg_len + LZO_SEGMENT_ALIGN - 1) / LZO_SEGMENT_ALIGN * LZO_SEGMENT_ALIGN;
+}
+
+static PyObject *
+compress_block_restarts(PyObject *dummy, PyObject *args)
+{
+  const lzo_bytep in;
+  Py_ssize_t in_len;
+  Py_ssize_t seg_len;
+  int threads = 1;
+  PyObject *compressed;
+  PyObject *restarts = NULL;
+  UNUSED(dummy);
+
+  if (!PyArg_ParseTuple(args, "s#n|i", &in, &in_len, &seg_len, &threads))
+    return NULL;
+
+  if (seg_len <= 0) {
+    PyErr_SetString(PyExc_ValueError, "segment_size must be positive");
+    return NULL;
+  }
+  /* keep segments on dictionary restarts, so the ratio doesn't suffer */
+  seg_len = (seg_len + LZO_SEGMENT_ALIGN - 1) / LZO_SEGMENT_ALIGN * LZO_SEGMENT_ALIGN;
+
+  compressed = compress_segments(in, in_len, seg_len, threads, &restarts);
+  if (compressed == NULL)
+    return NULL;
+  return Py_BuildValue("(NN)", compressed, restarts);
+}
+
 static PyObject *
 compress_block(PyObject *dummy, PyObject *args)
 {
@@ -47,16 +345,21 @@ compress_block(PyObject *dummy, PyObject *args)
   Py_ssize_t out_len;
   Py_ssize_t new_len;
 
-  lzo_uint32_t wrk_len;
+  lzo_uint32_t wrk_len = 0;
 
   int level;
   int method;
+  int threads = 1;
   int err;
   UNUSED(dummy);
 
-  if (!PyArg_ParseTuple(args, "s#II", &in, &in_len, &method, &level))
+  if (!PyArg_ParseTuple(args, "s#II|i", &in, &in_len, &method, &level, &threads))
     return NULL;
 
+  if (method == M_LZO1X_1 && threads > 1 && in_len >= 2 * SEGMENT_MIN)
+    return compress_segments(in, in_len, segment_length(in_len, threads),
+                             threads, NULL);
+
   out_len = in_len + in_len / 64 + 16 + 3;
 
   result = PyBytes_FromStringAndSize(NULL, out_len);
@@ -80,8 +383,19 @@ compress_block(PyObject *dummy, PyObject *args)
   wrkmem = (lzo_voidp) PyMem_Malloc(wrk_len);
   out = (lzo_bytep) PyString_AsString(result);
   
-  if (method == M_LZO1X_1){
+  if (USE_OPT(method, level)){
+    Py_BEGIN_ALLOW_THREADS
+    err = lzo1x_opt_compress(in, (lzo_uint) in_len, out, (lzo_uint*) &new_len);
+    Py_END_ALLOW_THREADS
+  }
+  else if (method == M_LZO1X_1){
+    Py_BEGIN_ALLOW_THREADS
+    if (in_len <= LATENCY_MAX)
+      lzo_pool_latency_enter();
     err = lzo1x_1_compress(in, (lzo_uint) in_len, out, (lzo_uint*) &new_len, wrkmem);
+    if (in_len <= LATENCY_MAX)
+      lzo_pool_latency_leave();
+    Py_END_ALLOW_THREADS
   }
 #ifdef USE_LIBLZO
   else if (method == M_LZO1X_1_15){
@@ -157,110 +471,2523 @@ decompress_block(PyObject *dummy, PyObject *args)
       return NULL;
   }
   if (len != dst_len){
-    return NULL;
+      Py_DECREF(result);
+      PyErr_SetString(LzoError, "internal error - decompressed size mismatch");
+      return NULL;
   }
 
   return result;
 
 }
 
-static PyObject *
-py_lzo_adler32(PyObject *dummy, PyObject *args)
+/*
+  writable view of obj. Python 2 mmap only has the old buffer interface,
+  so fall back to it
+*/
+static int
+get_write_buffer(PyObject *obj, Py_buffer *view)
 {
-  lzo_uint32 value = 1;
-  const lzo_bytep in;
+  void *buf;
   Py_ssize_t len;
 
-  lzo_uint32 new;
+  if (PyObject_CheckBuffer(obj))
+    return PyObject_GetBuffer(obj, view, PyBUF_WRITABLE);
 
-  if (!PyArg_ParseTuple(args, "s#|I", &in, &len, &value))
-    return NULL;
+  if (PyObject_AsWriteBuffer(obj, &buf, &len) < 0)
+    return -1;
+  return PyBuffer_FillInfo(view, obj, buf, len, 0, PyBUF_SIMPLE);
+}
 
-  if(len>0){
-    new = lzo_adler32(value, in, len);
-    return Py_BuildValue("I", new);
+/* check that [offset, offset+*len) lies in a buffer of size, len < 0
+   means up to the end */
+static int
+check_range(Py_ssize_t size, Py_ssize_t offset, Py_ssize_t *len)
+{
+  if (offset < 0 || offset > size) {
+    PyErr_SetString(PyExc_ValueError, "offset out of range");
+    return -1;
   }
-  else{
-    return Py_BuildValue("I", value);
+  if (*len < 0)
+    *len = size - offset;
+  if (*len > size - offset) {
+    PyErr_SetString(PyExc_ValueError, "buffer too small");
+    return -1;
   }
+  return 0;
+}
+
+/* a block split at its restart points, see compress_block_restarts */
+typedef struct {
+  const lzo_bytep in;
+  lzo_uint in_len;
+  lzo_bytep out;
+  lzo_uint out_len;
+  int n;
+  lzo_uint *c_off;
+  lzo_uint *d_off;
+  int err;
+} restart_pieces;
+
+static void
+decode_piece(void *ctx, int k)
+{
+  restart_pieces *p = (restart_pieces *) ctx;
+  lzo_uint d_end = k < p->n - 1 ? p->d_off[k + 1] : p->out_len;
+  int err;
+
+  err = lzo_segment_decode(p->in + p->c_off[k], p->in_len - p->c_off[k],
+                           p->out + p->d_off[k], d_end - p->d_off[k],
+                           k == p->n - 1);
+  if (err != LZO_E_OK)
+    p->err = err;
+}
+
+/*
+  parse a list of (c_off, d_off) restart points into p, they have to
+  start at (0, 0) and increase. Returns -1 with an exception set
+*/
+static int
+parse_restarts(PyObject *restarts, restart_pieces *p)
+{
+  PyObject *seq;
+  Py_ssize_t k, n;
+
+  seq = PySequence_Fast(restarts, "restarts must be a sequence");
+  if (seq == NULL)
+    return -1;
+  n = PySequence_Fast_GET_SIZE(seq);
+  p->n = (int) n;
+  p->c_off = (lzo_uint *) PyMem_Malloc((n + 1) * sizeof(lzo_uint));
+  p->d_off = (lzo_uint *) PyMem_Malloc((n + 1) * sizeof(lzo_uint));
+  if (p->c_off == NULL || p->d_off == NULL) {
+    Py_DECREF(seq);
+    PyErr_NoMemory();
+    return -1;
+  }
+
+  for (k = 0; k < n; k++) {
+    Py_ssize_t c, d;
+
+    if (!PyArg_ParseTuple(PySequence_Fast_GET_ITEM(seq, k), "nn;restart point must be (c_off, d_off)", &c, &d)) {
+      Py_DECREF(seq);
+      return -1;
+    }
+    if (k == 0 ? c != 0 || d != 0
+               : c <= (Py_ssize_t) p->c_off[k - 1] || d <= (Py_ssize_t) p->d_off[k - 1]
+                 || c >= (Py_ssize_t) p->in_len || d >= (Py_ssize_t) p->out_len) {
+      Py_DECREF(seq);
+      PyErr_SetString(LzoError, "invalid restart points");
+      return -1;
+    }
+    p->c_off[k] = (lzo_uint) c;
+    p->d_off[k] = (lzo_uint) d;
+  }
+  Py_DECREF(seq);
+  return 0;
 }
 
-#ifdef USE_LIBLZO
 static PyObject *
-py_lzo_crc32(PyObject *dummy, PyObject *args)
+decompress_into(PyObject *dummy, PyObject *args)
 {
-  lzo_uint32 value;
-  const lzo_bytep in;
-  Py_ssize_t len;
+  Py_buffer src;
+  Py_buffer dst;
+  PyObject *dst_obj;
+  Py_ssize_t dst_len;
+  Py_ssize_t offset = 0;
+  PyObject *restarts = Py_None;
+  int threads = 1;
+  restart_pieces pieces;
+  lzo_uint len;
+  int err = LZO_E_OK;
+  UNUSED(dummy);
 
-  lzo_uint32 new;
+  if (!PyArg_ParseTuple(args, "s*On|nOi", &src, &dst_obj, &dst_len, &offset,
+                        &restarts, &threads))
+    return NULL;
 
-  if (!PyArg_ParseTuple(args, "Is#", &value, &in, &len))
+  if (dst_len < 0) {
+    PyBuffer_Release(&src);
+    PyErr_SetString(PyExc_ValueError, "negative dst_len");
     return NULL;
-  
-  if(len>0){
-    new = lzo_crc32(value, in, len);
-    return Py_BuildValue("I", new);
   }
-  else{
-    return Py_BuildValue("I", value);
+
+  if (get_write_buffer(dst_obj, &dst) < 0) {
+    PyBuffer_Release(&src);
+    return NULL;
+  }
+
+  if (check_range(dst.len, offset, &dst_len) < 0) {
+    PyBuffer_Release(&dst);
+    PyBuffer_Release(&src);
+    return NULL;
   }
+
+  pieces.in = (const lzo_bytep) src.buf;
+  pieces.in_len = (lzo_uint) src.len;
+  pieces.out = (lzo_bytep) dst.buf + offset;
+  pieces.out_len = (lzo_uint) dst_len;
+  pieces.n = 0;
+  pieces.c_off = pieces.d_off = NULL;
+  pieces.err = LZO_E_OK;
+  if (restarts != Py_None && src.len != dst_len &&
+      parse_restarts(restarts, &pieces) < 0) {
+    PyMem_Free(pieces.c_off);
+    PyMem_Free(pieces.d_off);
+    PyBuffer_Release(&dst);
+    PyBuffer_Release(&src);
+    return NULL;
+  }
+
+  len = (lzo_uint) dst_len;
+  Py_BEGIN_ALLOW_THREADS
+  if (src.len == dst_len)
+    memcpy((char *) dst.buf + offset, src.buf, dst_len);
+  else if (pieces.n > 1) {
+    run_parallel(threads, pieces.n, decode_piece, &pieces, dst_len);
+    err = pieces.err;
+  }
+  else {
+    if (dst_len <= LATENCY_MAX)
+      lzo_pool_latency_enter();
+    err = lzo1x_decompress_safe((const lzo_bytep) src.buf, (lzo_uint) src.len,
+                                (lzo_bytep) dst.buf + offset, &len, NULL);
+    if (dst_len <= LATENCY_MAX)
+      lzo_pool_latency_leave();
+  }
+  Py_END_ALLOW_THREADS
+
+  PyMem_Free(pieces.c_off);
+  PyMem_Free(pieces.d_off);
+  PyBuffer_Release(&dst);
+  PyBuffer_Release(&src);
+
+  if (err != LZO_E_OK){
+    PyErr_SetString(LzoError, "internal error - decompression failed");
+    return NULL;
+  }
+  if (len != (lzo_uint) dst_len){
+    PyErr_SetString(LzoError, "internal error - decompressed size mismatch");
+    return NULL;
+  }
+
+  return PyInt_FromSsize_t(dst_len);
 }
-#endif
 
-/***********************************************************************
-// main
-************************************************************************/
+typedef struct {
+  Py_buffer *src;
+  lzo_bytep *out;
+  lzo_uint *out_len;            /* dst_len, then the length decoded */
+  int *err;
+} decompress_batch;
 
-static /* const */ PyMethodDef methods[] =
+static void
+decompress_one(void *ctx, int k)
 {
-    {"compress_block", (PyCFunction)compress_block, METH_VARARGS, compress__doc__},
-    {"decompress_block", (PyCFunction)decompress_block, METH_VARARGS, decompress__doc__},
-    {"lzo_adler32", (PyCFunction)py_lzo_adler32, METH_VARARGS, lzo_adler32__doc__},
-#ifdef USE_LIBLZO
-    {"lzo_crc32", (PyCFunction)py_lzo_crc32, METH_VARARGS, decompress__doc__},
-#endif
-    {NULL, NULL, 0, NULL}
-};
+  decompress_batch *b = (decompress_batch *) ctx;
 
+  /* stored blocks are copied, like in decompress_into */
+  if ((lzo_uint) b->src[k].len == b->out_len[k]) {
+    memcpy(b->out[k], b->src[k].buf, b->src[k].len);
+    b->err[k] = LZO_E_OK;
+    return;
+  }
+  b->err[k] = lzo1x_decompress_safe((const lzo_bytep) b->src[k].buf, (lzo_uint) b->src[k].len,
+                                    b->out[k], &b->out_len[k], NULL);
+}
 
-static /* const */ char module_documentation[]=
-"This is a python library deals with lzo files compressed with lzop.\n\n"
+static PyObject *
+decompress_many(PyObject *dummy, PyObject *args)
+{
+  PyObject *blocks, *lens;
+  PyObject *result = NULL;
+  decompress_batch batch;
+  Py_ssize_t *dst_lens = NULL;
+  Py_ssize_t n, i, got = 0;
+  Py_ssize_t total = 0;
+  int threads = 1;
+  UNUSED(dummy);
 
-;
+  if (!PyArg_ParseTuple(args, "OO|i", &blocks, &lens, &threads))
+    return NULL;
+
+  blocks = PySequence_Fast(blocks, "blocks must be a sequence");
+  if (blocks == NULL)
+    return NULL;
+  lens = PySequence_Fast(lens, "dst_lens must be a sequence");
+  if (lens == NULL) {
+    Py_DECREF(blocks);
+    return NULL;
+  }
+  batch.src = NULL;
+  batch.out = NULL;
+  batch.out_len = NULL;
+  batch.err = NULL;
+  n = PySequence_Fast_GET_SIZE(blocks);
+  if (PySequence_Fast_GET_SIZE(lens) != n) {
+    PyErr_SetString(PyExc_ValueError, "blocks and dst_lens differ in length");
+    goto done;
+  }
 
+  batch.src = (Py_buffer *) PyMem_Malloc((n + 1) * sizeof(Py_buffer));
+  batch.out = (lzo_bytep *) PyMem_Malloc((n + 1) * sizeof(lzo_bytep));
+  batch.out_len = (lzo_uint *) PyMem_Malloc((n + 1) * sizeof(lzo_uint));
+  batch.err = (int *) PyMem_Malloc((n + 1) * sizeof(int));
+  dst_lens = (Py_ssize_t *) PyMem_Malloc((n + 1) * sizeof(Py_ssize_t));
+  result = PyList_New(n);
+  if (!batch.src || !batch.out || !batch.out_len || !batch.err || !dst_lens
+      || result == NULL) {
+    PyErr_NoMemory();
+    Py_CLEAR(result);
+    goto done;
+  }
 
-#ifdef _MSC_VER
-_declspec(dllexport)
-#endif
-void init_lzo(void)
+  for (i = 0; i < n; i++) {
+    PyObject *out;
+    Py_ssize_t dst_len = PyNumber_AsSsize_t(PySequence_Fast_GET_ITEM(lens, i),
+                                            PyExc_OverflowError);
+
+    if (dst_len == -1 && PyErr_Occurred())
+      break;
+    if (dst_len < 0) {
+      PyErr_SetString(PyExc_ValueError, "negative dst_len");
+      break;
+    }
+    if (!PyArg_Parse(PySequence_Fast_GET_ITEM(blocks, i), "s*", &batch.src[i]))
+      break;
+    got++;
+    total += dst_len;
+    out = PyBytes_FromStringAndSize(NULL, dst_len);
+    if (out == NULL)
+      break;
+    PyList_SET_ITEM(result, i, out);
+    batch.out[i] = (lzo_bytep) PyString_AS_STRING(out);
+    batch.out_len[i] = (lzo_uint) dst_len;
+    dst_lens[i] = dst_len;
+  }
+  if (i < n) {
+    Py_CLEAR(result);
+    goto done;
+  }
+
+  Py_BEGIN_ALLOW_THREADS
+  run_parallel(threads, (int) n, decompress_one, &batch, total);
+  Py_END_ALLOW_THREADS
+
+  for (i = 0; i < n; i++) {
+    if (batch.err[i] != LZO_E_OK) {
+      PyErr_Format(LzoError, "block %zd: internal error - decompression failed: %d",
+                   i, batch.err[i]);
+      break;
+    }
+    if (batch.out_len[i] != (lzo_uint) dst_lens[i]) {
+      PyErr_Format(LzoError, "block %zd: internal error - decompressed size mismatch", i);
+      break;
+    }
+  }
+  if (i < n)
+    Py_CLEAR(result);
+
+done:
+  for (i = 0; i < got; i++)
+    PyBuffer_Release(&batch.src[i]);
+  PyMem_Free(batch.src);
+  PyMem_Free(batch.out);
+  PyMem_Free(batch.out_len);
+  PyMem_Free(batch.err);
+  PyMem_Free(dst_lens);
+  Py_DECREF(blocks);
+  Py_DECREF(lens);
+  return result;
+}
+
+typedef struct {
+  Py_buffer *src;
+  lzo_bytep *out;
+  lzo_uint *out_len;
+  int *err;
+  int opt;                      /* lzo1x_opt_compress rather than LZO1X-1 */
+} compress_batch;
+
+static void
+compress_one(void *ctx, int k)
 {
-    PyObject *m, *d, *v;
-    if (lzo_init() != LZO_E_OK)
-    {
-        return;
+  compress_batch *b = (compress_batch *) ctx;
+  lzo_voidp wrkmem;
+
+  if (b->opt) {
+    b->err[k] = lzo1x_opt_compress((const lzo_bytep) b->src[k].buf, (lzo_uint) b->src[k].len,
+                                   b->out[k], &b->out_len[k]);
+    return;
+  }
+  wrkmem = malloc(LZO1X_1_MEM_COMPRESS);
+  if (wrkmem == NULL) {
+    b->err[k] = LZO_E_OUT_OF_MEMORY;
+    return;
+  }
+  b->err[k] = lzo1x_1_compress((const lzo_bytep) b->src[k].buf, (lzo_uint) b->src[k].len,
+                               b->out[k], &b->out_len[k], wrkmem);
+  free(wrkmem);
+}
+
+static PyObject *
+compress_many(PyObject *dummy, PyObject *args)
+{
+  PyObject *blocks;
+  PyObject *result = NULL;
+  PyObject **outs = NULL;
+  compress_batch batch;
+  Py_ssize_t n, i, got = 0;
+  Py_ssize_t total = 0;
+  int method, level;
+  int threads = 1;
+  UNUSED(dummy);
+
+  if (!PyArg_ParseTuple(args, "OII|i", &blocks, &method, &level, &threads))
+    return NULL;
+
+  blocks = PySequence_Fast(blocks, "blocks must be a sequence");
+  if (blocks == NULL)
+    return NULL;
+  n = PySequence_Fast_GET_SIZE(blocks);
+
+  if (method != M_LZO1X_1 && !USE_OPT(method, level)) {
+    /* the other methods come from liblzo, one block after another */
+    result = PyList_New(n);
+    for (i = 0; result != NULL && i < n; i++) {
+      PyObject *a = Py_BuildValue("(OII)", PySequence_Fast_GET_ITEM(blocks, i),
+                                  method, level);
+      PyObject *c = a ? compress_block(NULL, a) : NULL;
+
+      Py_XDECREF(a);
+      if (c == NULL)
+        Py_CLEAR(result);
+      else
+        PyList_SET_ITEM(result, i, c);
     }
+    Py_DECREF(blocks);
+    return result;
+  }
 
-    m = Py_InitModule4("_lzo", methods, module_documentation,
-                       NULL, PYTHON_API_VERSION);
-    d = PyModule_GetDict(m);
+  batch.opt = USE_OPT(method, level);
+  batch.src = (Py_buffer *) PyMem_Malloc((n + 1) * sizeof(Py_buffer));
+  batch.out = (lzo_bytep *) PyMem_Malloc((n + 1) * sizeof(lzo_bytep));
+  batch.out_len = (lzo_uint *) PyMem_Malloc((n + 1) * sizeof(lzo_uint));
+  batch.err = (int *) PyMem_Malloc((n + 1) * sizeof(int));
+  outs = (PyObject **) PyMem_Malloc((n + 1) * sizeof(PyObject *));
+  if (!batch.src || !batch.out || !batch.out_len || !batch.err || !outs) {
+    PyErr_NoMemory();
+    goto done;
+  }
 
-    LzoError = PyErr_NewException("_lzo.error", NULL, NULL);
-    PyDict_SetItemString(d, "error", LzoError);
+  for (i = 0; i < n; i++) {
+    Py_ssize_t len;
 
-    v = PyString_FromString("<iridiummx@gmail.com>");
-    PyDict_SetItemString(d, "__author__", v);
-    Py_DECREF(v);
+    if (!PyArg_Parse(PySequence_Fast_GET_ITEM(blocks, i), "s*", &batch.src[i]))
+      break;
+    len = batch.src[i].len;
+    total += len;
+    outs[i] = PyBytes_FromStringAndSize(NULL, len + len / 64 + 16 + 3);
+    got++;
+    if (outs[i] == NULL)
+      break;
+    batch.out[i] = (lzo_bytep) PyString_AS_STRING(outs[i]);
+  }
+  if (i < n)
+    goto done;
 
-    v = PyInt_FromLong(LZO_VERSION);
-    PyDict_SetItemString(d, "LZO_VERSION", v);
-    Py_DECREF(v);
-    v = PyString_FromString(LZO_VERSION_STRING);
-    PyDict_SetItemString(d, "LZO_VERSION_STRING", v);
-    Py_DECREF(v);
-    v = PyString_FromString(LZO_VERSION_DATE);
-    PyDict_SetItemString(d, "LZO_VERSION_DATE", v);
-    Py_DECREF(v);
+  Py_BEGIN_ALLOW_THREADS
+  run_parallel(threads, (int) n, compress_one, &batch, total);
+  Py_END_ALLOW_THREADS
+
+  for (i = 0; i < n; i++) {
+    if (batch.err[i] != LZO_E_OK) {
+      PyErr_Format(LzoError, "Error %i while compressing data", batch.err[i]);
+      goto done;
+    }
+  }
+
+  result = PyList_New(n);
+  for (i = 0; result != NULL && i < n; i++) {
+    if (_PyString_Resize(&outs[i], batch.out_len[i]) < 0)
+      Py_CLEAR(result);
+    else {
+      PyList_SET_ITEM(result, i, outs[i]);
+      outs[i] = NULL;
+    }
+  }
+
+done:
+  for (i = 0; i < got; i++) {
+    PyBuffer_Release(&batch.src[i]);
+    Py_XDECREF(outs[i]);
+  }
+  PyMem_Free(batch.src);
+  PyMem_Free(batch.out);
+  PyMem_Free(batch.out_len);
+  PyMem_Free(batch.err);
+  PyMem_Free(outs);
+  Py_DECREF(blocks);
+  return result;
+}
+
+/* compress_v copies fragments below this size together with their
+   neighbours, a segment of their own would cost ratio */
+#define GATHER_MAX        (16 * 1024)
+
+static PyObject *
+compress_v(PyObject *dummy, PyObject *args)
+{
+  PyObject *frags;
+  PyObject *result = NULL;
+  Py_buffer *src = NULL;
+  lzo_segment_t *segs = NULL;
+  lzo_bytep gather = NULL;
+  lzo_bytep seg_out = NULL;
+  lzo_bytep gp;
+  lzo_bytep run = NULL;
+  Py_ssize_t n, i, got = 0;
+  Py_ssize_t total = 0, small = 0, bound = 0;
+  lzo_uint out_len;
+  int method, level;
+  int threads = 1;
+  int nseg = 0, k;
+  int err;
+  UNUSED(dummy);
+
+  if (!PyArg_ParseTuple(args, "OII|i", &frags, &method, &level, &threads))
+    return NULL;
+
+  frags = PySequence_Fast(frags, "fragments must be a sequence");
+  if (frags == NULL)
+    return NULL;
+  n = PySequence_Fast_GET_SIZE(frags);
+
+  src = (Py_buffer *) PyMem_Malloc((n + 1) * sizeof(Py_buffer));
+  segs = (lzo_segment_t *) PyMem_Malloc((n + 1) * sizeof(lzo_segment_t));
+  if (src == NULL || segs == NULL) {
+    PyErr_NoMemory();
+    goto done;
+  }
+  for (i = 0; i < n; i++) {
+    if (!PyArg_Parse(PySequence_Fast_GET_ITEM(frags, i), "s*", &src[i]))
+      goto done;
+    got++;
+    total += src[i].len;
+    if (src[i].len < GATHER_MAX)
+      small += src[i].len;
+  }
+
+  if (method != M_LZO1X_1) {
+    /* no segments for the other methods, concatenate */
+    PyObject *joined = PyBytes_FromStringAndSize(NULL, total);
+    PyObject *argtuple;
+    char *p;
+
+    if (joined == NULL)
+      goto done;
+    p = PyBytes_AS_STRING(joined);
+    for (i = 0; i < n; i++) {
+      memcpy(p, src[i].buf, src[i].len);
+      p += src[i].len;
+    }
+    argtuple = Py_BuildValue("(NII)", joined, method, level);
+    if (argtuple != NULL) {
+      result = compress_block(NULL, argtuple);
+      Py_DECREF(argtuple);
+    }
+    goto done;
+  }
+
+  /* large fragments are segments as they are, runs of small ones are
+     gathered into segments of at least GATHER_MAX bytes */
+  gp = gather = (lzo_bytep) PyMem_Malloc(small + 1);
+  if (gather == NULL) {
+    PyErr_NoMemory();
+    goto done;
+  }
+  for (i = 0; i <= n; i++) {
+    Py_ssize_t len = i < n ? src[i].len : 0;
+
+    if (i < n && len == 0)
+      continue;
+    if (i < n && len < GATHER_MAX) {
+      if (run == NULL)
+        run = gp;
+      memcpy(gp, src[i].buf, len);
+      gp += len;
+      if (gp - run < GATHER_MAX)
+        continue;
+    }
+    if (run != NULL) {
+      segs[nseg].in = run;
+      segs[nseg++].in_len = (lzo_uint) (gp - run);
+      run = NULL;
+    }
+    if (len >= GATHER_MAX) {
+      segs[nseg].in = (const lzo_bytep) src[i].buf;
+      segs[nseg++].in_len = (lzo_uint) len;
+    }
+  }
+
+  for (k = 0; k < nseg; k++)
+    bound += lzo_segment_bound(segs[k].in_len);
+  seg_out = (lzo_bytep) PyMem_Malloc(bound + 1);
+  out_len = lzo_segment_join_bound((lzo_uint) total, nseg);
+  result = PyBytes_FromStringAndSize(NULL, out_len);
+  if (seg_out == NULL || result == NULL) {
+    Py_CLEAR(result);
+    PyErr_NoMemory();
+    goto done;
+  }
+  for (k = 0, bound = 0; k < nseg; k++) {
+    segs[k].out = seg_out + bound;
+    segs[k].err = LZO_E_OK;
+    bound += lzo_segment_bound(segs[k].in_len);
+  }
+
+  Py_BEGIN_ALLOW_THREADS
+  run_parallel(threads, nseg, compress_segment, segs, total);
+  err = lzo_segment_join(segs, nseg, (lzo_bytep) PyString_AS_STRING(result),
+                         &out_len);
+  Py_END_ALLOW_THREADS
+
+  if (err != LZO_E_OK) {
+    Py_CLEAR(result);
+    PyErr_Format(LzoError, "Error %i while compressing data", err);
+    goto done;
+  }
+  _PyString_Resize(&result, out_len);
+
+done:
+  for (i = 0; i < got; i++)
+    PyBuffer_Release(&src[i]);
+  PyMem_Free(src);
+  PyMem_Free(segs);
+  PyMem_Free(gather);
+  PyMem_Free(seg_out);
+  Py_DECREF(frags);
+  return result;
+}
+
+static PyObject *
+decompress_into_v(PyObject *dummy, PyObject *args)
+{
+  PyObject *dsts;
+  Py_buffer src;
+  Py_buffer *dst = NULL;
+  lzo_stream_t *stream = NULL;
+  Py_ssize_t dst_len;
+  Py_ssize_t n, i, got = 0;
+  Py_ssize_t room = 0;
+  PyObject *result = NULL;
+  int err = LZO_E_OK;
+  UNUSED(dummy);
+
+  if (!PyArg_ParseTuple(args, "s*On", &src, &dsts, &dst_len))
+    return NULL;
+
+  dsts = PySequence_Fast(dsts, "dsts must be a sequence");
+  if (dsts == NULL) {
+    PyBuffer_Release(&src);
+    return NULL;
+  }
+  n = PySequence_Fast_GET_SIZE(dsts);
+  dst = (Py_buffer *) PyMem_Malloc((n + 1) * sizeof(Py_buffer));
+  if (dst == NULL) {
+    PyErr_NoMemory();
+    goto done;
+  }
+  for (i = 0; i < n; i++) {
+    if (get_write_buffer(PySequence_Fast_GET_ITEM(dsts, i), &dst[i]) < 0)
+      goto done;
+    got++;
+    room += dst[i].len;
+  }
+  if (dst_len < 0 || dst_len > room) {
+    PyErr_SetString(PyExc_ValueError, dst_len < 0 ? "negative dst_len" :
+                    "buffers too small");
+    goto done;
+  }
+  if (src.len != dst_len) {
+    stream = (lzo_stream_t *) PyMem_Malloc(sizeof(lzo_stream_t));
+    if (stream == NULL) {
+      PyErr_NoMemory();
+      goto done;
+    }
+  }
+
+  Py_BEGIN_ALLOW_THREADS
+  if (stream)
+    lzo_stream_init(stream, (const lzo_bytep) src.buf, (lzo_uint) src.len,
+                    (lzo_uint) dst_len);
+  for (i = 0, room = dst_len; i < n && room > 0 && err == LZO_E_OK; i++) {
+    lzo_uint len = (lzo_uint) (dst[i].len < room ? dst[i].len : room);
+    lzo_uint want = len;
+
+    /* a stored block is scattered as it is, like in decompress_into */
+    if (stream == NULL)
+      memcpy(dst[i].buf, (const char *) src.buf + (dst_len - room), len);
+    else if ((err = lzo_stream_decode(stream, (lzo_bytep) dst[i].buf, &len))
+             == LZO_E_OK && len != want)
+      err = LZO_E_ERROR;
+    room -= want;
+  }
+  /* the end of stream marker has to follow the last byte */
+  if (stream && err == LZO_E_OK) {
+    lzo_uint len = 0;
+
+    err = lzo_stream_decode(stream, NULL, &len);
+    if (err == LZO_E_OK && !lzo_stream_eof(stream))
+      err = LZO_E_ERROR;
+  }
+  Py_END_ALLOW_THREADS
+
+  if (err != LZO_E_OK)
+    PyErr_SetString(LzoError, "internal error - decompression failed");
+  else
+    result = PyInt_FromSsize_t(dst_len);
+
+done:
+  for (i = 0; i < got; i++)
+    PyBuffer_Release(&dst[i]);
+  PyMem_Free(dst);
+  PyMem_Free(stream);
+  PyBuffer_Release(&src);
+  Py_DECREF(dsts);
+  return result;
+}
+
+static PyObject *
+decompress_inplace(PyObject *dummy, PyObject *args)
+{
+  PyObject *buf_obj;
+  Py_buffer buf;
+  Py_ssize_t src_len, dst_len;
+  int err;
+  UNUSED(dummy);
+
+  if (!PyArg_ParseTuple(args, "Onn", &buf_obj, &src_len, &dst_len))
+    return NULL;
+
+  if (get_write_buffer(buf_obj, &buf) < 0)
+    return NULL;
+  if (src_len < 0 || dst_len < 0 || src_len > buf.len || dst_len > buf.len) {
+    PyBuffer_Release(&buf);
+    PyErr_SetString(PyExc_ValueError, src_len < 0 || dst_len < 0 ?
+                    "negative length" : "buffer too small");
+    return NULL;
+  }
+
+  Py_BEGIN_ALLOW_THREADS
+  err = lzo_inplace_decompress((lzo_bytep) buf.buf, (lzo_uint) (buf.len - src_len),
+                               (lzo_uint) src_len, (lzo_uint) dst_len);
+  Py_END_ALLOW_THREADS
+  PyBuffer_Release(&buf);
+
+  if (err == LZO_E_ERROR) {
+    PyErr_SetString(LzoError, "block does not fit in place, the buffer needs more margin");
+    return NULL;
+  }
+  if (err != LZO_E_OK) {
+    PyErr_SetString(LzoError, "internal error - decompression failed");
+    return NULL;
+  }
+  return PyInt_FromSsize_t(dst_len);
+}
+
+static PyObject *
+inplace_margin(PyObject *dummy, PyObject *args)
+{
+  Py_ssize_t dst_len;
+  UNUSED(dummy);
+
+  if (!PyArg_ParseTuple(args, "n", &dst_len))
+    return NULL;
+  if (dst_len < 0) {
+    PyErr_SetString(PyExc_ValueError, "negative dst_len");
+    return NULL;
+  }
+  return PyInt_FromSsize_t((Py_ssize_t) lzo_inplace_margin((lzo_uint) dst_len));
+}
+
+/* compress_fd and decompress_fd move blocks through slots, each with a
+   buffer for the file data and one for the result. A slot is read into,
+   worked on together with the other ready slots on the pool, then written
+   out, while the reads and writes of the other slots stay in flight */
+
+enum { SLOT_FREE, SLOT_READ, SLOT_READY, SLOT_DONE, SLOT_WRITE };
+
+/* the slots of one call stay under this, unless two would not */
+#define AIO_MEMORY        (64*1024*1024l)
+
+typedef struct {
+  int state;
+  Py_ssize_t block;
+  lzo_bytep in;
+  lzo_bytep out;
+  lzo_uint in_len;
+  lzo_uint out_len;
+  unsigned char head[16];       /* lzop block header, compress_fd */
+  size_t head_len;
+  long long dst_off;            /* where it is being written, compress_fd */
+  int err;                      /* LZO error, or 1 for a checksum mismatch */
+} aio_slot;
+
+typedef struct {
+  long long src_off;
+  lzo_uint src_len;
+  long long dst_off;
+  lzo_uint dst_len;
+  long c_adler32;               /* -1 if not checked */
+  long d_adler32;
+} aio_block;
+
+typedef struct {
+  aio_slot *slot;
+  int nslot;
+  int *ready;                   /* slots to work on */
+  const aio_block *blocks;      /* decompress_fd */
+  int opt;                      /* compress_fd with lzo1x_opt_compress */
+  int threads;
+  int failed;                   /* slot of the first error, or -1 */
+  long long window;             /* drop the files from the page cache in
+                                   pieces of this, 0 to leave them */
+} aio_job;
+
+/* the part of a file a conversion is done with, dropped from the page
+   cache: a window is written back while the next one fills, then dropped */
+typedef struct {
+  int fd;
+  long long flushed;
+  long long dropped;
+} aio_cache;
+
+static void
+put32(unsigned char *p, lzo_uint32_t v)
+{
+  p[0] = (unsigned char) (v >> 24);
+  p[1] = (unsigned char) (v >> 16);
+  p[2] = (unsigned char) (v >> 8);
+  p[3] = (unsigned char) v;
+}
+
+/* compress a slot and make its block header */
+static void
+aio_compress_one(void *ctx, int k)
+{
+  aio_job *job = (aio_job *) ctx;
+  aio_slot *s = &job->slot[job->ready[k]];
+
+  if (job->opt)
+    s->err = lzo1x_opt_compress(s->in, s->in_len, s->out, &s->out_len);
+  else {
+    lzo_voidp wrkmem = malloc(LZO1X_1_MEM_COMPRESS);
+
+    s->err = wrkmem == NULL ? LZO_E_OUT_OF_MEMORY
+      : lzo1x_1_compress(s->in, s->in_len, s->out, &s->out_len, wrkmem);
+    free(wrkmem);
+  }
+  put32(s->head, (lzo_uint32_t) s->in_len);
+  put32(s->head + 8, lzo_adler32(1, s->in, s->in_len));
+  if (s->out_len < s->in_len) {
+    put32(s->head + 4, (lzo_uint32_t) s->out_len);
+    put32(s->head + 12, lzo_adler32(1, s->out, s->out_len));
+    s->head_len = 16;
+  }
+  else {
+    put32(s->head + 4, (lzo_uint32_t) s->in_len);
+    s->head_len = 12;           /* stored, no checksum of compressed data */
+  }
+}
+
+static void
+aio_decompress_one(void *ctx, int k)
+{
+  aio_job *job = (aio_job *) ctx;
+  aio_slot *s = &job->slot[job->ready[k]];
+  const aio_block *b = &job->blocks[s->block];
+  lzo_bytep data = s->in;
+
+  s->err = LZO_E_OK;
+  if (b->src_len < b->dst_len) {
+    if (b->c_adler32 >= 0 && lzo_adler32(1, s->in, b->src_len) != (lzo_uint32_t) b->c_adler32) {
+      s->err = 1;
+      return;
+    }
+    s->out_len = b->dst_len;
+    s->err = lzo1x_decompress_safe(s->in, b->src_len, s->out, &s->out_len, NULL);
+    if (s->err == LZO_E_OK && s->out_len != b->dst_len)
+      s->err = LZO_E_ERROR;
+    data = s->out;
+  }
+  if (s->err == LZO_E_OK && b->d_adler32 >= 0
+      && lzo_adler32(1, data, b->dst_len) != (lzo_uint32_t) b->d_adler32)
+    s->err = 1;
+}
+
+static void
+aio_slots_free(aio_slot *slot, int n)
+{
+  int i;
+
+  for (i = 0; slot != NULL && i < n; i++) {
+    free(slot[i].in);
+    free(slot[i].out);
+  }
+  free(slot);
+}
+
+/* up to *n slots for blocks of in_max bytes in and out_max out, NULL
+   (MemoryError set) if they can't be allocated */
+static aio_slot *
+aio_slots(int *n, lzo_uint in_max, lzo_uint out_max)
+{
+  aio_slot *slot;
+  long fit = AIO_MEMORY / ((long) in_max + (long) out_max + 2);
+  int i;
+
+  if (*n > fit)
+    *n = fit > 2 ? (int) fit : 2;
+  slot = (aio_slot *) calloc((size_t) *n, sizeof(aio_slot));
+  for (i = 0; slot != NULL && i < *n; i++) {
+    slot[i].in = (lzo_bytep) malloc(in_max + 1);
+    slot[i].out = (lzo_bytep) malloc(out_max + 1);
+    if (slot[i].in == NULL || slot[i].out == NULL) {
+      aio_slots_free(slot, i + 1);
+      slot = NULL;
+    }
+  }
+  if (slot == NULL)
+    PyErr_NoMemory();
+  return slot;
+}
+
+/* take the completions there are, waiting for one if wait: a read makes
+   its slot ready, a write frees it. -1 (errno set) on an I/O error */
+static int
+aio_collect(lzo_aio_t *q, aio_job *job, int wait)
+{
+  unsigned long tag;
+  int err, r;
+
+  while ((r = lzo_aio_next(q, wait, &tag, &err)) == 1) {
+    aio_slot *s = &job->slot[tag];
+
+    if (err != 0) {
+      errno = -err;
+      return -1;
+    }
+    s->state = s->state == SLOT_READ ? SLOT_READY : SLOT_FREE;
+    wait = 0;
+  }
+  return r;
+}
+
+/* work on the ready slots on the pool, they are done then. Returns
+   nonzero if one failed, job->failed is the first */
+static int
+aio_work(aio_job *job, parallel_fn fn)
+{
+  int n = 0, i;
+
+  for (i = 0; i < job->nslot; i++)
+    if (job->slot[i].state == SLOT_READY)
+      job->ready[n++] = i;
+  run_parallel(job->threads, n, fn, job, LATENCY_MAX + 1);
+  for (i = 0; i < n; i++) {
+    job->slot[job->ready[i]].state = SLOT_DONE;
+    if (job->slot[job->ready[i]].err != LZO_E_OK && job->failed < 0)
+      job->failed = job->ready[i];
+  }
+  return job->failed >= 0;
+}
+
+/* the bytes of c before pos are not needed any more */
+static void
+aio_uncache(aio_cache *c, long long pos, long long window)
+{
+  if (window <= 0)
+    return;
+  while (pos - c->flushed >= window) {
+    lzo_aio_flush(c->fd, c->flushed, window);
+    c->flushed += window;
+  }
+  while (c->flushed - c->dropped > window) {
+    lzo_aio_drop(c->fd, c->dropped, window);
+    c->dropped += window;
+  }
+}
+
+/* the first block a slot still holds, or next */
+static Py_ssize_t
+aio_first(const aio_job *job, Py_ssize_t next)
+{
+  int i;
+
+  for (i = 0; i < job->nslot; i++)
+    if (job->slot[i].state != SLOT_FREE && job->slot[i].block < next)
+      next = job->slot[i].block;
+  return next;
+}
+
+static int
+aio_any(const aio_job *job, int state)
+{
+  int i;
+
+  for (i = 0; i < job->nslot; i++)
+    if (job->slot[i].state == state)
+      return 1;
+  return 0;
+}
+
+/* compress src_size bytes of src_fd as blocks of block_size appended to
+   dst_fd at *dst_off, in order. 0, -1 on an I/O error, 1 if a block
+   failed */
+static int
+aio_compress(lzo_aio_t *q, aio_job *job, int src_fd, int dst_fd,
+             long long src_size, lzo_uint block_size, long long *dst_off)
+{
+  Py_ssize_t nblocks = (Py_ssize_t) ((src_size + block_size - 1) / block_size);
+  Py_ssize_t next_read = 0, next_write = 0;
+  aio_slot *slot = job->slot;
+  aio_cache src = { 0, 0, 0 }, dst = { 0, 0, 0 };
+  int i;
+
+  src.fd = src_fd;
+  dst.fd = dst_fd;
+  dst.flushed = dst.dropped = *dst_off;
+  while (next_write < nblocks) {
+    for (i = 0; i < job->nslot && next_read < nblocks; i++)
+      if (slot[i].state == SLOT_FREE) {
+        long long off = (long long) next_read * block_size;
+
+        slot[i].block = next_read++;
+        slot[i].in_len = (lzo_uint) (src_size - off < (long long) block_size
+                                     ? src_size - off : (long long) block_size);
+        slot[i].state = SLOT_READ;
+        lzo_aio_read(q, src_fd, slot[i].in, slot[i].in_len, off, (unsigned long) i);
+      }
+    if (aio_collect(q, job, !aio_any(job, SLOT_READY)) < 0)
+      return -1;
+    if (aio_work(job, aio_compress_one))
+      return 1;
+
+    /* the blocks go out in file order */
+    for (i = 0; i < job->nslot; i++) {
+      void *buf[2];
+      size_t len[2];
+
+      if (slot[i].state != SLOT_DONE || slot[i].block != next_write)
+        continue;
+      buf[0] = slot[i].head;
+      len[0] = slot[i].head_len;
+      buf[1] = slot[i].head_len == 16 ? slot[i].out : slot[i].in;
+      len[1] = slot[i].head_len == 16 ? slot[i].out_len : slot[i].in_len;
+      slot[i].state = SLOT_WRITE;
+      slot[i].dst_off = *dst_off;
+      lzo_aio_write(q, dst_fd, buf, len, 2, *dst_off, (unsigned long) i);
+      *dst_off += (long long) (len[0] + len[1]);
+      next_write++;
+      i = -1;                   /* the next one may be in an earlier slot */
+    }
+
+    if (job->window > 0) {
+      long long written = *dst_off;
+
+      for (i = 0; i < job->nslot; i++)
+        if (slot[i].state == SLOT_WRITE && slot[i].dst_off < written)
+          written = slot[i].dst_off;
+      aio_uncache(&src, (long long) aio_first(job, next_read) * block_size, job->window);
+      aio_uncache(&dst, written, job->window);
+    }
+  }
+  while (lzo_aio_pending(q) > 0)
+    if (aio_collect(q, job, 1) < 0)
+      return -1;
+  if (job->window > 0) {
+    lzo_aio_drop(src_fd, src.dropped, src_size - src.dropped);
+    lzo_aio_drop(dst_fd, dst.dropped, *dst_off - dst.dropped);
+  }
+  return 0;
+}
+
+/* decode nblocks blocks of src_fd into dst_fd. 0, -1 on an I/O error, 1 if
+   a block failed */
+static int
+aio_decompress(lzo_aio_t *q, aio_job *job, int src_fd, int dst_fd, Py_ssize_t nblocks)
+{
+  Py_ssize_t next_read = 0, written = 0;
+  aio_slot *slot = job->slot;
+  aio_cache src = { 0, 0, 0 }, dst = { 0, 0, 0 };
+  const aio_block *last = &job->blocks[nblocks > 0 ? nblocks - 1 : 0];
+  int i;
+
+  src.fd = src_fd;
+  dst.fd = dst_fd;
+
+  while (written < nblocks) {
+    for (i = 0; i < job->nslot && next_read < nblocks; i++)
+      if (slot[i].state == SLOT_FREE) {
+        const aio_block *b = &job->blocks[next_read];
+
+        slot[i].block = next_read++;
+        slot[i].state = SLOT_READ;
+        lzo_aio_read(q, src_fd, slot[i].in, b->src_len, b->src_off, (unsigned long) i);
+      }
+    if (aio_collect(q, job, !aio_any(job, SLOT_READY)) < 0)
+      return -1;
+    if (aio_work(job, aio_decompress_one))
+      return 1;
+
+    for (i = 0; i < job->nslot; i++) {
+      const aio_block *b = &job->blocks[slot[i].block];
+      void *buf;
+      size_t len = b->dst_len;
+
+      if (slot[i].state != SLOT_DONE)
+        continue;
+      buf = b->src_len < b->dst_len ? slot[i].out : slot[i].in;
+      slot[i].state = SLOT_WRITE;
+      lzo_aio_write(q, dst_fd, &buf, &len, 1, b->dst_off, (unsigned long) i);
+      written++;
+    }
+
+    if (job->window > 0) {
+      Py_ssize_t first = aio_first(job, next_read);
+
+      if (first < nblocks) {
+        aio_uncache(&src, job->blocks[first].src_off, job->window);
+        aio_uncache(&dst, job->blocks[first].dst_off, job->window);
+      }
+    }
+  }
+  while (lzo_aio_pending(q) > 0)
+    if (aio_collect(q, job, 1) < 0)
+      return -1;
+  if (job->window > 0 && nblocks > 0) {
+    lzo_aio_drop(src_fd, src.dropped, last->src_off + last->src_len - src.dropped);
+    lzo_aio_drop(dst_fd, dst.dropped, last->dst_off + last->dst_len - dst.dropped);
+  }
+  return 0;
+}
+
+static PyObject *
+compress_fd(PyObject *dummy, PyObject *args)
+{
+  int src_fd, dst_fd;
+  long long src_size, dst_off;
+  Py_ssize_t block_size;
+  int method, level;
+  int threads = 1, depth = AIO_DEPTH, uring = 1;
+  long long window = 0;
+  lzo_aio_t *q;
+  aio_job job;
+  int r;
+  UNUSED(dummy);
+
+  if (!PyArg_ParseTuple(args, "iiLLnII|iiiL", &src_fd, &dst_fd, &src_size, &dst_off,
+                        &block_size, &method, &level, &threads, &depth, &uring, &window))
+    return NULL;
+  if (method != M_LZO1X_1 && !USE_OPT(method, level)) {
+    PyErr_SetString(LzoError, "Compression method not supported");
+    return NULL;
+  }
+  if (block_size <= 0 || src_size < 0 || depth < 1) {
+    PyErr_SetString(PyExc_ValueError, "block_size, src_size or depth out of range");
+    return NULL;
+  }
+
+  memset(&job, 0, sizeof(job));
+  job.nslot = depth;
+  job.opt = USE_OPT(method, level);
+  job.threads = threads;
+  job.failed = -1;
+  job.window = window;
+  job.slot = aio_slots(&job.nslot, (lzo_uint) block_size,
+                       (lzo_uint) (block_size + block_size / 64 + 16 + 3));
+  if (job.slot == NULL)
+    return NULL;
+  job.ready = (int *) malloc(job.nslot * sizeof(int));
+  q = lzo_aio_new(job.nslot, uring);
+  if (job.ready == NULL || q == NULL) {
+    free(job.ready);
+    aio_slots_free(job.slot, job.nslot);
+    return PyErr_NoMemory();
+  }
+
+  Py_BEGIN_ALLOW_THREADS
+  r = aio_compress(q, &job, src_fd, dst_fd, src_size, (lzo_uint) block_size, &dst_off);
+  if (r < 0)
+    r = -errno;
+  lzo_aio_free(q);
+  Py_END_ALLOW_THREADS
+
+  if (r > 0)
+    PyErr_Format(LzoError, "Error %i while compressing data", job.slot[job.failed].err);
+  else if (r < 0) {
+    errno = -r;
+    PyErr_SetFromErrno(PyExc_IOError);
+  }
+  free(job.ready);
+  aio_slots_free(job.slot, job.nslot);
+  return r == 0 ? PyLong_FromLongLong(dst_off) : NULL;
+}
+
+static PyObject *
+decompress_fd(PyObject *dummy, PyObject *args)
+{
+  PyObject *blocks;
+  aio_block *table = NULL;
+  lzo_uint in_max = 1, out_max = 1;
+  int src_fd, dst_fd;
+  int threads = 1, depth = AIO_DEPTH, uring = 1;
+  long long window = 0;
+  Py_ssize_t n, i;
+  lzo_aio_t *q;
+  aio_job job;
+  int r;
+  UNUSED(dummy);
+
+  if (!PyArg_ParseTuple(args, "iiO|iiiL", &src_fd, &dst_fd, &blocks, &threads, &depth,
+                        &uring, &window))
+    return NULL;
+  if (depth < 1) {
+    PyErr_SetString(PyExc_ValueError, "depth out of range");
+    return NULL;
+  }
+  blocks = PySequence_Fast(blocks, "blocks must be a sequence");
+  if (blocks == NULL)
+    return NULL;
+  n = PySequence_Fast_GET_SIZE(blocks);
+  table = (aio_block *) PyMem_Malloc((n + 1) * sizeof(aio_block));
+  if (table == NULL) {
+    Py_DECREF(blocks);
+    return PyErr_NoMemory();
+  }
+  for (i = 0; i < n; i++) {
+    aio_block *b = &table[i];
+    unsigned long src_len, dst_len;
+    PyObject *c_adler32, *d_adler32;
+
+    if (!PyArg_ParseTuple(PySequence_Fast_GET_ITEM(blocks, i), "LkLkOO;blocks are "
+                          "(src_off, src_len, dst_off, dst_len, c_adler32, d_adler32)",
+                          &b->src_off, &src_len, &b->dst_off, &dst_len,
+                          &c_adler32, &d_adler32))
+      break;
+    b->src_len = (lzo_uint) src_len;
+    b->dst_len = (lzo_uint) dst_len;
+    b->c_adler32 = c_adler32 == Py_None ? -1 : (long) PyLong_AsUnsignedLongMask(c_adler32);
+    b->d_adler32 = d_adler32 == Py_None ? -1 : (long) PyLong_AsUnsignedLongMask(d_adler32);
+    if (PyErr_Occurred())
+      break;
+    if (b->src_len == 0 || b->src_len > b->dst_len) {
+      PyErr_SetString(LzoError, "compressed larger than uncompressed");
+      break;
+    }
+    if (b->src_len > in_max)
+      in_max = b->src_len;
+    if (b->dst_len > out_max)
+      out_max = b->dst_len;
+  }
+  Py_DECREF(blocks);
+  if (i < n) {
+    PyMem_Free(table);
+    return NULL;
+  }
+
+  memset(&job, 0, sizeof(job));
+  job.nslot = depth;
+  job.blocks = table;
+  job.threads = threads;
+  job.failed = -1;
+  job.window = window;
+  job.slot = aio_slots(&job.nslot, in_max, out_max);
+  if (job.slot == NULL) {
+    PyMem_Free(table);
+    return NULL;
+  }
+  job.ready = (int *) malloc(job.nslot * sizeof(int));
+  q = lzo_aio_new(job.nslot, uring);
+  if (job.ready == NULL || q == NULL) {
+    free(job.ready);
+    aio_slots_free(job.slot, job.nslot);
+    PyMem_Free(table);
+    return PyErr_NoMemory();
+  }
+
+  Py_BEGIN_ALLOW_THREADS
+  r = aio_decompress(q, &job, src_fd, dst_fd, n);
+  if (r < 0)
+    r = -errno;
+  lzo_aio_free(q);
+  Py_END_ALLOW_THREADS
+
+  if (r > 0) {
+    aio_slot *s = &job.slot[job.failed];
+
+    if (s->err == 1)
+      PyErr_Format(LzoError, "Checksum error in block %zd", s->block);
+    else
+      PyErr_Format(LzoError, "Error %i while decompressing block %zd", s->err, s->block);
+  }
+  else if (r < 0) {
+    errno = -r;
+    PyErr_SetFromErrno(PyExc_IOError);
+  }
+  free(job.ready);
+  aio_slots_free(job.slot, job.nslot);
+  PyMem_Free(table);
+  if (r != 0)
+    return NULL;
+  Py_RETURN_NONE;
+}
+
+static PyObject *
+aio_uring(PyObject *dummy, PyObject *args)
+{
+  lzo_aio_t *q = lzo_aio_new(1, 1);
+  int on;
+  UNUSED(dummy);
+  UNUSED(args);
+
+  if (q == NULL)
+    return PyErr_NoMemory();
+  on = lzo_aio_uring(q);
+  lzo_aio_free(q);
+  return PyBool_FromLong(on);
+}
+
+static PyObject *
+set_pool_size(PyObject *dummy, PyObject *args)
+{
+  int size;
+  UNUSED(dummy);
+
+  if (!PyArg_ParseTuple(args, "i", &size))
+    return NULL;
+  Py_BEGIN_ALLOW_THREADS
+  lzo_pool_set_size(size);
+  Py_END_ALLOW_THREADS
+  Py_RETURN_NONE;
+}
+
+static PyObject *
+set_pool_qos(PyObject *dummy, PyObject *args)
+{
+  int on;
+  UNUSED(dummy);
+
+  if (!PyArg_ParseTuple(args, "i", &on))
+    return NULL;
+  lzo_pool_set_qos(on);
+  Py_RETURN_NONE;
+}
+
+static PyObject *
+pool_size(PyObject *dummy, PyObject *args)
+{
+  UNUSED(dummy);
+  UNUSED(args);
+  return PyInt_FromLong(lzo_pool_size());
+}
+
+static PyObject *
+pool_stats(PyObject *dummy, PyObject *args)
+{
+  PyObject *result;
+  int i, n = lzo_pool_size();
+  UNUSED(dummy);
+  UNUSED(args);
+
+  result = PyList_New(n);
+  for (i = 0; result != NULL && i < n; i++) {
+    lzo_pool_stats_t st;
+    PyObject *d;
+
+    lzo_pool_stats(i, &st);
+    d = Py_BuildValue("{s:k,s:k,s:k,s:d,s:d}", "tasks", st.tasks,
+                      "steals", st.steals, "latency", st.latency,
+                      "busy", st.busy, "uptime", st.uptime);
+    if (d == NULL)
+      Py_CLEAR(result);
+    else
+      PyList_SET_ITEM(result, i, d);
+  }
+  return result;
+}
+
+static PyObject *
+py_lzo_adler32(PyObject *dummy, PyObject *args)
+{
+  lzo_uint32 value = 1;
+  Py_buffer in;
+  Py_ssize_t offset = 0;
+  Py_ssize_t len = -1;
+
+  lzo_uint32 new;
+
+  if (!PyArg_ParseTuple(args, "s*|Inn", &in, &value, &offset, &len))
+    return NULL;
+
+  if (check_range(in.len, offset, &len) < 0) {
+    PyBuffer_Release(&in);
+    return NULL;
+  }
+
+  if(len>0){
+    Py_BEGIN_ALLOW_THREADS
+    new = lzo_adler32(value, (const lzo_bytep) in.buf + offset, len);
+    Py_END_ALLOW_THREADS
+    PyBuffer_Release(&in);
+    return Py_BuildValue("I", new);
+  }
+  else{
+    PyBuffer_Release(&in);
+    return Py_BuildValue("I", value);
+  }
+}
+
+#ifdef USE_LIBLZO
+static PyObject *
+py_lzo_crc32(PyObject *dummy, PyObject *args)
+{
+  lzo_uint32 value;
+  const lzo_bytep in;
+  Py_ssize_t len;
+
+  lzo_uint32 new;
+
+  if (!PyArg_ParseTuple(args, "Is#", &value, &in, &len))
+    return NULL;
+  
+  if(len>0){
+    new = lzo_crc32(value, in, len);
+    return Py_BuildValue("I", new);
+  }
+  else{
+    return Py_BuildValue("I", value);
+  }
+}
+#endif
+
+/***********************************************************************
+// BlockDecoder
+************************************************************************/
+
+typedef struct {
+  PyObject_HEAD
+  Py_buffer src;
+  lzo_stream_t *stream;
+  Py_ssize_t dst_len;
+  Py_ssize_t produced;
+} BlockDecoderObject;
+
+static PyObject *
+BlockDecoder_new(PyTypeObject *type, PyObject *args, PyObject *kwds)
+{
+  BlockDecoderObject *self;
+  Py_buffer src;
+  Py_ssize_t dst_len;
+
+  if (!PyArg_ParseTuple(args, "s*n:BlockDecoder", &src, &dst_len))
+    return NULL;
+
+  if (dst_len < 0) {
+    PyBuffer_Release(&src);
+    PyErr_SetString(PyExc_ValueError, "negative dst_len");
+    return NULL;
+  }
+
+  self = (BlockDecoderObject *) type->tp_alloc(type, 0);
+  if (self == NULL) {
+    PyBuffer_Release(&src);
+    return NULL;
+  }
+  self->src = src;
+  self->dst_len = dst_len;
+  self->produced = 0;
+  self->stream = (lzo_stream_t *) PyMem_Malloc(sizeof(lzo_stream_t));
+  if (self->stream == NULL) {
+    Py_DECREF(self);
+    return PyErr_NoMemory();
+  }
+  lzo_stream_init(self->stream, (const lzo_bytep) src.buf,
+                  (lzo_uint) src.len, (lzo_uint) dst_len);
+  return (PyObject *) self;
+}
+
+static void
+BlockDecoder_dealloc(BlockDecoderObject *self)
+{
+  PyBuffer_Release(&self->src);
+  PyMem_Free(self->stream);
+  Py_TYPE(self)->tp_free((PyObject *) self);
+}
+
+static PyObject *
+BlockDecoder_read(BlockDecoderObject *self, PyObject *args)
+{
+  PyObject *result;
+  Py_ssize_t size = -1;
+  Py_ssize_t remaining = self->dst_len - self->produced;
+  lzo_uint len;
+  int err;
+
+  if (!PyArg_ParseTuple(args, "|n:read", &size))
+    return NULL;
+
+  if (size < 0 || size > remaining)
+    size = remaining;
+
+  result = PyBytes_FromStringAndSize(NULL, size);
+  if (result == NULL)
+    return NULL;
+
+  len = (lzo_uint) size;
+  Py_BEGIN_ALLOW_THREADS
+  err = lzo_stream_decode(self->stream, (lzo_bytep) PyBytes_AS_STRING(result), &len);
+  Py_END_ALLOW_THREADS
+
+  if (err != LZO_E_OK) {
+    Py_DECREF(result);
+    PyErr_SetString(LzoError, "internal error - decompression failed");
+    return NULL;
+  }
+  self->produced += len;
+  if ((lzo_stream_eof(self->stream) && self->produced != self->dst_len)
+      || (len == 0 && size > 0)) {
+    Py_DECREF(result);
+    PyErr_SetString(LzoError, "internal error - decompressed size mismatch");
+    return NULL;
+  }
+
+  if ((Py_ssize_t) len != size)
+    _PyString_Resize(&result, len);
+  return result;
+}
+
+static PyObject *
+BlockDecoder_get_eof(BlockDecoderObject *self, void *closure)
+{
+  return PyBool_FromLong(lzo_stream_eof(self->stream));
+}
+
+static PyObject *
+BlockDecoder_get_produced(BlockDecoderObject *self, void *closure)
+{
+  return PyInt_FromSsize_t(self->produced);
+}
+
+static PyMethodDef BlockDecoder_methods[] = {
+  {"read", (PyCFunction)BlockDecoder_read, METH_VARARGS,
+   "read([size]) -> next size bytes of the block"},
+  {NULL, NULL, 0, NULL}
+};
+
+static PyGetSetDef BlockDecoder_getset[] = {
+  {"eof", (getter)BlockDecoder_get_eof, NULL,
+   "true once the whole block has been decoded", NULL},
+  {"produced", (getter)BlockDecoder_get_produced, NULL,
+   "bytes returned so far", NULL},
+  {NULL, NULL, NULL, NULL, NULL}
+};
+
+static PyTypeObject BlockDecoderType = {
+  PyVarObject_HEAD_INIT(NULL, 0)
+  "_lzo.BlockDecoder",                  /* tp_name */
+  sizeof(BlockDecoderObject),           /* tp_basicsize */
+  0,                                    /* tp_itemsize */
+  (destructor)BlockDecoder_dealloc,     /* tp_dealloc */
+  0,                                    /* tp_print */
+  0,                                    /* tp_getattr */
+  0,                                    /* tp_setattr */
+  0,                                    /* tp_compare */
+  0,                                    /* tp_repr */
+  0,                                    /* tp_as_number */
+  0,                                    /* tp_as_sequence */
+  0,                                    /* tp_as_mapping */
+  0,                                    /* tp_hash */
+  0,                                    /* tp_call */
+  0,                                    /* tp_str */
+  0,                                    /* tp_getattro */
+  0,                                    /* tp_setattro */
+  0,                                    /* tp_as_buffer */
+  Py_TPFLAGS_DEFAULT,                   /* tp_flags */
+  BlockDecoder__doc__,                  /* tp_doc */
+  0,                                    /* tp_traverse */
+  0,                                    /* tp_clear */
+  0,                                    /* tp_richcompare */
+  0,                                    /* tp_weaklistoffset */
+  0,                                    /* tp_iter */
+  0,                                    /* tp_iternext */
+  BlockDecoder_methods,                 /* tp_methods */
+  0,                                    /* tp_members */
+  BlockDecoder_getset,                  /* tp_getset */
+  0,                                    /* tp_base */
+  0,                                    /* tp_dict */
+  0,                                    /* tp_descr_get */
+  0,                                    /* tp_descr_set */
+  0,                                    /* tp_dictoffset */
+  0,                                    /* tp_init */
+  0,                                    /* tp_alloc */
+  BlockDecoder_new,                     /* tp_new */
+};
+
+/***********************************************************************
+// MessageCompressor, MessageDecompressor
+************************************************************************/
+
+typedef struct {
+  PyObject_HEAD
+  lzo_ctx_t *ctx;
+} MessageCompressorObject;
+
+typedef struct {
+  PyObject_HEAD
+  lzo_dctx_t *ctx;
+  int broken;
+} MessageDecompressorObject;
+
+static PyObject *
+MessageCompressor_new(PyTypeObject *type, PyObject *args, PyObject *kwds)
+{
+  MessageCompressorObject *self;
+
+  if (!PyArg_ParseTuple(args, ":MessageCompressor"))
+    return NULL;
+
+  self = (MessageCompressorObject *) type->tp_alloc(type, 0);
+  if (self == NULL)
+    return NULL;
+  self->ctx = (lzo_ctx_t *) PyMem_Malloc(sizeof(lzo_ctx_t));
+  if (self->ctx == NULL) {
+    Py_DECREF(self);
+    return PyErr_NoMemory();
+  }
+  lzo_ctx_init(self->ctx);
+  return (PyObject *) self;
+}
+
+static void
+MessageCompressor_dealloc(MessageCompressorObject *self)
+{
+  PyMem_Free(self->ctx);
+  Py_TYPE(self)->tp_free((PyObject *) self);
+}
+
+/* the context is not thread safe, so compress keeps the GIL; messages are
+   small anyway */
+static PyObject *
+MessageCompressor_compress(MessageCompressorObject *self, PyObject *args)
+{
+  PyObject *result;
+  const lzo_bytep in;
+  Py_ssize_t in_len;
+  lzo_uint out_len;
+  int err;
+
+  if (!PyArg_ParseTuple(args, "s#:compress", &in, &in_len))
+    return NULL;
+
+  out_len = lzo_ctx_bound((lzo_uint) in_len);
+  result = PyBytes_FromStringAndSize(NULL, out_len);
+  if (result == NULL)
+    return NULL;
+
+  err = lzo_ctx_compress(self->ctx, in, (lzo_uint) in_len,
+                         (lzo_bytep) PyBytes_AS_STRING(result), &out_len);
+  if (err != LZO_E_OK) {
+    Py_DECREF(result);
+    PyErr_Format(LzoError, "Error %i while compressing data", err);
+    return NULL;
+  }
+  _PyString_Resize(&result, out_len);
+  return result;
+}
+
+static PyObject *
+MessageDecompressor_new(PyTypeObject *type, PyObject *args, PyObject *kwds)
+{
+  MessageDecompressorObject *self;
+
+  if (!PyArg_ParseTuple(args, ":MessageDecompressor"))
+    return NULL;
+
+  self = (MessageDecompressorObject *) type->tp_alloc(type, 0);
+  if (self == NULL)
+    return NULL;
+  self->broken = 0;
+  self->ctx = (lzo_dctx_t *) PyMem_Malloc(sizeof(lzo_dctx_t));
+  if (self->ctx == NULL) {
+    Py_DECREF(self);
+    return PyErr_NoMemory();
+  }
+  lzo_dctx_init(self->ctx);
+  return (PyObject *) self;
+}
+
+static void
+MessageDecompressor_dealloc(MessageDecompressorObject *self)
+{
+  PyMem_Free(self->ctx);
+  Py_TYPE(self)->tp_free((PyObject *) self);
+}
+
+static PyObject *
+MessageDecompressor_decompress(MessageDecompressorObject *self, PyObject *args)
+{
+  PyObject *result;
+  const lzo_bytep in;
+  Py_ssize_t in_len;
+  Py_ssize_t dst_len;
+  lzo_uint len;
+  int err;
+
+  if (!PyArg_ParseTuple(args, "s#n:decompress", &in, &in_len, &dst_len))
+    return NULL;
+
+  if (dst_len < 0) {
+    PyErr_SetString(PyExc_ValueError, "negative dst_len");
+    return NULL;
+  }
+  if (self->broken) {
+    PyErr_SetString(LzoError, "message context lost after an error");
+    return NULL;
+  }
+
+  result = PyBytes_FromStringAndSize(NULL, dst_len);
+  if (result == NULL)
+    return NULL;
+
+  len = (lzo_uint) dst_len;
+  err = lzo_dctx_decompress(self->ctx, in, (lzo_uint) in_len,
+                            (lzo_bytep) PyBytes_AS_STRING(result), &len);
+  if (err != LZO_E_OK) {
+    self->broken = 1;
+    Py_DECREF(result);
+    PyErr_SetString(LzoError, "internal error - decompression failed");
+    return NULL;
+  }
+  return result;
+}
+
+static PyMethodDef MessageCompressor_methods[] = {
+  {"compress", (PyCFunction)MessageCompressor_compress, METH_VARARGS,
+   "compress(data) -> block of the next message"},
+  {NULL, NULL, 0, NULL}
+};
+
+static PyMethodDef MessageDecompressor_methods[] = {
+  {"decompress", (PyCFunction)MessageDecompressor_decompress, METH_VARARGS,
+   "decompress(block, dst_len) -> the next message"},
+  {NULL, NULL, 0, NULL}
+};
+
+static PyTypeObject MessageCompressorType = {
+  PyVarObject_HEAD_INIT(NULL, 0)
+  "_lzo.MessageCompressor",             /* tp_name */
+  sizeof(MessageCompressorObject),      /* tp_basicsize */
+  0,                                    /* tp_itemsize */
+  (destructor)MessageCompressor_dealloc, /* tp_dealloc */
+  0,                                    /* tp_print */
+  0,                                    /* tp_getattr */
+  0,                                    /* tp_setattr */
+  0,                                    /* tp_compare */
+  0,                                    /* tp_repr */
+  0,                                    /* tp_as_number */
+  0,                                    /* tp_as_sequence */
+  0,                                    /* tp_as_mapping */
+  0,                                    /* tp_hash */
+  0,                                    /* tp_call */
+  0,                                    /* tp_str */
+  0,                                    /* tp_getattro */
+  0,                                    /* tp_setattro */
+  0,                                    /* tp_as_buffer */
+  Py_TPFLAGS_DEFAULT,                   /* tp_flags */
+  MessageCompressor__doc__,             /* tp_doc */
+  0,                                    /* tp_traverse */
+  0,                                    /* tp_clear */
+  0,                                    /* tp_richcompare */
+  0,                                    /* tp_weaklistoffset */
+  0,                                    /* tp_iter */
+  0,                                    /* tp_iternext */
+  MessageCompressor_methods,            /* tp_methods */
+  0,                                    /* tp_members */
+  0,                                    /* tp_getset */
+  0,                                    /* tp_base */
+  0,                                    /* tp_dict */
+  0,                                    /* tp_descr_get */
+  0,                                    /* tp_descr_set */
+  0,                                    /* tp_dictoffset */
+  0,                                    /* tp_init */
+  0,                                    /* tp_alloc */
+  MessageCompressor_new,                /* tp_new */
+};
+
+static PyTypeObject MessageDecompressorType = {
+  PyVarObject_HEAD_INIT(NULL, 0)
+  "_lzo.MessageDecompressor",           /* tp_name */
+  sizeof(MessageDecompressorObject),    /* tp_basicsize */
+  0,                                    /* tp_itemsize */
+  (destructor)MessageDecompressor_dealloc, /* tp_dealloc */
+  0,                                    /* tp_print */
+  0,                                    /* tp_getattr */
+  0,                                    /* tp_setattr */
+  0,                                    /* tp_compare */
+  0,                                    /* tp_repr */
+  0,                                    /* tp_as_number */
+  0,                                    /* tp_as_sequence */
+  0,                                    /* tp_as_mapping */
+  0,                                    /* tp_hash */
+  0,                                    /* tp_call */
+  0,                                    /* tp_str */
+  0,                                    /* tp_getattro */
+  0,                                    /* tp_setattro */
+  0,                                    /* tp_as_buffer */
+  Py_TPFLAGS_DEFAULT,                   /* tp_flags */
+  MessageDecompressor__doc__,           /* tp_doc */
+  0,                                    /* tp_traverse */
+  0,                                    /* tp_clear */
+  0,                                    /* tp_richcompare */
+  0,                                    /* tp_weaklistoffset */
+  0,                                    /* tp_iter */
+  0,                                    /* tp_iternext */
+  MessageDecompressor_methods,          /* tp_methods */
+  0,                                    /* tp_members */
+  0,                                    /* tp_getset */
+  0,                                    /* tp_base */
+  0,                                    /* tp_dict */
+  0,                                    /* tp_descr_get */
+  0,                                    /* tp_descr_set */
+  0,                                    /* tp_dictoffset */
+  0,                                    /* tp_init */
+  0,                                    /* tp_alloc */
+  MessageDecompressor_new,              /* tp_new */
+};
+
+/***********************************************************************
+// LzoMap
+************************************************************************/
+
+typedef struct {
+  PyObject_HEAD
+  lzo_map_t *map;
+  Py_ssize_t exports;
+} LzoMapObject;
+
+static PyObject *
+LzoMap_new(PyTypeObject *type, PyObject *args, PyObject *kwds)
+{
+  LzoMapObject *self;
+  PyObject *blocks;
+  lzo_map_block *table;
+  unsigned long flags;
+  int fd, lazy = 1, err = LZO_E_OK;
+  Py_ssize_t n, i;
+
+  if (!PyArg_ParseTuple(args, "iOk|i:LzoMap", &fd, &blocks, &flags, &lazy))
+    return NULL;
+  blocks = PySequence_Fast(blocks, "blocks must be a sequence");
+  if (blocks == NULL)
+    return NULL;
+  n = PySequence_Fast_GET_SIZE(blocks);
+  table = (lzo_map_block *) PyMem_Malloc((n + 1) * sizeof(lzo_map_block));
+  if (table == NULL) {
+    Py_DECREF(blocks);
+    return PyErr_NoMemory();
+  }
+  for (i = 0; i < n; i++) {
+    unsigned long dst_len, src_len;
+
+    if (!PyArg_ParseTuple(PySequence_Fast_GET_ITEM(blocks, i), "LLkk;blocks are "
+                          "(file_offset, data_offset, dst_len, src_len)",
+                          &table[i].file_off, &table[i].data_off, &dst_len, &src_len))
+      break;
+    table[i].dst_len = (lzo_uint) dst_len;
+    table[i].src_len = (lzo_uint) src_len;
+  }
+  Py_DECREF(blocks);
+  if (i < n) {
+    PyMem_Free(table);
+    return NULL;
+  }
+
+  self = (LzoMapObject *) type->tp_alloc(type, 0);
+  if (self == NULL) {
+    PyMem_Free(table);
+    return NULL;
+  }
+  Py_BEGIN_ALLOW_THREADS
+  self->map = lzo_map_open(fd, table, (size_t) n, flags, lazy, &err);
+  Py_END_ALLOW_THREADS
+  PyMem_Free(table);
+
+  if (self->map == NULL) {
+    Py_DECREF(self);
+    if (err == LZO_E_OUT_OF_MEMORY)
+      return PyErr_NoMemory();
+    if (err > 0) {
+      errno = err;
+      return PyErr_SetFromErrno(PyExc_IOError);
+    }
+    PyErr_SetString(LzoError, "bad block or index in mapped lzo file");
+    return NULL;
+  }
+  return (PyObject *) self;
+}
+
+static void
+LzoMap_dealloc(LzoMapObject *self)
+{
+  lzo_map_t *map = self->map;
+
+  Py_BEGIN_ALLOW_THREADS
+  lzo_map_close(map);
+  Py_END_ALLOW_THREADS
+  Py_TYPE(self)->tp_free((PyObject *) self);
+}
+
+static int
+LzoMap_check(LzoMapObject *self)
+{
+  if (self->map == NULL) {
+    PyErr_SetString(PyExc_ValueError, "mapped lzo file is closed");
+    return -1;
+  }
+  return 0;
+}
+
+static PyObject *
+LzoMap_close(LzoMapObject *self, PyObject *args)
+{
+  lzo_map_t *map = self->map;
+  UNUSED(args);
+
+  if (self->exports > 0) {
+    PyErr_SetString(PyExc_BufferError, "cannot close: buffers of the map are in use");
+    return NULL;
+  }
+  self->map = NULL;
+  Py_BEGIN_ALLOW_THREADS
+  lzo_map_close(map);
+  Py_END_ALLOW_THREADS
+  Py_RETURN_NONE;
+}
+
+static PyObject *
+LzoMap_enter(LzoMapObject *self, PyObject *args)
+{
+  UNUSED(args);
+
+  if (LzoMap_check(self) < 0)
+    return NULL;
+  Py_INCREF(self);
+  return (PyObject *) self;
+}
+
+static PyObject *
+LzoMap_exit(LzoMapObject *self, PyObject *args)
+{
+  return LzoMap_close(self, args);
+}
+
+static Py_ssize_t
+LzoMap_length(LzoMapObject *self)
+{
+  if (LzoMap_check(self) < 0)
+    return -1;
+  return (Py_ssize_t) lzo_map_size(self->map);
+}
+
+/* bytes at off of a map, an error if a lazy map served them from a bad
+   block */
+static PyObject *
+LzoMap_copy(LzoMapObject *self, Py_ssize_t off, Py_ssize_t len)
+{
+  PyObject *result = PyBytes_FromStringAndSize((const char *) lzo_map_addr(self->map) + off, len);
+
+  if (result != NULL && lzo_map_failed(self->map, (size_t) off, (size_t) len)) {
+    Py_DECREF(result);
+    PyErr_SetString(LzoError, "bad block in mapped lzo file");
+    return NULL;
+  }
+  return result;
+}
+
+static PyObject *
+LzoMap_item(LzoMapObject *self, Py_ssize_t i)
+{
+  if (LzoMap_check(self) < 0)
+    return NULL;
+  if (i < 0 || i >= (Py_ssize_t) lzo_map_size(self->map)) {
+    PyErr_SetString(PyExc_IndexError, "map index out of range");
+    return NULL;
+  }
+  return LzoMap_copy(self, i, 1);
+}
+
+static PyObject *
+LzoMap_slice(LzoMapObject *self, Py_ssize_t lo, Py_ssize_t hi)
+{
+  Py_ssize_t size;
+
+  if (LzoMap_check(self) < 0)
+    return NULL;
+  size = (Py_ssize_t) lzo_map_size(self->map);
+  if (lo < 0)
+    lo = 0;
+  if (hi > size)
+    hi = size;
+  if (hi < lo)
+    hi = lo;
+  return LzoMap_copy(self, lo, hi - lo);
+}
+
+static Py_ssize_t
+LzoMap_readbuffer(LzoMapObject *self, Py_ssize_t segment, void **ptr)
+{
+  if (LzoMap_check(self) < 0)
+    return -1;
+  if (segment != 0) {
+    PyErr_SetString(PyExc_SystemError, "accessing non-existent map segment");
+    return -1;
+  }
+  /* the buffer may go straight to a syscall */
+  lzo_map_fault_in(self->map);
+  *ptr = (void *) lzo_map_addr(self->map);
+  return (Py_ssize_t) lzo_map_size(self->map);
+}
+
+static Py_ssize_t
+LzoMap_segcount(LzoMapObject *self, Py_ssize_t *lenp)
+{
+  if (lenp != NULL)
+    *lenp = self->map != NULL ? (Py_ssize_t) lzo_map_size(self->map) : 0;
+  return 1;
+}
+
+static int
+LzoMap_getbuffer(LzoMapObject *self, Py_buffer *view, int flags)
+{
+  if (LzoMap_check(self) < 0)
+    return -1;
+  lzo_map_fault_in(self->map);
+  if (PyBuffer_FillInfo(view, (PyObject *) self, (void *) lzo_map_addr(self->map),
+                        (Py_ssize_t) lzo_map_size(self->map), 1, flags) < 0)
+    return -1;
+  self->exports++;
+  return 0;
+}
+
+static void
+LzoMap_releasebuffer(LzoMapObject *self, Py_buffer *view)
+{
+  UNUSED(view);
+  self->exports--;
+}
+
+static PyObject *
+LzoMap_get_lazy(LzoMapObject *self, void *closure)
+{
+  if (LzoMap_check(self) < 0)
+    return NULL;
+  return PyBool_FromLong(lzo_map_lazy(self->map));
+}
+
+static PyObject *
+LzoMap_get_closed(LzoMapObject *self, void *closure)
+{
+  return PyBool_FromLong(self->map == NULL);
+}
+
+static PyObject *
+LzoMap_get_stats(LzoMapObject *self, void *closure)
+{
+  unsigned long faults, decodes, errors;
+
+  if (LzoMap_check(self) < 0)
+    return NULL;
+  lzo_map_stats(self->map, &faults, &decodes, &errors);
+  return Py_BuildValue("{sksksk}", "faults", faults, "decodes", decodes, "errors", errors);
+}
+
+static PyMethodDef LzoMap_methods[] = {
+  {"close", (PyCFunction)LzoMap_close, METH_NOARGS,
+   "close() unmap the content, no buffer of it may be in use"},
+  {"__enter__", (PyCFunction)LzoMap_enter, METH_NOARGS, NULL},
+  {"__exit__", (PyCFunction)LzoMap_exit, METH_VARARGS, NULL},
+  {NULL, NULL, 0, NULL}
+};
+
+static PyGetSetDef LzoMap_getset[] = {
+  {"lazy", (getter)LzoMap_get_lazy, NULL,
+   "true if blocks are decoded on first touch, false if all were at once", NULL},
+  {"closed", (getter)LzoMap_get_closed, NULL, "true after close()", NULL},
+  {"stats", (getter)LzoMap_get_stats, NULL,
+   "dict of the page faults served, blocks decoded and blocks that failed", NULL},
+  {NULL, NULL, NULL, NULL, NULL}
+};
+
+static PySequenceMethods LzoMap_as_sequence = {
+  (lenfunc)LzoMap_length,               /* sq_length */
+  0,                                    /* sq_concat */
+  0,                                    /* sq_repeat */
+  (ssizeargfunc)LzoMap_item,            /* sq_item */
+  (ssizessizeargfunc)LzoMap_slice,      /* sq_slice */
+  0,                                    /* sq_ass_item */
+  0,                                    /* sq_ass_slice */
+  0,                                    /* sq_contains */
+};
+
+static PyBufferProcs LzoMap_as_buffer = {
+  (readbufferproc)LzoMap_readbuffer,    /* bf_getreadbuffer */
+  0,                                    /* bf_getwritebuffer */
+  (segcountproc)LzoMap_segcount,        /* bf_getsegcount */
+  (charbufferproc)LzoMap_readbuffer,    /* bf_getcharbuffer */
+  (getbufferproc)LzoMap_getbuffer,      /* bf_getbuffer */
+  (releasebufferproc)LzoMap_releasebuffer, /* bf_releasebuffer */
+};
+
+static PyTypeObject LzoMapType = {
+  PyVarObject_HEAD_INIT(NULL, 0)
+  "_lzo.LzoMap",                        /* tp_name */
+  sizeof(LzoMapObject),                 /* tp_basicsize */
+  0,                                    /* tp_itemsize */
+  (destructor)LzoMap_dealloc,           /* tp_dealloc */
+  0,                                    /* tp_print */
+  0,                                    /* tp_getattr */
+  0,                                    /* tp_setattr */
+  0,                                    /* tp_compare */
+  0,                                    /* tp_repr */
+  0,                                    /* tp_as_number */
+  &LzoMap_as_sequence,                  /* tp_as_sequence */
+  0,                                    /* tp_as_mapping */
+  0,                                    /* tp_hash */
+  0,                                    /* tp_call */
+  0,                                    /* tp_str */
+  0,                                    /* tp_getattro */
+  0,                                    /* tp_setattro */
+  &LzoMap_as_buffer,                    /* tp_as_buffer */
+  Py_TPFLAGS_DEFAULT | Py_TPFLAGS_HAVE_NEWBUFFER, /* tp_flags */
+  LzoMap__doc__,                        /* tp_doc */
+  0,                                    /* tp_traverse */
+  0,                                    /* tp_clear */
+  0,                                    /* tp_richcompare */
+  0,                                    /* tp_weaklistoffset */
+  0,                                    /* tp_iter */
+  0,                                    /* tp_iternext */
+  LzoMap_methods,                       /* tp_methods */
+  0,                                    /* tp_members */
+  LzoMap_getset,                        /* tp_getset */
+  0,                                    /* tp_base */
+  0,                                    /* tp_dict */
+  0,                                    /* tp_descr_get */
+  0,                                    /* tp_descr_set */
+  0,                                    /* tp_dictoffset */
+  0,                                    /* tp_init */
+  0,                                    /* tp_alloc */
+  LzoMap_new,                           /* tp_new */
+};
+
+/***********************************************************************
+// BlockCache
+************************************************************************/
+
+typedef struct {
+  PyObject_HEAD
+  lzo_cache_t *cache;
+  lzo_cache_t *closing;         /* closed while get or put ran */
+  int users;
+  PyObject *name;
+} BlockCacheObject;
+
+static PyObject *
+BlockCache_new(PyTypeObject *type, PyObject *args, PyObject *kwds)
+{
+  BlockCacheObject *self;
+  unsigned PY_LONG_LONG size, slot_size;
+  const char *name = NULL;
+  int shards = 0, err = 0;
+
+  if (!PyArg_ParseTuple(args, "KK|iz:BlockCache", &size, &slot_size, &shards, &name))
+    return NULL;
+  self = (BlockCacheObject *) type->tp_alloc(type, 0);
+  if (self == NULL)
+    return NULL;
+  if (name != NULL)
+    self->name = PyString_FromString(name);
+  else {
+    Py_INCREF(Py_None);
+    self->name = Py_None;
+  }
+  if (self->name == NULL) {
+    Py_DECREF(self);
+    return NULL;
+  }
+  Py_BEGIN_ALLOW_THREADS
+  self->cache = lzo_cache_open(name, (size_t) size, (size_t) slot_size, shards, &err);
+  Py_END_ALLOW_THREADS
+
+  if (self->cache == NULL) {
+    Py_DECREF(self);
+    errno = err;
+    return PyErr_SetFromErrno(err == EINVAL ? PyExc_ValueError : PyExc_OSError);
+  }
+  return (PyObject *) self;
+}
+
+static void
+BlockCache_dealloc(BlockCacheObject *self)
+{
+  lzo_cache_close(self->cache);
+  Py_XDECREF(self->name);
+  Py_TYPE(self)->tp_free((PyObject *) self);
+}
+
+static int
+BlockCache_check(BlockCacheObject *self)
+{
+  if (self->cache == NULL) {
+    PyErr_SetString(PyExc_ValueError, "block cache is closed");
+    return -1;
+  }
+  return 0;
+}
+
+/* the cache for a call without the GIL, or NULL if it is closed */
+static lzo_cache_t *
+BlockCache_use(BlockCacheObject *self)
+{
+  if (BlockCache_check(self) < 0)
+    return NULL;
+  self->users++;
+  return self->cache;
+}
+
+static void
+BlockCache_done(BlockCacheObject *self)
+{
+  if (--self->users == 0 && self->closing != NULL) {
+    lzo_cache_close(self->closing);
+    self->closing = NULL;
+  }
+}
+
+static PyObject *
+BlockCache_get(BlockCacheObject *self, PyObject *args)
+{
+  lzo_cache_t *cache;
+  unsigned PY_LONG_LONG file, block;
+  Py_ssize_t len;
+  PyObject *out;
+  int found;
+
+  if (!PyArg_ParseTuple(args, "KKn:get", &file, &block, &len))
+    return NULL;
+  if (len < 0) {
+    PyErr_SetString(PyExc_ValueError, "negative length");
+    return NULL;
+  }
+  out = PyBytes_FromStringAndSize(NULL, len);
+  if (out == NULL)
+    return NULL;
+  cache = BlockCache_use(self);
+  if (cache == NULL) {
+    Py_DECREF(out);
+    return NULL;
+  }
+  Py_BEGIN_ALLOW_THREADS
+  found = lzo_cache_get(cache, file, block, PyBytes_AS_STRING(out), (size_t) len);
+  Py_END_ALLOW_THREADS
+  BlockCache_done(self);
+
+  if (!found) {
+    Py_DECREF(out);
+    Py_RETURN_NONE;
+  }
+  return out;
+}
+
+static PyObject *
+BlockCache_put(BlockCacheObject *self, PyObject *args)
+{
+  lzo_cache_t *cache;
+  unsigned PY_LONG_LONG file, block;
+  Py_buffer data;
+  int stored;
+
+  if (!PyArg_ParseTuple(args, "KKs*:put", &file, &block, &data))
+    return NULL;
+  cache = BlockCache_use(self);
+  if (cache == NULL) {
+    PyBuffer_Release(&data);
+    return NULL;
+  }
+  Py_BEGIN_ALLOW_THREADS
+  stored = lzo_cache_put(cache, file, block, data.buf, (size_t) data.len);
+  Py_END_ALLOW_THREADS
+  BlockCache_done(self);
+  PyBuffer_Release(&data);
+  return PyBool_FromLong(stored);
+}
+
+static PyObject *
+BlockCache_close(BlockCacheObject *self, PyObject *args)
+{
+  UNUSED(args);
+
+  if (self->users > 0)
+    self->closing = self->cache;
+  else
+    lzo_cache_close(self->cache);
+  self->cache = NULL;
+  Py_RETURN_NONE;
+}
+
+static PyObject *
+BlockCache_unlink(BlockCacheObject *self, PyObject *args)
+{
+  int err;
+  UNUSED(args);
+
+  if (self->name == Py_None) {
+    PyErr_SetString(PyExc_ValueError, "block cache has no name");
+    return NULL;
+  }
+  err = lzo_cache_unlink(PyString_AS_STRING(self->name));
+  if (err != 0) {
+    errno = err;
+    return PyErr_SetFromErrno(PyExc_OSError);
+  }
+  Py_RETURN_NONE;
+}
+
+static PyObject *
+BlockCache_enter(BlockCacheObject *self, PyObject *args)
+{
+  UNUSED(args);
+
+  if (BlockCache_check(self) < 0)
+    return NULL;
+  Py_INCREF(self);
+  return (PyObject *) self;
+}
+
+static PyObject *
+BlockCache_exit(BlockCacheObject *self, PyObject *args)
+{
+  return BlockCache_close(self, args);
+}
+
+static PyObject *
+BlockCache_get_slots(BlockCacheObject *self, void *closure)
+{
+  if (BlockCache_check(self) < 0)
+    return NULL;
+  return PyInt_FromSize_t(lzo_cache_slots(self->cache));
+}
+
+static PyObject *
+BlockCache_get_slot_size(BlockCacheObject *self, void *closure)
+{
+  if (BlockCache_check(self) < 0)
+    return NULL;
+  return PyInt_FromSize_t(lzo_cache_slot_size(self->cache));
+}
+
+static PyObject *
+BlockCache_get_name(BlockCacheObject *self, void *closure)
+{
+  Py_INCREF(self->name);
+  return self->name;
+}
+
+static PyObject *
+BlockCache_get_closed(BlockCacheObject *self, void *closure)
+{
+  return PyBool_FromLong(self->cache == NULL);
+}
+
+static PyObject *
+BlockCache_get_stats(BlockCacheObject *self, void *closure)
+{
+  lzo_cache_t *cache = BlockCache_use(self);
+  lzo_cache_stats_t st;
+
+  if (cache == NULL)
+    return NULL;
+  Py_BEGIN_ALLOW_THREADS
+  lzo_cache_stats(cache, &st);
+  Py_END_ALLOW_THREADS
+  BlockCache_done(self);
+  return Py_BuildValue("{sksksksksk}", "hits", st.hits, "misses", st.misses,
+                       "inserts", st.inserts, "evictions", st.evictions, "used", st.used);
+}
+
+static PyMethodDef BlockCache_methods[] = {
+  {"get", (PyCFunction)BlockCache_get, METH_VARARGS,
+   "get(file, block, length) the cached block, None unless it is there with\n"
+   "that length"},
+  {"put", (PyCFunction)BlockCache_put, METH_VARARGS,
+   "put(file, block, data) cache a block, False if it is larger than a slot"},
+  {"close", (PyCFunction)BlockCache_close, METH_NOARGS,
+   "close() unmap the cache, the other processes keep it"},
+  {"unlink", (PyCFunction)BlockCache_unlink, METH_NOARGS,
+   "unlink() remove the name of a named cache"},
+  {"__enter__", (PyCFunction)BlockCache_enter, METH_NOARGS, NULL},
+  {"__exit__", (PyCFunction)BlockCache_exit, METH_VARARGS, NULL},
+  {NULL, NULL, 0, NULL}
+};
+
+static PyGetSetDef BlockCache_getset[] = {
+  {"slots", (getter)BlockCache_get_slots, NULL, "number of blocks it holds", NULL},
+  {"slot_size", (getter)BlockCache_get_slot_size, NULL, "largest block it holds", NULL},
+  {"name", (getter)BlockCache_get_name, NULL, "shm name, None if anonymous", NULL},
+  {"closed", (getter)BlockCache_get_closed, NULL, "true after close()", NULL},
+  {"stats", (getter)BlockCache_get_stats, NULL,
+   "dict of the hits, misses, inserts, evictions and used slots of all the\n"
+   "processes sharing the cache", NULL},
+  {NULL, NULL, NULL, NULL, NULL}
+};
+
+static PyTypeObject BlockCacheType = {
+  PyVarObject_HEAD_INIT(NULL, 0)
+  "_lzo.BlockCache",                    /* tp_name */
+  sizeof(BlockCacheObject),             /* tp_basicsize */
+  0,                                    /* tp_itemsize */
+  (destructor)BlockCache_dealloc,       /* tp_dealloc */
+  0,                                    /* tp_print */
+  0,                                    /* tp_getattr */
+  0,                                    /* tp_setattr */
+  0,                                    /* tp_compare */
+  0,                                    /* tp_repr */
+  0,                                    /* tp_as_number */
+  0,                                    /* tp_as_sequence */
+  0,                                    /* tp_as_mapping */
+  0,                                    /* tp_hash */
+  0,                                    /* tp_call */
+  0,                                    /* tp_str */
+  0,                                    /* tp_getattro */
+  0,                                    /* tp_setattro */
+  0,                                    /* tp_as_buffer */
+  Py_TPFLAGS_DEFAULT,                   /* tp_flags */
+  BlockCache__doc__,                    /* tp_doc */
+  0,                                    /* tp_traverse */
+  0,                                    /* tp_clear */
+  0,                                    /* tp_richcompare */
+  0,                                    /* tp_weaklistoffset */
+  0,                                    /* tp_iter */
+  0,                                    /* tp_iternext */
+  BlockCache_methods,                   /* tp_methods */
+  0,                                    /* tp_members */
+  BlockCache_getset,                    /* tp_getset */
+  0,                                    /* tp_base */
+  0,                                    /* tp_dict */
+  0,                                    /* tp_descr_get */
+  0,                                    /* tp_descr_set */
+  0,                                    /* tp_dictoffset */
+  0,                                    /* tp_init */
+  0,                                    /* tp_alloc */
+  BlockCache_new,                       /* tp_new */
+};
+
+/***********************************************************************
+// main
+************************************************************************/
+
+static /* const */ PyMethodDef methods[] =
+{
+    {"compress_block", (PyCFunction)compress_block, METH_VARARGS, compress__doc__},
+    {"decompress_block", (PyCFunction)decompress_block, METH_VARARGS, decompress__doc__},
+    {"decompress_into", (PyCFunction)decompress_into, METH_VARARGS, decompress_into__doc__},
+    {"decompress_many", (PyCFunction)decompress_many, METH_VARARGS, decompress_many__doc__},
+    {"compress_many", (PyCFunction)compress_many, METH_VARARGS, compress_many__doc__},
+    {"compress_v", (PyCFunction)compress_v, METH_VARARGS, compress_v__doc__},
+    {"decompress_into_v", (PyCFunction)decompress_into_v, METH_VARARGS, decompress_into_v__doc__},
+    {"decompress_inplace", (PyCFunction)decompress_inplace, METH_VARARGS, decompress_inplace__doc__},
+    {"inplace_margin", (PyCFunction)inplace_margin, METH_VARARGS, inplace_margin__doc__},
+    {"set_pool_size", (PyCFunction)set_pool_size, METH_VARARGS, set_pool_size__doc__},
+    {"compress_fd", (PyCFunction)compress_fd, METH_VARARGS, compress_fd__doc__},
+    {"decompress_fd", (PyCFunction)decompress_fd, METH_VARARGS, decompress_fd__doc__},
+    {"aio_uring", (PyCFunction)aio_uring, METH_NOARGS, aio_uring__doc__},
+    {"set_pool_qos", (PyCFunction)set_pool_qos, METH_VARARGS, set_pool_qos__doc__},
+    {"pool_size", (PyCFunction)pool_size, METH_NOARGS, pool_size__doc__},
+    {"pool_stats", (PyCFunction)pool_stats, METH_NOARGS, pool_stats__doc__},
+    {"compress_block_restarts", (PyCFunction)compress_block_restarts, METH_VARARGS, compress_block_restarts__doc__},
+    {"lzo_adler32", (PyCFunction)py_lzo_adler32, METH_VARARGS, lzo_adler32__doc__},
+#ifdef USE_LIBLZO
+    {"lzo_crc32", (PyCFunction)py_lzo_crc32, METH_VARARGS, decompress__doc__},
+#endif
+    {NULL, NULL, 0, NULL}
+};
+
+
+static /* const */ char module_documentation[]=
+"This is a python library deals with lzo files compressed with lzop.\n\n"
+
+;
+
+
+#ifdef _MSC_VER
+_declspec(dllexport)
+#endif
+void init_lzo(void)
+{
+    PyObject *m, *d, *v;
+    if (lzo_init() != LZO_E_OK)
+    {
+        return;
+    }
+
+    if (PyType_Ready(&BlockDecoderType) < 0 ||
+        PyType_Ready(&MessageCompressorType) < 0 ||
+        PyType_Ready(&MessageDecompressorType) < 0 ||
+        PyType_Ready(&LzoMapType) < 0 ||
+        PyType_Ready(&BlockCacheType) < 0)
+        return;
+
+    m = Py_InitModule4("_lzo", methods, module_documentation,
+                       NULL, PYTHON_API_VERSION);
+    d = PyModule_GetDict(m);
+
+    Py_INCREF(&BlockDecoderType);
+    PyDict_SetItemString(d, "BlockDecoder", (PyObject *) &BlockDecoderType);
+    Py_INCREF(&MessageCompressorType);
+    PyDict_SetItemString(d, "MessageCompressor", (PyObject *) &MessageCompressorType);
+    Py_INCREF(&MessageDecompressorType);
+    PyDict_SetItemString(d, "MessageDecompressor", (PyObject *) &MessageDecompressorType);
+    Py_INCREF(&LzoMapType);
+    PyDict_SetItemString(d, "LzoMap", (PyObject *) &LzoMapType);
+    Py_INCREF(&BlockCacheType);
+    PyDict_SetItemString(d, "BlockCache", (PyObject *) &BlockCacheType);
+
+    LzoError = PyErr_NewException("_lzo.error", NULL, NULL);
+    PyDict_SetItemString(d, "error", LzoError);
+
+    v = PyString_FromString("<iridiummx@gmail.com>");
+    PyDict_SetItemString(d, "__author__", v);
+    Py_DECREF(v);
+
+    v = PyInt_FromLong(LZO_VERSION);
+    PyDict_SetItemString(d, "LZO_VERSION", v);
+    Py_DECREF(v);
+    v = PyString_FromString(LZO_VERSION_STRING);
+    PyDict_SetItemString(d, "LZO_VERSION_STRING", v);
+    Py_DECREF(v);
+    v = PyString_FromString(LZO_VERSION_DATE);
+    PyDict_SetItemString(d, "LZO_VERSION_DATE", v);
+    Py_DECREF(v);
+
+#if defined(SEEK_DATA) && defined(SEEK_HOLE)
+    /* os.lseek whence values for sparse files, os has them from 3.3 on */
+    v = PyInt_FromLong(SEEK_DATA);
+    PyDict_SetItemString(d, "SEEK_DATA", v);
+    Py_DECREF(v);
+    v = PyInt_FromLong(SEEK_HOLE);
+    PyDict_SetItemString(d, "SEEK_HOLE", v);
+    Py_DECREF(v);
+#endif
 }
 
 
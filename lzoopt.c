@@ -0,0 +1,821 @@
+/*
+ * Maximum ratio LZO1X compression, see lzoopt.h.
+ *
+ * The instruction costs and encodings follow lzo1x_decompress_safe in
+ * minilzo.c.  M1 comes in two kinds: after 1-3 literals it is a 2 byte
+ * match of 2 bytes within 0x400, after a run of 4 or more it is a 3 byte
+ * match 0x801-0xc00 back, both in 2 bytes.  That is why the parse keeps
+ * track of how long the current literal run is.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include "lzoopt.h"
+
+#define M1_MAX_OFFSET   0x0400
+#define M2_MAX_OFFSET   0x0800
+#define M1B_MAX_OFFSET  (M2_MAX_OFFSET + M1_MAX_OFFSET)
+#define M3_MAX_OFFSET   0x4000
+#define M4_MAX_OFFSET   0xbfff
+#define M2_MAX_LEN      8
+#define M3_MAX_LEN      33
+#define M4_MAX_LEN      9
+#define M3_MARKER       32
+#define M4_MARKER       16
+
+/* every match length up to this (the M2 ones) is tried, longer ones only
+   in full and cut to the longest that still costs 3 bytes */
+#define NICE_LEN        M2_MAX_LEN
+/* a match this long is taken without looking for matches inside it */
+#define FAST_LEN        64
+/* the positions ahead whose suffix array lines are fetched early */
+#define AHEAD           8
+/* 2 and 3 byte matches come from the last occurrence of their bytes */
+#define HEAD_SIZE       65536
+
+#define INF             0xffffffffu
+
+/* offset classes: the longest match within each limit is kept */
+enum { C_M1, C_M2, C_M1B, C_M3, C_M4, N_CLASS };
+
+static const lzo_uint class_limit[N_CLASS] = {
+  M1_MAX_OFFSET, M2_MAX_OFFSET, M1B_MAX_OFFSET, M3_MAX_OFFSET, M4_MAX_OFFSET
+};
+
+/* parse states: after a match, after 1-3 literals, after 4 or more */
+enum { S_MATCH, S_LIT1, S_LIT2, S_LIT3, S_LIT, N_STATE };
+
+typedef struct {
+  lzo_uint32_t cost[N_STATE];   /* bytes from the start of the chunk */
+  lzo_uint32_t run;             /* literals in the run of S_LIT */
+  lzo_uint32_t mlen;            /* match ending here, for S_MATCH */
+  unsigned short moff;
+  unsigned char mfrom;          /* state the match follows */
+  unsigned char lfrom;          /* S_LIT3 or S_LIT, before the last literal */
+} node_t;
+
+/***********************************************************************
+// suffix array, SA-IS (Nong, Zhang and Chan)
+************************************************************************/
+
+static void
+induce(const int *s, int *sa, int n, int upper, const unsigned char *ls,
+       const int *sum_s, const int *sum_l, int *buf, const int *lms, int m)
+{
+  int i;
+
+  for (i = 0; i < n; i++)
+    sa[i] = -1;
+  memcpy(buf, sum_s, (upper + 2) * sizeof(int));
+  for (i = 0; i < m; i++)
+    sa[buf[s[lms[i]]]++] = lms[i];
+
+  memcpy(buf, sum_l, (upper + 2) * sizeof(int));
+  sa[buf[s[n - 1]]++] = n - 1;
+  for (i = 0; i < n; i++) {
+    int v = sa[i];
+    if (v >= 1 && !ls[v - 1])
+      sa[buf[s[v - 1]]++] = v - 1;
+  }
+
+  memcpy(buf, sum_l, (upper + 2) * sizeof(int));
+  for (i = n - 1; i >= 0; i--) {
+    int v = sa[i];
+    if (v >= 1 && ls[v - 1])
+      sa[--buf[s[v - 1] + 1]] = v - 1;
+  }
+}
+
+/* sort the suffixes of s[0..n), whose values are in [0, upper] */
+static int
+sais(const int *s, int *sa, int n, int upper)
+{
+  unsigned char *ls;
+  int *sum_s, *sum_l, *buf, *lms_map, *lms, *sorted, *rec_s, *rec_sa;
+  int i, m = 0, rec_upper = 0;
+  int err = 0;
+
+  if (n <= 2) {
+    if (n == 1)
+      sa[0] = 0;
+    else if (n == 2) {
+      sa[0] = s[0] < s[1] ? 0 : 1;
+      sa[1] = 1 - sa[0];
+    }
+    return 0;
+  }
+
+  ls = (unsigned char *) malloc(n);
+  sum_s = (int *) calloc(upper + 2, sizeof(int));
+  sum_l = (int *) calloc(upper + 2, sizeof(int));
+  buf = (int *) malloc((upper + 2) * sizeof(int));
+  lms_map = (int *) malloc((n + 1) * sizeof(int));
+  lms = (int *) malloc((n / 2 + 1) * sizeof(int));
+  sorted = (int *) malloc((n / 2 + 1) * sizeof(int));
+  if (!ls || !sum_s || !sum_l || !buf || !lms_map || !lms || !sorted) {
+    err = -1;
+    goto done;
+  }
+
+  ls[n - 1] = 0;
+  for (i = n - 2; i >= 0; i--)
+    ls[i] = s[i] == s[i + 1] ? ls[i + 1] : s[i] < s[i + 1];
+  for (i = 0; i < n; i++) {
+    if (!ls[i])
+      sum_s[s[i]]++;
+    else
+      sum_l[s[i] + 1]++;
+  }
+  for (i = 0; i <= upper; i++) {
+    sum_s[i] += sum_l[i];
+    if (i < upper)
+      sum_l[i + 1] += sum_s[i];
+  }
+
+  for (i = 0; i <= n; i++)
+    lms_map[i] = -1;
+  for (i = 1; i < n; i++)
+    if (!ls[i - 1] && ls[i]) {
+      lms_map[i] = m;
+      lms[m++] = i;
+    }
+
+  induce(s, sa, n, upper, ls, sum_s, sum_l, buf, lms, m);
+  if (m == 0)
+    goto done;
+
+  /* name the sorted LMS substrings and sort them recursively */
+  for (i = 0, rec_upper = 0; i < n; i++)
+    if (lms_map[sa[i]] != -1)
+      sorted[rec_upper++] = sa[i];
+
+  rec_s = (int *) malloc(m * sizeof(int));
+  rec_sa = (int *) malloc(m * sizeof(int));
+  if (!rec_s || !rec_sa) {
+    free(rec_s);
+    free(rec_sa);
+    err = -1;
+    goto done;
+  }
+  rec_upper = 0;
+  rec_s[lms_map[sorted[0]]] = 0;
+  for (i = 1; i < m; i++) {
+    int l = sorted[i - 1], r = sorted[i];
+    int end_l = lms_map[l] + 1 < m ? lms[lms_map[l] + 1] : n;
+    int end_r = lms_map[r] + 1 < m ? lms[lms_map[r] + 1] : n;
+    int same = 1;
+
+    if (end_l - l != end_r - r)
+      same = 0;
+    else {
+      while (l < end_l && s[l] == s[r]) {
+        l++;
+        r++;
+      }
+      if (l == n || s[l] != s[r])
+        same = 0;
+    }
+    if (!same)
+      rec_upper++;
+    rec_s[lms_map[sorted[i]]] = rec_upper;
+  }
+
+  err = sais(rec_s, rec_sa, m, rec_upper);
+  if (err == 0) {
+    for (i = 0; i < m; i++)
+      sorted[i] = lms[rec_sa[i]];
+    induce(s, sa, n, upper, ls, sum_s, sum_l, buf, sorted, m);
+  }
+  free(rec_s);
+  free(rec_sa);
+
+done:
+  free(ls);
+  free(sum_s);
+  free(sum_l);
+  free(buf);
+  free(lms_map);
+  free(lms);
+  free(sorted);
+  return err;
+}
+
+/***********************************************************************
+// output
+************************************************************************/
+
+typedef struct {
+  lzo_bytep out;
+  lzo_bytep op;
+  const lzo_bytep lit;          /* start of the pending literal run */
+} emit_t;
+
+static void
+emit_literals(emit_t *e, const lzo_bytep ip)
+{
+  lzo_uint t = (lzo_uint) (ip - e->lit);
+  lzo_bytep op = e->op;
+
+  if (t == 0)
+    return;
+  if (op == e->out && t <= 238)
+    *op++ = (unsigned char) (17 + t);
+  else if (t <= 3)
+    op[-2] = (unsigned char) (op[-2] | t);
+  else if (t <= 18)
+    *op++ = (unsigned char) (t - 3);
+  else {
+    lzo_uint tt = t - 18;
+
+    *op++ = 0;
+    while (tt > 255) {
+      tt -= 255;
+      *op++ = 0;
+    }
+    *op++ = (unsigned char) tt;
+  }
+  memcpy(op, e->lit, t);
+  e->op = op + t;
+  e->lit = ip;
+}
+
+static void
+emit_match(emit_t *e, const lzo_bytep ip, lzo_uint m_len, lzo_uint m_off)
+{
+  lzo_uint run = (lzo_uint) (ip - e->lit);
+  const lzo_bytep end = ip + m_len;
+  lzo_bytep op;
+
+  emit_literals(e, ip);
+  op = e->op;
+
+  if (m_len == 2) {
+    /* only after 1-3 literals, within M1_MAX_OFFSET */
+    m_off -= 1;
+    *op++ = (unsigned char) ((m_off & 3) << 2);
+    *op++ = (unsigned char) (m_off >> 2);
+  }
+  else if (m_len == 3 && run >= 4 && m_off > M2_MAX_OFFSET && m_off <= M1B_MAX_OFFSET) {
+    m_off -= 1 + M2_MAX_OFFSET;
+    *op++ = (unsigned char) ((m_off & 3) << 2);
+    *op++ = (unsigned char) (m_off >> 2);
+  }
+  else if (m_off <= M2_MAX_OFFSET && m_len <= M2_MAX_LEN) {
+    m_off -= 1;
+    *op++ = (unsigned char) (((m_len - 1) << 5) | ((m_off & 7) << 2));
+    *op++ = (unsigned char) (m_off >> 3);
+  }
+  else {
+    if (m_off <= M3_MAX_OFFSET) {
+      m_off -= 1;
+      if (m_len <= M3_MAX_LEN)
+        *op++ = (unsigned char) (M3_MARKER | (m_len - 2));
+      else {
+        m_len -= M3_MAX_LEN;
+        *op++ = M3_MARKER | 0;
+        goto long_len;
+      }
+    }
+    else {
+      m_off -= 0x4000;
+      if (m_len <= M4_MAX_LEN)
+        *op++ = (unsigned char) (M4_MARKER | ((m_off >> 11) & 8) | (m_len - 2));
+      else {
+        m_len -= M4_MAX_LEN;
+        *op++ = (unsigned char) (M4_MARKER | ((m_off >> 11) & 8));
+long_len:
+        while (m_len > 255) {
+          m_len -= 255;
+          *op++ = 0;
+        }
+        *op++ = (unsigned char) m_len;
+      }
+    }
+    *op++ = (unsigned char) ((m_off & 63) << 2);
+    *op++ = (unsigned char) (m_off >> 6);
+  }
+  e->op = op;
+  e->lit = end;
+}
+
+/***********************************************************************
+// parse
+************************************************************************/
+
+/* header bytes of a literal run of t, first if it starts the stream */
+static lzo_uint32_t
+run_header(lzo_uint t, int first)
+{
+  if (t == 0)
+    return 0;
+  if (first && t <= 238)
+    return 1;
+  if (t <= 3)
+    return 0;
+  if (t <= 18)
+    return 1;
+  return (lzo_uint32_t) (2 + (t - 19) / 255);
+}
+
+/* bytes of a match of m_len from offset class c */
+static lzo_uint32_t
+match_cost(lzo_uint m_len, int c)
+{
+  if (c <= C_M2 && m_len <= M2_MAX_LEN)
+    return 2;
+  if (c <= C_M3)
+    return m_len <= M3_MAX_LEN ? 3 : (lzo_uint32_t) (4 + (m_len - M3_MAX_LEN - 1) / 255);
+  return m_len <= M4_MAX_LEN ? 3 : (lzo_uint32_t) (4 + (m_len - M4_MAX_LEN - 1) / 255);
+}
+
+/* a match of m_len from a node in state s whose cost is cost */
+static void
+relax(node_t *y, lzo_uint32_t cost, int s, lzo_uint m_len,
+      const lzo_uint *best, const lzo_uint *off)
+{
+  int c = 0;
+
+  while (best[c] < m_len)
+    c++;
+  if (m_len == 2) {
+    if (c != C_M1 || s == S_MATCH || s == S_LIT)
+      return;
+    cost += 2;
+  }
+  else if (c == C_M1B && m_len == 3 && s == S_LIT)
+    cost += 2;
+  else
+    cost += match_cost(m_len, c);
+
+  if (cost < y->cost[S_MATCH]) {
+    y->cost[S_MATCH] = cost;
+    y->mlen = (lzo_uint32_t) m_len;
+    y->moff = (unsigned short) off[c];
+    y->mfrom = (unsigned char) s;
+  }
+}
+
+/***********************************************************************
+// window sets
+************************************************************************/
+
+/* the suffix array ranks of the positions within one offset limit of the
+   current one, as a bitmap with a summary of its non-empty words.  The
+   ranks next to that of the current position are its longest matches
+   within the limit */
+typedef struct {
+  lzo_uint32_t *w0;
+  lzo_uint32_t *w1;
+  int n1;                       /* words in w1 */
+} wset_t;
+
+#if defined(__GNUC__)
+#  define HIGH_BIT(x)   (31 - __builtin_clz(x))
+#  define LOW_BIT(x)    __builtin_ctz(x)
+#  define PREFETCH(p)   __builtin_prefetch(p)
+#else
+#  define PREFETCH(p)   ((void) 0)
+static int
+HIGH_BIT(lzo_uint32_t x)
+{
+  int b = 0;
+
+  while (x >>= 1)
+    b++;
+  return b;
+}
+
+static int
+LOW_BIT(lzo_uint32_t x)
+{
+  int b = 0;
+
+  while (!(x & 1)) {
+    x >>= 1;
+    b++;
+  }
+  return b;
+}
+#endif
+
+static void
+wset_clear(wset_t *s, int n)
+{
+  s->n1 = (n >> 10) + 1;
+  memset(s->w0, 0, ((n >> 5) + 1) * sizeof(lzo_uint32_t));
+  memset(s->w1, 0, s->n1 * sizeof(lzo_uint32_t));
+}
+
+static void
+wset_add(wset_t *s, int r)
+{
+  s->w0[r >> 5] |= (lzo_uint32_t) 1 << (r & 31);
+  s->w1[r >> 10] |= (lzo_uint32_t) 1 << ((r >> 5) & 31);
+}
+
+static void
+wset_remove(wset_t *s, int r)
+{
+  if ((s->w0[r >> 5] &= ~((lzo_uint32_t) 1 << (r & 31))) == 0)
+    s->w1[r >> 10] &= ~((lzo_uint32_t) 1 << ((r >> 5) & 31));
+}
+
+/* largest member below r, or -1 */
+static int
+wset_pred(const wset_t *s, int r)
+{
+  int i = r >> 5, j;
+  lzo_uint32_t m = s->w0[i] & (((lzo_uint32_t) 1 << (r & 31)) - 1);
+
+  if (m)
+    return (i << 5) + HIGH_BIT(m);
+  j = i >> 5;
+  m = s->w1[j] & (((lzo_uint32_t) 1 << (i & 31)) - 1);
+  while (!m) {
+    if (--j < 0)
+      return -1;
+    m = s->w1[j];
+  }
+  i = (j << 5) + HIGH_BIT(m);
+  return (i << 5) + HIGH_BIT(s->w0[i]);
+}
+
+/* smallest member above r, or -1 */
+static int
+wset_succ(const wset_t *s, int r)
+{
+  int i = r >> 5, j;
+  lzo_uint32_t m = (r & 31) == 31 ? 0 : s->w0[i] & ((lzo_uint32_t) ~0 << ((r & 31) + 1));
+
+  if (m)
+    return (i << 5) + LOW_BIT(m);
+  j = i >> 5;
+  m = (i & 31) == 31 ? 0 : s->w1[j] & ((lzo_uint32_t) ~0 << ((i & 31) + 1));
+  while (!m) {
+    if (++j >= s->n1)
+      return -1;
+    m = s->w1[j];
+  }
+  i = (j << 5) + LOW_BIT(m);
+  return (i << 5) + LOW_BIT(s->w0[i]);
+}
+
+/***********************************************************************
+// match finder
+************************************************************************/
+
+/* the window sets, for M2, M3 and M4 */
+#define N_SET           3
+
+static const lzo_uint set_limit[N_SET] = {
+  M2_MAX_OFFSET, M3_MAX_OFFSET, M4_MAX_OFFSET
+};
+
+static const int set_class[N_SET] = { C_M2, C_M3, C_M4 };
+
+typedef struct {
+  const lzo_bytep in;
+  const lzo_bytep text;         /* what the suffix array covers */
+  int *sa;
+  int *rank;
+  int *tmp;
+  wset_t set[N_SET];
+  int *head2;                   /* last text position of each 2 bytes */
+  int *head3;                   /* and of 3 bytes, hashed */
+  node_t *node;
+  lzo_uint *match;              /* ends of the chosen matches */
+} parse_t;
+
+#define HEAD2(t)        ((t)[0] | (t)[1] << 8)
+#define HEAD3(t)        ((((t)[0] << 16 | (t)[1] << 8 | (t)[2]) * 0x9e37u >> 8) & (HEAD_SIZE - 1))
+
+/* text position p becomes a match source for the positions after it */
+static void
+remember(parse_t *w, int p, int n)
+{
+  const lzo_bytep t = w->text + p;
+  int k;
+
+  if (p + 2 <= n)
+    w->head2[HEAD2(t)] = p;
+  if (p + 3 <= n)
+    w->head3[HEAD3(t)] = p;
+  for (k = 0; k < N_SET; k++) {
+    wset_add(&w->set[k], w->rank[p]);
+    if ((lzo_uint) p >= set_limit[k])
+      wset_remove(&w->set[k], w->rank[p - set_limit[k]]);
+  }
+}
+
+/* the window words and suffix array entry find_matches reads at text
+   position p, which are otherwise cache misses */
+static void
+prefetch(const parse_t *w, int p, int n)
+{
+  int r, k;
+
+  if (p >= n)
+    return;
+  r = w->rank[p];
+  PREFETCH(&w->sa[r]);
+  for (k = 0; k < N_SET; k++)
+    PREFETCH(&w->set[k].w0[r >> 5]);
+}
+
+/* a match of m from distance d, for every class that reaches that far */
+static void
+add_match(lzo_uint *best, lzo_uint *off, lzo_uint d, lzo_uint m)
+{
+  int c;
+
+  for (c = N_CLASS - 1; c >= 0 && d <= class_limit[c]; c--)
+    if (best[c] < m) {
+      best[c] = m;
+      off[c] = d;
+    }
+}
+
+static lzo_uint
+match_len(const lzo_bytep a, const lzo_bytep b, lzo_uint max)
+{
+  lzo_uint n = 0;
+
+  while (n + 8 <= max && memcmp(a + n, b + n, 8) == 0)
+    n += 8;
+  while (n < max && a[n] == b[n])
+    n++;
+  return n;
+}
+
+/* find, for each class, the longest match at text position p of text[0..n):
+   2 and 3 bytes from the last occurrence, longer ones from the suffix
+   array neighbours of p within each window */
+static void
+find_matches(const parse_t *w, int p, int n, lzo_uint *best, lzo_uint *off)
+{
+  const lzo_bytep t = w->text + p;
+  int r = w->rank[p];
+  int i, k, c, q;
+
+  for (c = 0; c < N_CLASS; c++)
+    best[c] = off[c] = 0;
+
+  if (p + 2 <= n && (q = w->head2[HEAD2(t)]) >= 0 && (lzo_uint) (p - q) <= M4_MAX_OFFSET)
+    add_match(best, off, (lzo_uint) (p - q), 2);
+  if (p + 3 > n)
+    return;
+  q = w->head3[HEAD3(t)];
+  if (q < 0)
+    return;             /* nothing starts like p */
+  if (memcmp(w->text + q, t, 3) == 0) {
+    if ((lzo_uint) (p - q) > M4_MAX_OFFSET)
+      return;
+    add_match(best, off, (lzo_uint) (p - q), 3);
+  }
+
+  /* the windows nest, so a neighbour found in a wider one that is also
+     within a narrower one is the neighbour there too, and one further out
+     matches no longer than that of the wider one */
+  for (i = 0; i < 2; i++) {
+    lzo_uint d = M4_MAX_OFFSET + 1, m = INF;
+
+    for (k = N_SET - 1; k >= 0; k--) {
+      int rq;
+
+      if (d <= set_limit[k])
+        continue;
+      if (m <= best[set_class[k]])
+        break;
+      rq = i == 0 ? wset_pred(&w->set[k], r) : wset_succ(&w->set[k], r);
+      if (rq < 0)
+        break;
+      q = w->sa[rq];
+      d = (lzo_uint) (p - q);
+      m = match_len(t, w->text + q, (lzo_uint) (n - p));
+      add_match(best, off, d, m);
+    }
+  }
+}
+
+/***********************************************************************
+// parse
+************************************************************************/
+
+/* parse in[start..end), with text[0..n) = in[end - n..end) in the suffix
+   array; the chunk begins in state *state with a literal run of *run.
+   Emits the matches and leaves the state at the end in *state / *run */
+static void
+parse_chunk(parse_t *w, emit_t *e, lzo_uint start, lzo_uint end, int n,
+            int *state, lzo_uint *run)
+{
+  node_t *node = w->node;
+  lzo_uint len = end - start;
+  lzo_uint base = end - (lzo_uint) n;   /* in position of text[0] */
+  lzo_uint p, skip = 0;
+  lzo_uint best[N_CLASS], off[N_CLASS];
+  lzo_uint nm;
+  int s;
+
+  for (p = 0; p <= len; p++)
+    for (s = 0; s < N_STATE; s++)
+      node[p].cost[s] = INF;
+  node[0].cost[*state] = 0;
+  node[0].run = (lzo_uint32_t) *run;
+
+  memset(w->head2, 0xff, HEAD_SIZE * sizeof(int));
+  memset(w->head3, 0xff, HEAD_SIZE * sizeof(int));
+  for (s = 0; s < N_SET; s++)
+    wset_clear(&w->set[s], n);
+  for (p = 0; p < start - base; p++)
+    remember(w, (int) p, n);
+
+  for (p = 0; p < len; p++) {
+    node_t *x = &node[p];
+    lzo_uint gp = start + p;
+    lzo_uint maxl, top, m_len;
+    int c, lit, from;
+
+    /* one more literal */
+    for (s = 0; s < N_STATE; s++) {
+      lzo_uint t = s == S_LIT ? x->run : (lzo_uint) s;
+      int first = gp == t;
+      lzo_uint32_t cost;
+      node_t *y = &node[p + 1];
+      int to = s < S_LIT ? s + 1 : S_LIT;
+
+      if (x->cost[s] == INF)
+        continue;
+      cost = x->cost[s] + 1 + run_header(t + 1, first) - run_header(t, first);
+      if (cost < y->cost[to]) {
+        y->cost[to] = cost;
+        if (to == S_LIT) {
+          y->run = (lzo_uint32_t) (t + 1);
+          y->lfrom = (unsigned char) s;
+        }
+      }
+    }
+
+    if (p < skip) {
+      remember(w, (int) (gp - base), n);
+      continue;
+    }
+    prefetch(w, (int) (gp - base + AHEAD), n);
+    find_matches(w, (int) (gp - base), n, best, off);
+    remember(w, (int) (gp - base), n);
+    maxl = best[C_M4];
+    if (maxl < 2)
+      continue;
+    if (maxl >= FAST_LEN)
+      skip = p + maxl;
+
+    /* the states only differ in M1, so each length is tried from the
+       cheapest of them, the M1 kinds from theirs */
+    lit = S_LIT1;
+    for (s = S_LIT2; s <= S_LIT3; s++)
+      if (x->cost[s] < x->cost[lit])
+        lit = s;
+    from = x->cost[S_LIT] < x->cost[lit] ? S_LIT : lit;
+    if (x->cost[S_MATCH] < x->cost[from])
+      from = S_MATCH;
+
+    top = maxl < NICE_LEN ? maxl : NICE_LEN;
+    if (x->cost[lit] != INF)
+      relax(&node[p + 2], x->cost[lit], lit, 2, best, off);
+    if (x->cost[S_LIT] != INF && best[C_M2] < 3 && best[C_M1B] >= 3)
+      relax(&node[p + 3], x->cost[S_LIT], S_LIT, 3, best, off);
+    for (c = 0, m_len = 3; c < N_CLASS; c++) {
+      lzo_uint hi = best[c] < top ? best[c] : top;
+
+      for (; m_len <= hi; m_len++) {
+        lzo_uint32_t cost = x->cost[from] + match_cost(m_len, c);
+        node_t *y = &node[p + m_len];
+
+        if (cost < y->cost[S_MATCH]) {
+          y->cost[S_MATCH] = cost;
+          y->mlen = (lzo_uint32_t) m_len;
+          y->moff = (unsigned short) off[c];
+          y->mfrom = (unsigned char) from;
+        }
+      }
+    }
+    for (c = 0; c < N_CLASS; c++) {
+      lzo_uint edge = c <= C_M3 ? M3_MAX_LEN : M4_MAX_LEN;
+
+      if (best[c] <= top || (c > 0 && best[c] == best[c - 1]))
+        continue;
+      relax(&node[p + best[c]], x->cost[from], from, best[c], best, off);
+      if (edge > top && edge < best[c])
+        relax(&node[p + edge], x->cost[from], from, edge, best, off);
+    }
+  }
+
+  /* cheapest state at the end, then back to the start */
+  for (s = 0, *state = 0; s < N_STATE; s++)
+    if (node[len].cost[s] < node[len].cost[*state])
+      *state = s;
+  *run = *state == S_LIT ? node[len].run : (lzo_uint) *state;
+
+  nm = 0;
+  for (p = len, s = *state; p > 0; ) {
+    if (s == S_MATCH) {
+      w->match[nm++] = p;
+      s = node[p].mfrom;
+      p -= node[p].mlen;
+    }
+    else {
+      s = s == S_LIT ? node[p].lfrom : s - 1;
+      p--;
+    }
+  }
+  while (nm > 0) {
+    p = w->match[--nm];
+    emit_match(e, w->in + start + p - node[p].mlen, node[p].mlen, node[p].moff);
+  }
+}
+
+/***********************************************************************
+// compress
+************************************************************************/
+
+/* suffix array and rank of text[0..n) */
+static int
+index_text(parse_t *w, const lzo_bytep text, int n)
+{
+  int i;
+
+  for (i = 0; i < n; i++)
+    w->tmp[i] = text[i];
+  if (sais(w->tmp, w->sa, n, 255) != 0)
+    return LZO_E_OUT_OF_MEMORY;
+  for (i = 0; i < n; i++)
+    w->rank[w->sa[i]] = i;
+  return LZO_E_OK;
+}
+
+int
+lzo1x_opt_compress(const lzo_bytep in, lzo_uint in_len,
+                   lzo_bytep out, lzo_uintp out_len)
+{
+  lzo_uint chunk = in_len < LZO_OPT_CHUNK ? in_len : LZO_OPT_CHUNK;
+  lzo_uint text = chunk + (in_len > chunk ? M4_MAX_OFFSET : 0);
+  lzo_uint start, run = 0;
+  int state = S_MATCH;
+  int err = LZO_E_OK;
+  int k;
+  parse_t w;
+  emit_t e;
+
+  e.out = e.op = out;
+  e.lit = in;
+  memset(&w, 0, sizeof(w));
+  w.in = in;
+
+  if (in_len > 0) {
+    w.sa = (int *) malloc(text * sizeof(int));
+    w.rank = (int *) malloc(text * sizeof(int));
+    w.tmp = (int *) malloc(text * sizeof(int));
+    w.node = (node_t *) malloc((chunk + 1) * sizeof(node_t));
+    w.match = (lzo_uint *) malloc((chunk / 2 + 1) * sizeof(lzo_uint));
+    w.head2 = (int *) malloc(HEAD_SIZE * sizeof(int));
+    w.head3 = (int *) malloc(HEAD_SIZE * sizeof(int));
+    for (k = 0; k < N_SET; k++) {
+      w.set[k].w0 = (lzo_uint32_t *) malloc(((text >> 5) + 1) * sizeof(lzo_uint32_t));
+      w.set[k].w1 = (lzo_uint32_t *) malloc(((text >> 10) + 1) * sizeof(lzo_uint32_t));
+      if (!w.set[k].w0 || !w.set[k].w1)
+        err = LZO_E_OUT_OF_MEMORY;
+    }
+    if (!w.sa || !w.rank || !w.tmp || !w.node || !w.match || !w.head2 || !w.head3)
+      err = LZO_E_OUT_OF_MEMORY;
+  }
+
+  for (start = 0; start < in_len && err == LZO_E_OK; start += chunk) {
+    lzo_uint end = in_len - start < chunk ? in_len : start + chunk;
+    lzo_uint from = start > M4_MAX_OFFSET ? start - M4_MAX_OFFSET : 0;
+
+    w.text = in + from;
+    err = index_text(&w, in + from, (int) (end - from));
+    if (err == LZO_E_OK)
+      parse_chunk(&w, &e, start, end, (int) (end - from), &state, &run);
+  }
+
+  free(w.sa);
+  free(w.rank);
+  free(w.tmp);
+  free(w.node);
+  free(w.match);
+  free(w.head2);
+  free(w.head3);
+  for (k = 0; k < N_SET; k++) {
+    free(w.set[k].w0);
+    free(w.set[k].w1);
+  }
+  if (err != LZO_E_OK)
+    return err;
+
+  emit_literals(&e, in + in_len);
+  *e.op++ = M4_MARKER | 1;
+  *e.op++ = 0;
+  *e.op++ = 0;
+  *out_len = (lzo_uint) (e.op - out);
+  return LZO_E_OK;
+}
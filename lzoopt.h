@@ -0,0 +1,33 @@
+/*
+ * Maximum ratio LZO1X compression.
+ *
+ * Matches come from a suffix array (built with SA-IS) rather than from
+ * hash chains: of the positions within an offset limit, the ones next to
+ * the current position in the array share the longest prefix with it, so
+ * keeping a window of array ranks for each of the M2-M4 limits gives the
+ * longest match of every instruction kind with two lookups per window.
+ * The instructions are then chosen by a shortest path over their cost in
+ * bytes (the literal runs included), so the stream is the smallest those
+ * matches allow.  The output is plain LZO1X, any decoder reads it.
+ *
+ * Input is parsed LZO_OPT_CHUNK bytes at a time, matches reach back into
+ * the chunks before.  Memory is about 50 bytes per byte of a chunk, taken
+ * with malloc for each call.
+ *
+ * It runs at a few MB/s, about as fast as LZO1X-999, and is not meant as
+ * a quicker replacement for it: bench.py -m opt compares the two.
+ */
+
+#ifndef LZOOPT_H
+#define LZOOPT_H
+
+#include "minilzo.h"
+
+#define LZO_OPT_CHUNK       (256*1024l)
+
+/* out needs room for in_len + in_len / 64 + 16 + 3 bytes. Returns
+ * LZO_E_OUT_OF_MEMORY if the work arrays can't be allocated */
+int lzo1x_opt_compress(const lzo_bytep in, lzo_uint in_len,
+                       lzo_bytep out, lzo_uintp out_len);
+
+#endif
@@ -0,0 +1,558 @@
+/*
+ * Work-stealing thread pool, see lzopool.h.
+ *
+ * Locking: pool.lock guards the pool state, the counts of queued tasks and
+ * the completion of jobs; the deques of every worker (one per class) have
+ * a lock of their own.  A thread first reserves a task by decrementing
+ * pool.queued[cls] and then takes one from some deque of that class,
+ * there is always one for each reservation.  pool.latency alone changes
+ * without the lock, by atomic operations, so small calls never take it.
+ */
+
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE             /* sched_getaffinity */
+#endif
+
+#include <stdlib.h>
+#include "lzopool.h"
+
+#ifdef _WIN32
+
+/* no pool, everything runs in the calling thread */
+
+int
+lzo_pool_run(int n, lzo_pool_fn fn, void *ctx, int cls)
+{
+  int k;
+
+  (void) cls;
+  for (k = 0; k < n; k++)
+    fn(ctx, k);
+  return 0;
+}
+
+void
+lzo_pool_latency_enter(void)
+{
+}
+
+void
+lzo_pool_latency_leave(void)
+{
+}
+
+void
+lzo_pool_set_qos(int on)
+{
+  (void) on;
+}
+
+int
+lzo_pool_size(void)
+{
+  return 1;
+}
+
+void
+lzo_pool_set_size(int size)
+{
+  (void) size;
+}
+
+void
+lzo_pool_stats(int i, lzo_pool_stats_t *st)
+{
+  (void) i;
+  st->tasks = st->steals = st->latency = 0;
+  st->busy = st->uptime = 0;
+}
+
+#else
+
+#include <pthread.h>
+#include <sched.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#define MAX_WORKERS     256
+
+typedef struct {
+  lzo_pool_fn fn;
+  void *ctx;
+  int cls;
+  int remaining;                /* tasks not finished yet */
+  pthread_cond_t done;
+} job_t;
+
+typedef struct {
+  job_t *job;
+  int k;
+} task_t;
+
+typedef struct {
+  task_t *tasks;                /* ring, the top is tasks[head] */
+  int cap;
+  int head;
+  int count;
+} deque_t;
+
+typedef struct {
+  pthread_mutex_t lock;
+  deque_t q[LZO_POOL_CLASSES];
+  pthread_t thread;
+  double start;
+  lzo_pool_stats_t st;
+} worker_t;
+
+static struct {
+  pthread_mutex_t lock;
+  pthread_cond_t work;          /* a task may be taken, or stopping */
+  pthread_cond_t idle;          /* running == 0 or a stop has finished */
+  int size;                     /* wanted, 0 for one per CPU */
+  int started;
+  int stopping;
+  int running;                  /* lzo_pool_run calls in progress */
+  int queued[LZO_POOL_CLASSES]; /* unreserved tasks in the deques */
+  int latency;                  /* latency work in flight, atomic */
+  int bulk;                     /* bulk tasks being run */
+  int qos;
+  int n;
+  worker_t *workers;
+} pool = {
+  PTHREAD_MUTEX_INITIALIZER, PTHREAD_COND_INITIALIZER, PTHREAD_COND_INITIALIZER,
+  0, 0, 0, 0, {0, 0}, 0, 0, 1
+};
+
+static double
+now(void)
+{
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+static int
+cpu_count(void)
+{
+  long n;
+#ifdef CPU_COUNT
+  cpu_set_t set;
+
+  if (sched_getaffinity(0, sizeof(set), &set) == 0 && CPU_COUNT(&set) > 0)
+    return CPU_COUNT(&set);
+#endif
+  n = sysconf(_SC_NPROCESSORS_ONLN);
+  return n > 0 ? (int) n : 1;
+}
+
+static int
+wanted_size(void)
+{
+  int n = pool.size > 0 ? pool.size : cpu_count();
+
+  return n < MAX_WORKERS ? n : MAX_WORKERS;
+}
+
+/* push tasks k in [lo, hi) of job to the bottom of w, highest first so the
+   owner runs them in order. Returns -1 if out of memory */
+static int
+push(worker_t *w, job_t *job, int lo, int hi)
+{
+  deque_t *q = &w->q[job->cls];
+  int k;
+
+  pthread_mutex_lock(&w->lock);
+  if (q->count + (hi - lo) > q->cap) {
+    int cap = (q->count + (hi - lo)) * 2;
+    task_t *tasks = (task_t *) malloc(cap * sizeof(task_t));
+    int i;
+
+    if (tasks == NULL) {
+      pthread_mutex_unlock(&w->lock);
+      return -1;
+    }
+    for (i = 0; i < q->count; i++)
+      tasks[i] = q->tasks[(q->head + i) % q->cap];
+    free(q->tasks);
+    q->tasks = tasks;
+    q->cap = cap;
+    q->head = 0;
+  }
+  for (k = hi - 1; k >= lo; k--) {
+    task_t *t = &q->tasks[(q->head + q->count++) % q->cap];
+
+    t->job = job;
+    t->k = k;
+  }
+  pthread_mutex_unlock(&w->lock);
+  return 0;
+}
+
+/* take a reserved task of class cls: the newest of worker me (-1 for
+   none), else the oldest of another worker */
+static void
+take(int me, int cls, task_t *t, int *stolen)
+{
+  int i;
+
+  for (;;) {
+    if (me >= 0) {
+      worker_t *w = &pool.workers[me];
+      deque_t *q = &w->q[cls];
+
+      pthread_mutex_lock(&w->lock);
+      if (q->count > 0) {
+        *t = q->tasks[(q->head + --q->count) % q->cap];
+        pthread_mutex_unlock(&w->lock);
+        *stolen = 0;
+        return;
+      }
+      pthread_mutex_unlock(&w->lock);
+    }
+    for (i = 1; i <= pool.n; i++) {
+      worker_t *w = &pool.workers[(me + i + pool.n) % pool.n];
+      deque_t *q = &w->q[cls];
+
+      pthread_mutex_lock(&w->lock);
+      if (q->count > 0) {
+        *t = q->tasks[q->head];
+        q->head = (q->head + 1) % q->cap;
+        q->count--;
+        pthread_mutex_unlock(&w->lock);
+        *stolen = 1;
+        return;
+      }
+      pthread_mutex_unlock(&w->lock);
+    }
+    /* a task pushed after the scan started, look again */
+    sched_yield();
+  }
+}
+
+/* class of the task to reserve next, -1 if none may be taken now. Bulk
+   tasks only run on the CPUs latency work leaves, but always on one at
+   least, so that steady latency work can't stall them. Called with
+   pool.lock */
+static int
+next_class(void)
+{
+  if (pool.queued[LZO_POOL_LATENCY] > 0)
+    return LZO_POOL_LATENCY;
+  if (pool.queued[LZO_POOL_BULK] > 0) {
+    int slots;
+
+    /* pairs with lzo_pool_latency_leave: it sees the queued task or this
+       sees its decrement */
+    __sync_synchronize();
+    slots = pool.n - pool.latency;
+    if (!pool.qos || pool.bulk < (slots > 1 ? slots : 1))
+      return LZO_POOL_BULK;
+  }
+  return -1;
+}
+
+/* reserve a task of class cls. Called with pool.lock */
+static void
+reserve(int cls)
+{
+  pool.queued[cls]--;
+  if (cls == LZO_POOL_BULK)
+    pool.bulk++;
+}
+
+static void
+run_task(worker_t *w, task_t *t, int stolen)
+{
+  int cls = t->job->cls;
+  double t0 = w ? now() : 0;
+
+  t->job->fn(t->job->ctx, t->k);
+  if (w) {
+    double busy = now() - t0;
+
+    pthread_mutex_lock(&w->lock);
+    w->st.tasks++;
+    w->st.steals += stolen;
+    w->st.latency += cls == LZO_POOL_LATENCY;
+    w->st.busy += busy;
+    pthread_mutex_unlock(&w->lock);
+  }
+
+  pthread_mutex_lock(&pool.lock);
+  if (cls == LZO_POOL_BULK && --pool.bulk >= 0 && pool.queued[LZO_POOL_BULK] > 0)
+    pthread_cond_broadcast(&pool.work);     /* a bulk slot is free again */
+  if (--t->job->remaining == 0)
+    pthread_cond_broadcast(&t->job->done);
+  pthread_mutex_unlock(&pool.lock);
+}
+
+static void *
+worker_main(void *arg)
+{
+  worker_t *w = (worker_t *) arg;
+  int me = (int) (w - pool.workers);
+
+  for (;;) {
+    task_t t;
+    int stolen;
+    int cls;
+
+    pthread_mutex_lock(&pool.lock);
+    while ((cls = next_class()) < 0 && !pool.stopping)
+      pthread_cond_wait(&pool.work, &pool.lock);
+    if (cls < 0) {
+      pthread_mutex_unlock(&pool.lock);
+      break;
+    }
+    reserve(cls);
+    pthread_mutex_unlock(&pool.lock);
+
+    take(me, cls, &t, &stolen);
+    run_task(w, &t, stolen);
+  }
+  return NULL;
+}
+
+/* the forked child has none of the threads, start over there */
+static void
+before_fork(void)
+{
+  pthread_mutex_lock(&pool.lock);
+}
+
+static void
+after_fork_parent(void)
+{
+  pthread_mutex_unlock(&pool.lock);
+}
+
+static void
+after_fork_child(void)
+{
+  pthread_mutex_init(&pool.lock, NULL);
+  pthread_cond_init(&pool.work, NULL);
+  pthread_cond_init(&pool.idle, NULL);
+  pool.started = pool.stopping = pool.running = 0;
+  pool.queued[LZO_POOL_LATENCY] = pool.queued[LZO_POOL_BULK] = 0;
+  pool.latency = pool.bulk = 0;
+  pool.n = 0;
+  pool.workers = NULL;          /* leaked, the deque locks may be held */
+}
+
+/* start the pool if needed and count a run in. Called with pool.lock */
+static int
+enter(void)
+{
+  static int atfork;
+  int i;
+
+  while (pool.stopping)
+    pthread_cond_wait(&pool.idle, &pool.lock);
+
+  if (!pool.started) {
+    int n = wanted_size();
+
+    if (!atfork) {
+      if (pthread_atfork(before_fork, after_fork_parent, after_fork_child) != 0)
+        return -1;
+      atfork = 1;
+    }
+    pool.workers = (worker_t *) calloc(n, sizeof(worker_t));
+    if (pool.workers == NULL)
+      return -1;
+    for (i = 0; i < n; i++) {
+      pthread_mutex_init(&pool.workers[i].lock, NULL);
+      pool.workers[i].start = now();
+    }
+    pool.n = n;
+    for (i = 0; i < n; i++) {
+      if (pthread_create(&pool.workers[i].thread, NULL, worker_main,
+                         &pool.workers[i]) != 0)
+        break;
+    }
+    if (i == 0) {
+      free(pool.workers);
+      pool.workers = NULL;
+      pool.n = 0;
+      return -1;
+    }
+    /* fewer threads than planned, live with those */
+    pool.n = i;
+    pool.started = 1;
+  }
+  pool.running++;
+  return 0;
+}
+
+int
+lzo_pool_run(int n, lzo_pool_fn fn, void *ctx, int cls)
+{
+  job_t job;
+  int i, k;
+
+  if (n <= 0)
+    return 0;
+
+  pthread_mutex_lock(&pool.lock);
+  if (enter() < 0) {
+    pthread_mutex_unlock(&pool.lock);
+    for (k = 0; k < n; k++)
+      fn(ctx, k);
+    return -1;
+  }
+  if (cls == LZO_POOL_LATENCY)
+    __sync_fetch_and_add(&pool.latency, 1);
+  pthread_mutex_unlock(&pool.lock);
+
+  job.fn = fn;
+  job.ctx = ctx;
+  job.cls = cls;
+  job.remaining = n;
+  pthread_cond_init(&job.done, NULL);
+
+  /* deal out contiguous ranges, the thieves even out the rest */
+  for (i = 0, k = 0; i < pool.n; i++) {
+    int hi = (int) ((long) n * (i + 1) / pool.n);
+
+    if (hi > k && push(&pool.workers[i], &job, k, hi) < 0)
+      break;
+    k = hi;
+  }
+
+  pthread_mutex_lock(&pool.lock);
+  pool.queued[cls] += k;
+  pthread_cond_broadcast(&pool.work);
+  pthread_mutex_unlock(&pool.lock);
+
+  /* what could not be queued runs here */
+  for (; k < n; k++) {
+    task_t t;
+
+    t.job = &job;
+    t.k = k;
+    run_task(NULL, &t, 0);
+  }
+
+  /* help out until the job is done */
+  pthread_mutex_lock(&pool.lock);
+  while (job.remaining > 0) {
+    int c = next_class();
+
+    if (c >= 0) {
+      task_t t;
+      int stolen;
+
+      reserve(c);
+      pthread_mutex_unlock(&pool.lock);
+      take(-1, c, &t, &stolen);
+      run_task(NULL, &t, stolen);
+      pthread_mutex_lock(&pool.lock);
+    }
+    else
+      pthread_cond_wait(&job.done, &pool.lock);
+  }
+  if (cls == LZO_POOL_LATENCY && __sync_sub_and_fetch(&pool.latency, 1) == 0)
+    pthread_cond_broadcast(&pool.work);
+  if (--pool.running == 0)
+    pthread_cond_broadcast(&pool.idle);
+  pthread_mutex_unlock(&pool.lock);
+
+  pthread_cond_destroy(&job.done);
+  return 0;
+}
+
+int
+lzo_pool_size(void)
+{
+  int n;
+
+  pthread_mutex_lock(&pool.lock);
+  n = pool.started ? pool.n : wanted_size();
+  pthread_mutex_unlock(&pool.lock);
+  return n;
+}
+
+void
+lzo_pool_set_size(int size)
+{
+  worker_t *workers;
+  int i, n;
+
+  pthread_mutex_lock(&pool.lock);
+  while (pool.stopping || pool.running > 0)
+    pthread_cond_wait(&pool.idle, &pool.lock);
+  pool.size = size > 0 ? size : 0;
+  if (!pool.started) {
+    pthread_mutex_unlock(&pool.lock);
+    return;
+  }
+  pool.stopping = 1;
+  pthread_cond_broadcast(&pool.work);
+  workers = pool.workers;
+  n = pool.n;
+  pthread_mutex_unlock(&pool.lock);
+
+  for (i = 0; i < n; i++) {
+    pthread_join(workers[i].thread, NULL);
+    pthread_mutex_destroy(&workers[i].lock);
+    free(workers[i].q[LZO_POOL_LATENCY].tasks);
+    free(workers[i].q[LZO_POOL_BULK].tasks);
+  }
+  free(workers);
+
+  pthread_mutex_lock(&pool.lock);
+  pool.workers = NULL;
+  pool.n = 0;
+  pool.started = 0;
+  pool.stopping = 0;
+  pthread_cond_broadcast(&pool.idle);
+  pthread_mutex_unlock(&pool.lock);
+}
+
+/* these bracket every small call, pool or not: no pool.lock unless bulk
+   work waits for the last latency work to end */
+void
+lzo_pool_latency_enter(void)
+{
+  __sync_fetch_and_add(&pool.latency, 1);
+}
+
+void
+lzo_pool_latency_leave(void)
+{
+  if (__sync_sub_and_fetch(&pool.latency, 1) == 0 &&
+      *(volatile int *) &pool.queued[LZO_POOL_BULK] > 0) {
+    pthread_mutex_lock(&pool.lock);
+    pthread_cond_broadcast(&pool.work);
+    pthread_mutex_unlock(&pool.lock);
+  }
+}
+
+void
+lzo_pool_set_qos(int on)
+{
+  pthread_mutex_lock(&pool.lock);
+  pool.qos = on;
+  pthread_cond_broadcast(&pool.work);
+  pthread_mutex_unlock(&pool.lock);
+}
+
+void
+lzo_pool_stats(int i, lzo_pool_stats_t *st)
+{
+  memset(st, 0, sizeof(*st));
+  pthread_mutex_lock(&pool.lock);
+  if (pool.started && i >= 0 && i < pool.n) {
+    worker_t *w = &pool.workers[i];
+
+    pthread_mutex_lock(&w->lock);
+    *st = w->st;
+    pthread_mutex_unlock(&w->lock);
+    st->uptime = now() - w->start;
+  }
+  pthread_mutex_unlock(&pool.lock);
+}
+
+#endif
@@ -0,0 +1,63 @@
+/*
+ * Work-stealing thread pool for the bulk operations of the extension.
+ *
+ * One pool per process, started on first use with one worker per CPU in
+ * the affinity mask (or lzo_pool_set_size).  Every worker owns a deque of
+ * tasks: it pops its own newest task and, when out of work, steals the
+ * oldest task of another worker.  A thread waiting in lzo_pool_run works
+ * on tasks too, so a pool of any size never deadlocks.  Nothing here
+ * touches Python, callers release the GIL around lzo_pool_run.
+ *
+ * Work comes in two classes.  Latency tasks are always taken before bulk
+ * ones, and while latency work is in flight (a latency job, or a small
+ * call running in its own thread between lzo_pool_latency_enter and
+ * _leave) workers start fewer bulk tasks, so that latency work finds
+ * idle CPUs.  One bulk task may always run, however much latency work
+ * there is, so bulk work keeps going at one worker's speed at least.
+ * Running tasks are never interrupted, bulk callers keep their tasks
+ * block sized.
+ */
+
+#ifndef LZOPOOL_H
+#define LZOPOOL_H
+
+typedef void (*lzo_pool_fn)(void *ctx, int k);
+
+enum {
+  LZO_POOL_LATENCY,
+  LZO_POOL_BULK,
+  LZO_POOL_CLASSES
+};
+
+typedef struct {
+  unsigned long tasks;          /* tasks run */
+  unsigned long steals;         /* of them taken from another worker */
+  unsigned long latency;        /* of them latency tasks */
+  double busy;                  /* seconds spent running tasks */
+  double uptime;                /* seconds since the worker started */
+} lzo_pool_stats_t;
+
+/* run fn(ctx, k) for k in [0, n) as tasks of class cls on the pool and
+ * wait for all of them.  Returns 0, or -1 if the pool could not be
+ * started; the tasks have then been run by the calling thread */
+int lzo_pool_run(int n, lzo_pool_fn fn, void *ctx, int cls);
+
+/* bracket latency sensitive work done outside the pool */
+void lzo_pool_latency_enter(void);
+void lzo_pool_latency_leave(void);
+
+/* turn holding back bulk work for latency work on (the default) or off */
+void lzo_pool_set_qos(int on);
+
+/* number of workers the pool has or will have once started */
+int lzo_pool_size(void);
+
+/* resize the pool, size <= 0 means one worker per usable CPU.  Waits for
+ * running tasks; the new pool starts on next use */
+void lzo_pool_set_size(int size);
+
+/* counters of worker i < lzo_pool_size(), all zero before the pool
+ * started */
+void lzo_pool_stats(int i, lzo_pool_stats_t *st);
+
+#endif
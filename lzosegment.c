@@ -0,0 +1,153 @@
+/*
+ * Segmented LZO1X compression, see lzosegment.h.
+ */
+
+#include <string.h>
+#include "lzosegment.h"
+
+int
+lzo_segment_compress(lzo_segment_t *s, lzo_voidp wrkmem)
+{
+  s->err = lzo1x_1_compress_segment(s->in, s->in_len, s->out, &s->out_len,
+                                    &s->tail, wrkmem);
+  return s->err;
+}
+
+/* literal run header for t >= 4 literals after a match or at the start */
+static lzo_bytep
+put_run(lzo_bytep op, lzo_uint t)
+{
+  if (t <= 18)
+    *op++ = (unsigned char) (t - 3);
+  else {
+    lzo_uint tt = t - 18;
+
+    *op++ = 0;
+    while (tt > 255) {
+      tt -= 255;
+      *op++ = 0;
+    }
+    *op++ = (unsigned char) tt;
+  }
+  return op;
+}
+
+/* bytes of the header put_run writes for a run of t */
+static lzo_uint
+run_header(lzo_uint t)
+{
+  return t <= 18 ? 1 : 2 + (t - 19) / 255;
+}
+
+/* copy the last t input bytes before segment k, which may be spread over
+   the inputs of several segments */
+static lzo_bytep
+put_pending(lzo_bytep op, const lzo_segment_t *s, int k, lzo_uint t)
+{
+  int j = k - 1;
+  lzo_uint c = t;
+
+  if (t == 0)
+    return op;
+  while (c > s[j].in_len) {
+    c -= s[j].in_len;
+    j--;
+  }
+  /* they start c bytes before the end of segment j */
+  memcpy(op, s[j].in + s[j].in_len - c, c);
+  op += c;
+  for (j++; j < k; j++) {
+    memcpy(op, s[j].in, s[j].in_len);
+    op += s[j].in_len;
+  }
+  return op;
+}
+
+int
+lzo_segment_join(lzo_segment_t *s, int n,
+                 lzo_bytep out, lzo_uintp out_len)
+{
+  lzo_bytep op = out;
+  lzo_bytep op_end = out + *out_len;
+  lzo_uint pos = 0;             /* input bytes before segment k */
+  lzo_uint t = 0;               /* literals before segment k still to emit */
+  int k;
+
+  for (k = 0; k < n; k++) {
+    const lzo_bytep tp = s[k].out;
+    const lzo_bytep tp_end = tp + s[k].out_len;
+    lzo_uint r;
+
+    if (s[k].err != LZO_E_OK)
+      return s[k].err;
+    if (s[k].out_len == 0) {
+      /* no match at all, the whole segment is literals */
+      s[k].c_off = s[k].d_off = LZO_SEGMENT_NO_RESTART;
+      t += s[k].in_len;
+      pos += s[k].in_len;
+      continue;
+    }
+
+    /* the segment opens with a literal run of r >= 4 bytes, which
+       becomes a run of t + r */
+    if (*tp >= 16)
+      return LZO_E_ERROR;
+    if (*tp != 0)
+      r = *tp++ + 3;
+    else {
+      r = 18;
+      while (*++tp == 0)
+        r += 255;
+      r += *tp++;
+    }
+
+    /* the merged run needs a header for t + r, tp is past the one of r */
+    if ((lzo_uint) (op_end - op) < run_header(t + r) + t + (lzo_uint) (tp_end - tp))
+      return LZO_E_OUTPUT_OVERRUN;
+    s[k].c_off = (lzo_uint) (op - out);
+    s[k].d_off = pos - t;
+    op = put_run(op, t + r);
+    op = put_pending(op, s, k, t);
+    memcpy(op, tp, tp_end - tp);
+    op += tp_end - tp;
+    t = s[k].tail;
+    pos += s[k].in_len;
+  }
+
+  /* trailing literals and the end-of-stream marker, as lzo1x_1_compress */
+  if ((lzo_uint) (op_end - op) < run_header(t) + t + 3)
+    return LZO_E_OUTPUT_OVERRUN;
+  if (t > 0) {
+    if (op == out && t <= 238)
+      *op++ = (unsigned char) (17 + t);
+    else if (t <= 3)
+      op[-2] = (unsigned char) (op[-2] | t);
+    else
+      op = put_run(op, t);
+    op = put_pending(op, s, n, t);
+  }
+  *op++ = 16 | 1;               /* M4_MARKER | 1 */
+  *op++ = 0;
+  *op++ = 0;
+
+  *out_len = (lzo_uint) (op - out);
+  return LZO_E_OK;
+}
+
+int
+lzo_segment_decode(const lzo_bytep in, lzo_uint in_len,
+                   lzo_bytep out, lzo_uint out_len, int last)
+{
+  lzo_uint len = out_len;
+  int err;
+
+  /* a piece that stops at a restart point is decoded with the rest of the
+     stream as input, the decoder wants a few bytes of lookahead.  It ends
+     when the literal run at the restart point no longer fits in out */
+  err = lzo1x_decompress_safe(in, in_len, out, &len, NULL);
+  if (!last)
+    err = err == LZO_E_OUTPUT_OVERRUN ? LZO_E_OK : LZO_E_ERROR;
+  if (err == LZO_E_OK && len != out_len)
+    err = LZO_E_ERROR;
+  return err;
+}
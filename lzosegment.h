@@ -0,0 +1,64 @@
+/*
+ * Splitting one LZO1X block into segments that are compressed
+ * independently (e.g. by several threads) and then joined into a single
+ * stream that any LZO1X decoder accepts.
+ *
+ * Matches never cross a segment boundary, so the join only has to deal
+ * with literals: the literals left at the end of a segment are merged into
+ * the literal run that starts the next one.  Segment sizes that are
+ * multiples of LZO_SEGMENT_ALIGN cost no ratio, lzo1x_1_compress restarts
+ * its dictionary at those offsets anyway.  The inputs of the segments
+ * need not be adjacent in memory, so scattered fragments of one logical
+ * input can be compressed in place.
+ *
+ * The merged literal run is also a restart point: decoding can begin
+ * there with a fresh decoder, so a joined stream can be split across
+ * threads again with lzo_segment_decode.  Decoders that don't know the
+ * restart points just see an ordinary stream.
+ */
+
+#ifndef LZOSEGMENT_H
+#define LZOSEGMENT_H
+
+#include "minilzo.h"
+
+#define LZO_SEGMENT_ALIGN   49152
+
+typedef struct {
+  const unsigned char *in;      /* anywhere, need not follow the previous one */
+  lzo_uint in_len;
+  unsigned char *out;           /* lzo_segment_bound(in_len) bytes */
+  lzo_uint out_len;
+  lzo_uint tail;                /* trailing literals not in out */
+  int err;
+  /* set by lzo_segment_join: restart point of this segment in the joined
+     stream and in the uncompressed data, LZO_SEGMENT_NO_RESTART if the
+     segment was all literals and went into the next restart */
+  lzo_uint c_off;
+  lzo_uint d_off;
+} lzo_segment_t;
+
+#define LZO_SEGMENT_NO_RESTART  ((lzo_uint) -1)
+
+#define lzo_segment_bound(n)    ((n) + (n) / 16 + 64 + 3)
+
+/* bound for the joined stream of n segments of in_len bytes in total */
+#define lzo_segment_join_bound(in_len, n) \
+  ((in_len) + (in_len) / 16 + 64 * ((n) + 1) + 3)
+
+/* compress s->in into s->out, sets out_len, tail and err */
+int lzo_segment_compress(lzo_segment_t *s, lzo_voidp wrkmem);
+
+/* join n compressed segments into one stream at out; *out_len is the room
+ * at out on entry and the stream length on return */
+int lzo_segment_join(lzo_segment_t *s, int n,
+                     lzo_bytep out, lzo_uintp out_len);
+
+/* decode the piece of a joined stream that starts at a restart point, in
+ * is the stream from there to its end.  The piece must produce exactly
+ * out_len bytes, last tells whether it runs up to the end-of-stream
+ * marker or stops at the next restart point. */
+int lzo_segment_decode(const lzo_bytep in, lzo_uint in_len,
+                       lzo_bytep out, lzo_uint out_len, int last);
+
+#endif
@@ -0,0 +1,253 @@
+/*
+ * Resumable LZO1X decoder, see lzostream.h.
+ *
+ * The instruction decoding follows lzo1x_decompress_safe in minilzo.c; an
+ * instruction is parsed in one go (the whole compressed stream is in
+ * memory) and only copying its literals and match bytes can pause.
+ */
+
+#include <string.h>
+#include "lzostream.h"
+
+#define WMASK           (LZO_STREAM_WINDOW - 1)
+#define M2_MAX_OFFSET   0x0800
+
+#define NEED_IP(x) \
+  if ((lzo_uint)(s->ip_end - ip) < (lzo_uint)(x)) goto input_overrun
+#define TEST_IV(x) \
+  if ((x) > (lzo_uint)0 - 511) goto input_overrun
+
+#define MIN(a,b)        ((a) < (b) ? (a) : (b))
+
+void
+lzo_stream_reset(lzo_stream_t *s, const lzo_bytep in, lzo_uint in_len,
+                 lzo_uint dst_len)
+{
+  s->ip = in;
+  s->ip_end = in + in_len;
+  s->base = s->pos;
+  s->dst_len = dst_len;
+  s->lit = 0;
+  s->mlen = 0;
+  s->moff = 0;
+  s->state = LZO_STREAM_S_START;
+  s->next = LZO_STREAM_S_LOOP;
+  s->err = LZO_E_OK;
+}
+
+void
+lzo_stream_init(lzo_stream_t *s, const lzo_bytep in, lzo_uint in_len,
+                lzo_uint dst_len)
+{
+  s->pos = 0;
+  lzo_stream_reset(s, in, in_len, dst_len);
+}
+
+/* parse the next instruction into s->lit / s->mlen */
+static int
+parse(lzo_stream_t *s)
+{
+  const unsigned char *ip = s->ip;
+  lzo_uint room = s->dst_len - (s->pos - s->base);
+  lzo_uint t;
+
+  switch (s->state) {
+  case LZO_STREAM_S_START:
+    NEED_IP(1);
+    if (*ip > 17) {
+      t = *ip++ - 17;
+      s->lit = t;
+      s->next = t < 4 ? LZO_STREAM_S_MATCH : LZO_STREAM_S_FIRST_LIT;
+      goto literals;
+    }
+    /* fall through */
+  case LZO_STREAM_S_LOOP:
+    NEED_IP(1);
+    t = *ip++;
+    if (t >= 16)
+      goto match;
+    if (t == 0) {
+      NEED_IP(1);
+      while (*ip == 0) {
+        t += 255;
+        ip++;
+        TEST_IV(t);
+        NEED_IP(1);
+      }
+      t += 15 + *ip++;
+    }
+    s->lit = t + 3;
+    s->next = LZO_STREAM_S_FIRST_LIT;
+    goto literals;
+
+  case LZO_STREAM_S_FIRST_LIT:
+    NEED_IP(1);
+    t = *ip++;
+    if (t >= 16)
+      goto match;
+    NEED_IP(1);
+    s->moff = 1 + M2_MAX_OFFSET + (t >> 2) + ((lzo_uint)*ip++ << 2);
+    s->mlen = 3;
+    goto match_done;
+
+  case LZO_STREAM_S_MATCH:
+    NEED_IP(1);
+    t = *ip++;
+    goto match;
+
+  default:
+    return LZO_E_ERROR;
+  }
+
+match:
+  if (t >= 64) {
+    NEED_IP(1);
+    s->moff = 1 + ((t >> 2) & 7) + ((lzo_uint)*ip++ << 3);
+    s->mlen = (t >> 5) + 1;
+  }
+  else if (t >= 32) {
+    t &= 31;
+    if (t == 0) {
+      NEED_IP(1);
+      while (*ip == 0) {
+        t += 255;
+        ip++;
+        TEST_IV(t);
+        NEED_IP(1);
+      }
+      t += 31 + *ip++;
+    }
+    NEED_IP(2);
+    s->moff = 1 + (ip[0] >> 2) + ((lzo_uint)ip[1] << 6);
+    ip += 2;
+    s->mlen = t + 2;
+  }
+  else if (t >= 16) {
+    lzo_uint off = (t & 8) << 11;
+    t &= 7;
+    if (t == 0) {
+      NEED_IP(1);
+      while (*ip == 0) {
+        t += 255;
+        ip++;
+        TEST_IV(t);
+        NEED_IP(1);
+      }
+      t += 7 + *ip++;
+    }
+    NEED_IP(2);
+    off += (ip[0] >> 2) + ((lzo_uint)ip[1] << 6);
+    ip += 2;
+    if (off == 0) {
+      s->ip = ip;
+      s->state = LZO_STREAM_S_EOF;
+      return ip == s->ip_end ? LZO_E_OK : LZO_E_INPUT_NOT_CONSUMED;
+    }
+    s->moff = off + 0x4000;
+    s->mlen = t + 2;
+  }
+  else {
+    NEED_IP(1);
+    s->moff = 1 + (t >> 2) + ((lzo_uint)*ip++ << 2);
+    s->mlen = 2;
+  }
+
+match_done:
+  if (s->moff > s->pos || s->moff > LZO_STREAM_WINDOW)
+    return LZO_E_LOOKBEHIND_OVERRUN;
+  if (s->mlen > room)
+    return LZO_E_OUTPUT_OVERRUN;
+  room -= s->mlen;
+  s->lit = ip[-2] & 3;
+  s->next = s->lit ? LZO_STREAM_S_MATCH : LZO_STREAM_S_LOOP;
+
+literals:
+  NEED_IP(s->lit);
+  if (s->lit > room)
+    return LZO_E_OUTPUT_OVERRUN;
+  s->ip = ip;
+  s->state = s->next;
+  return LZO_E_OK;
+
+input_overrun:
+  return LZO_E_INPUT_OVERRUN;
+}
+
+static void
+copy_literals(lzo_stream_t *s, lzo_bytep op, lzo_uint n)
+{
+  while (n > 0) {
+    lzo_uint d = s->pos & WMASK;
+    lzo_uint c = MIN(n, LZO_STREAM_WINDOW - d);
+
+    memcpy(s->win + d, s->ip, c);
+    memcpy(op, s->ip, c);
+    s->ip += c;
+    op += c;
+    s->pos += c;
+    n -= c;
+  }
+}
+
+static void
+copy_match(lzo_stream_t *s, lzo_bytep op, lzo_uint n)
+{
+  while (n > 0) {
+    lzo_uint src = (s->pos - s->moff) & WMASK;
+    lzo_uint d = s->pos & WMASK;
+    lzo_uint c = MIN(n, LZO_STREAM_WINDOW - src);
+
+    c = MIN(c, LZO_STREAM_WINDOW - d);
+    if (d > src && d - src < c) {
+      /* overlapping run, must go byte by byte */
+      lzo_uint i;
+      for (i = 0; i < c; i++)
+        s->win[d + i] = s->win[src + i];
+    }
+    else
+      /* the source may also lie just ahead of d, when it wraps the ring */
+      memmove(s->win + d, s->win + src, c);
+    memcpy(op, s->win + d, c);
+    op += c;
+    s->pos += c;
+    n -= c;
+  }
+}
+
+int
+lzo_stream_decode(lzo_stream_t *s, lzo_bytep out, lzo_uintp out_len)
+{
+  lzo_bytep op = out;
+  lzo_uint avail = *out_len;
+  lzo_uint n;
+
+  while (s->err == LZO_E_OK) {
+    if (s->mlen > 0) {
+      n = MIN(s->mlen, avail);
+      if (n == 0)
+        break;
+      copy_match(s, op, n);
+      s->mlen -= n;
+    }
+    else if (s->lit > 0) {
+      n = MIN(s->lit, avail);
+      if (n == 0)
+        break;
+      copy_literals(s, op, n);
+      s->lit -= n;
+    }
+    else if (s->state == LZO_STREAM_S_EOF)
+      break;
+    else {
+      /* parse even when out is full, so that eof shows up as soon as
+         the last byte has been produced */
+      s->err = parse(s);
+      continue;
+    }
+    op += n;
+    avail -= n;
+  }
+
+  *out_len = (lzo_uint)(op - out);
+  return s->err;
+}
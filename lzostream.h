@@ -0,0 +1,58 @@
+/*
+ * Resumable LZO1X decoder.
+ *
+ * Decodes one LZO1X stream into caller supplied buffers of any size,
+ * pausing whenever the buffer is full.  The last LZO_STREAM_WINDOW bytes of
+ * output are kept in a ring, so matches can reach back across pauses and
+ * the decoder never needs the whole uncompressed block in memory.  Input is
+ * checked like lzo1x_decompress_safe.
+ */
+
+#ifndef LZOSTREAM_H
+#define LZOSTREAM_H
+
+#include "minilzo.h"
+
+/* power of two, at least M4_MAX_OFFSET (0xbfff) */
+#define LZO_STREAM_WINDOW   (64*1024l)
+
+typedef struct {
+  const unsigned char *ip;      /* next input byte */
+  const unsigned char *ip_end;
+  lzo_uint pos;                 /* bytes written to the window, ever */
+  lzo_uint base;                /* pos at the start of this stream */
+  lzo_uint dst_len;             /* expected size of this stream */
+  lzo_uint lit;                 /* literals left to copy */
+  lzo_uint mlen;                /* match bytes left to copy */
+  lzo_uint moff;                /* distance of the pending match */
+  int state;
+  int next;                     /* state once lit/mlen are copied */
+  int err;                      /* sticky LZO_E_* */
+  unsigned char win[LZO_STREAM_WINDOW];
+} lzo_stream_t;
+
+/* start decoding in[0..in_len) which should produce dst_len bytes */
+void lzo_stream_init(lzo_stream_t *s, const lzo_bytep in, lzo_uint in_len,
+                     lzo_uint dst_len);
+
+/* like lzo_stream_init, but keep the window of the previous stream so
+ * the new one may reference it */
+void lzo_stream_reset(lzo_stream_t *s, const lzo_bytep in, lzo_uint in_len,
+                      lzo_uint dst_len);
+
+/* decode up to *out_len bytes into out; *out_len is set to the number of
+ * bytes produced.  Returns LZO_E_OK or an error, errors are sticky. */
+int lzo_stream_decode(lzo_stream_t *s, lzo_bytep out, lzo_uintp out_len);
+
+/* true once the end-of-stream marker was consumed */
+#define lzo_stream_eof(s)   ((s)->state == LZO_STREAM_S_EOF)
+
+enum {
+  LZO_STREAM_S_START,
+  LZO_STREAM_S_LOOP,            /* expect literal run or match */
+  LZO_STREAM_S_FIRST_LIT,       /* after a literal run */
+  LZO_STREAM_S_MATCH,           /* after trailing literals, expect match */
+  LZO_STREAM_S_EOF
+};
+
+#endif
@@ -4624,6 +4624,8 @@ int __far __pascal LibMain ( int a, short b, short c, long d )
 #define D_INDEX2(d,p)       d = (d & (D_MASK & 0x7ff)) ^ (D_HIGH | 0x1f)
 #if 1
 #define DINDEX(dv,p)        DM(((DMUL(0x1824429d,dv)) >> (32-D_BITS)))
+/* DINDEX into a dictionary of only 1 << b entries, b <= D_BITS */
+#define DINDEX_B(dv,b)      ((lzo_uint)(((DMUL(0x1824429d,dv)) >> (32-(b))) & LZO_MASK(b)))
 #else
 #define DINDEX(dv,p)        DM((dv) + ((dv) >> (32-D_BITS)))
 #endif
@@ -4913,6 +4915,23 @@ DVAL_ASSERT(lzo_xint dv, const lzo_bytep p)
 
 #define LZO_DETERMINISTIC !(LZO_DICT_USE_PTR)
 
+/* emit the extra length bytes of a long literal run: one zero byte per
+ * 255 and the remainder, returns the new op */
+static __lzo_forceinline lzo_bytep
+put_literal_len(lzo_bytep op, lzo_uint tt)
+{
+    if __lzo_unlikely(tt > 255)
+    {
+        lzo_uint zeros = (tt - 1) / 255;
+        lzo_memset(op, 0, zeros);
+        op += zeros;
+        tt -= zeros * 255;
+    }
+    assert(tt > 0);
+    *op++ = LZO_BYTE(tt);
+    return op;
+}
+
 #ifndef DO_COMPRESS
 #define DO_COMPRESS     lzo1x_1_compress
 #endif
@@ -4921,10 +4940,16 @@ DVAL_ASSERT(lzo_xint dv, const lzo_bytep p)
 #  define do_compress       LZO_PP_ECONCAT2(DO_COMPRESS,_core)
 #endif
 
-static __lzo_noinline lzo_uint
-do_compress ( const lzo_bytep in , lzo_uint  in_len,
-                    lzo_bytep out, lzo_uintp out_len,
-                    lzo_uint  ti,  lzo_voidp wrkmem)
+/* with window set, in[0..start) is history: the output starts at
+ * in + start, may begin with a match into the history and wrkmem holds
+ * the dictionary left by the previous call (see lzo1x_1_compress_window).
+ * The other callers pass constants, which the compiler folds away */
+static __lzo_forceinline lzo_uint
+do_compress_dict ( const lzo_bytep in , lzo_uint  in_len,
+                         lzo_bytep out, lzo_uintp out_len,
+                         lzo_uint  ti,  lzo_voidp wrkmem,
+                         unsigned  dbits,
+                         lzo_uint  start, int window)
 {
     const lzo_bytep ip;
     lzo_bytep op;
@@ -4934,10 +4959,11 @@ do_compress ( const lzo_bytep in , lzo_uint  in_len,
     lzo_dict_p const dict = (lzo_dict_p) wrkmem;
 
     op = out;
-    ip = in;
+    ip = in + start;
     ii = ip;
 
-    ip += ti < 4 ? 4 - ti : 0;
+    if (!window)
+        ip += ti < 4 ? 4 - ti : 0;
     for (;;)
     {
         const lzo_bytep m_pos;
@@ -4989,9 +5015,11 @@ next:
         if __lzo_unlikely(ip >= ip_end)
             break;
         dv = UA_GET_LE32(ip);
-        dindex = DINDEX(dv,ip);
+        dindex = DINDEX_B(dv,dbits);
         GINDEX(m_off,m_pos,in+dict,dindex,in);
         UPDATE_I(dict,0,dindex,ip,in);
+        if (window && (lzo_uint) (pd(ip,m_pos) - 1) >= M4_MAX_OFFSET)
+            goto literal;
         if __lzo_unlikely(dv != UA_GET_LE32(m_pos))
             goto literal;
         }
@@ -5004,7 +5032,10 @@ next:
         {
             if (t <= 3)
             {
-                op[-2] = LZO_BYTE(op[-2] | t);
+                if (window && op == out)
+                    *op++ = LZO_BYTE(17 + t);
+                else
+                    op[-2] = LZO_BYTE(op[-2] | t);
 #if (LZO_OPT_UNALIGNED32)
                 UA_COPY4(op, ii);
                 op += t;
@@ -5027,16 +5058,8 @@ next:
                     *op++ = LZO_BYTE(t - 3);
                 else
                 {
-                    lzo_uint tt = t - 18;
                     *op++ = 0;
-                    while __lzo_unlikely(tt > 255)
-                    {
-                        tt -= 255;
-                        UA_SET1(op, 0);
-                        op++;
-                    }
-                    assert(tt > 0);
-                    *op++ = LZO_BYTE(tt);
+                    op = put_literal_len(op, t - 18);
                 }
 #if (LZO_OPT_UNALIGNED32) || (LZO_OPT_UNALIGNED64)
                 do {
@@ -5208,6 +5231,45 @@ m_len_done:
     return pd(in_end,ii-ti);
 }
 
+/* the full dictionary, dbits is a constant here */
+static __lzo_noinline lzo_uint
+do_compress ( const lzo_bytep in , lzo_uint  in_len,
+                    lzo_bytep out, lzo_uintp out_len,
+                    lzo_uint  ti,  lzo_voidp wrkmem)
+{
+    return do_compress_dict(in,in_len,out,out_len,ti,wrkmem,D_BITS,0,0);
+}
+
+static __lzo_noinline lzo_uint
+do_compress_small ( const lzo_bytep in , lzo_uint  in_len,
+                          lzo_bytep out, lzo_uintp out_len,
+                          lzo_uint  ti,  lzo_voidp wrkmem,
+                          unsigned  dbits)
+{
+    return do_compress_dict(in,in_len,out,out_len,ti,wrkmem,dbits,0,0);
+}
+
+static __lzo_noinline lzo_uint
+do_compress_window ( const lzo_bytep in , lzo_uint  in_len,
+                           lzo_bytep out, lzo_uintp out_len,
+                           lzo_uint  start, lzo_voidp wrkmem)
+{
+    return do_compress_dict(in,in_len,out,out_len,0,wrkmem,D_BITS,start,1);
+}
+
+/* a chunk of len bytes hashes into a dictionary of two entries per byte,
+ * up to the full 1 << D_BITS: short inputs only clear and touch that much
+ * of wrkmem. Chunks over 4 KiB use the full dictionary as before */
+static __lzo_inline unsigned
+dict_bits ( lzo_uint len )
+{
+    unsigned b = 8;
+
+    while (b < D_BITS && ((lzo_uint)1 << b) < 2 * len)
+        b++;
+    return b;
+}
+
 LZO_PUBLIC(int)
 DO_COMPRESS      ( const lzo_bytep in , lzo_uint  in_len,
                          lzo_bytep out, lzo_uintp out_len,
@@ -5217,6 +5279,7 @@ DO_COMPRESS      ( const lzo_bytep in , lzo_uint  in_len,
     lzo_bytep op = out;
     lzo_uint l = in_len;
     lzo_uint t = 0;
+    unsigned dbits;
 
     while (l > 20)
     {
@@ -5228,10 +5291,14 @@ DO_COMPRESS      ( const lzo_bytep in , lzo_uint  in_len,
         ll_end = (lzo_uintptr_t)ip + ll;
         if ((ll_end + ((t + ll) >> 5)) <= ll_end || (const lzo_bytep)(ll_end + ((t + ll) >> 5)) <= ip + ll)
             break;
+        dbits = dict_bits(ll);
 #if (LZO_DETERMINISTIC)
-        lzo_memset(wrkmem, 0, ((lzo_uint)1 << D_BITS) * sizeof(lzo_dict_t));
+        lzo_memset(wrkmem, 0, ((lzo_uint)1 << dbits) * sizeof(lzo_dict_t));
 #endif
-        t = do_compress(ip,ll,op,out_len,t,wrkmem);
+        if (dbits < D_BITS)
+            t = do_compress_small(ip,ll,op,out_len,t,wrkmem,dbits);
+        else
+            t = do_compress(ip,ll,op,out_len,t,wrkmem);
         ip += ll;
         op += *out_len;
         l  -= ll;
@@ -5250,17 +5317,102 @@ DO_COMPRESS      ( const lzo_bytep in , lzo_uint  in_len,
             *op++ = LZO_BYTE(t - 3);
         else
         {
-            lzo_uint tt = t - 18;
+            *op++ = 0;
+            op = put_literal_len(op, t - 18);
+        }
+        UA_COPYN(op, ii, t);
+        op += t;
+    }
+
+    *op++ = M4_MARKER | 1;
+    *op++ = 0;
+    *op++ = 0;
+
+    *out_len = pd(op, out);
+    return LZO_E_OK;
+}
+
+/* lzo1x_1_compress without the trailing literals and the end-of-stream
+ * marker: the last *tail bytes of in are left for the caller to emit.
+ * The output starts with a literal run of at least 4 bytes (or is empty)
+ * and ends with a match, so segments compressed independently can be
+ * joined into one stream. */
+LZO_PUBLIC(int)
+lzo1x_1_compress_segment ( const lzo_bytep in , lzo_uint  in_len,
+                                 lzo_bytep out, lzo_uintp out_len,
+                                 lzo_uintp tail, lzo_voidp wrkmem )
+{
+    const lzo_bytep ip = in;
+    lzo_bytep op = out;
+    lzo_uint l = in_len;
+    lzo_uint t = 0;
+    unsigned dbits;
 
+    while (l > 20)
+    {
+        lzo_uint ll = l;
+        lzo_uintptr_t ll_end;
+#if 0 || (LZO_DETERMINISTIC)
+        ll = LZO_MIN(ll, 49152);
+#endif
+        ll_end = (lzo_uintptr_t)ip + ll;
+        if ((ll_end + ((t + ll) >> 5)) <= ll_end || (const lzo_bytep)(ll_end + ((t + ll) >> 5)) <= ip + ll)
+            break;
+        dbits = dict_bits(ll);
+#if (LZO_DETERMINISTIC)
+        lzo_memset(wrkmem, 0, ((lzo_uint)1 << dbits) * sizeof(lzo_dict_t));
+#endif
+        if (dbits < D_BITS)
+            t = do_compress_small(ip,ll,op,out_len,t,wrkmem,dbits);
+        else
+            t = do_compress(ip,ll,op,out_len,t,wrkmem);
+        ip += ll;
+        op += *out_len;
+        l  -= ll;
+    }
+
+    *tail = t + l;
+    *out_len = pd(op, out);
+    return LZO_E_OK;
+}
+
+/* lzo1x_1_compress of in[start..in_len) alone, with in[0..start) as
+ * history the matches may reach back into by up to M4_MAX_OFFSET bytes:
+ * the output decodes on a window that already holds the history (see
+ * lzo_stream_reset). wrkmem is not cleared, it has to hold zeros or the
+ * dictionary of the previous call on the same buffer, after
+ * lzo1x_1_window_shift if the buffer moved. in_len is at most 65536 */
+LZO_PUBLIC(int)
+lzo1x_1_compress_window ( const lzo_bytep in , lzo_uint  in_len,
+                                lzo_uint  start,
+                                lzo_bytep out, lzo_uintp out_len,
+                                lzo_voidp wrkmem )
+{
+    lzo_bytep op = out;
+    lzo_uint t = in_len - start;
+
+    if (start > in_len || in_len > 0x10000)
+        return LZO_E_ERROR;
+    if (t > 20)
+    {
+        t = do_compress_window(in,in_len,op,out_len,start,wrkmem);
+        op += *out_len;
+    }
+
+    if (t > 0)
+    {
+        const lzo_bytep ii = in + in_len - t;
+
+        if (op == out && t <= 238)
+            *op++ = LZO_BYTE(17 + t);
+        else if (t <= 3)
+            op[-2] = LZO_BYTE(op[-2] | t);
+        else if (t <= 18)
+            *op++ = LZO_BYTE(t - 3);
+        else
+        {
             *op++ = 0;
-            while (tt > 255)
-            {
-                tt -= 255;
-                UA_SET1(op, 0);
-                op++;
-            }
-            assert(tt > 0);
-            *op++ = LZO_BYTE(tt);
+            op = put_literal_len(op, t - 18);
         }
         UA_COPYN(op, ii, t);
         op += t;
@@ -5274,6 +5426,34 @@ DO_COMPRESS      ( const lzo_bytep in , lzo_uint  in_len,
     return LZO_E_OK;
 }
 
+/* the first shift bytes of the buffer of lzo1x_1_compress_window were
+ * dropped: move the dictionary along, entries that fell off point to the
+ * start, where they are too far back to be used */
+LZO_PUBLIC(void)
+lzo1x_1_window_shift ( lzo_voidp wrkmem, lzo_uint shift )
+{
+    lzo_dict_p const dict = (lzo_dict_p) wrkmem;
+    lzo_uint i;
+
+    for (i = 0; i < D_SIZE; i++)
+        dict[i] = (lzo_dict_t) (dict[i] >= shift ? dict[i] - shift : 0);
+}
+
+/* enter every position of in[0..in_len), the start of the buffer of
+ * lzo1x_1_compress_window, into the dictionary, so that data put there
+ * without compressing it is history the next call can match */
+LZO_PUBLIC(void)
+lzo1x_1_window_fill ( const lzo_bytep in, lzo_uint in_len, lzo_voidp wrkmem )
+{
+    lzo_dict_p const dict = (lzo_dict_p) wrkmem;
+    const lzo_bytep ip;
+
+    if (in_len < 4 || in_len > 0x10000)
+        return;
+    for (ip = in; ip <= in + in_len - 4; ip++)
+        UPDATE_I(dict,0,DINDEX_B(UA_GET_LE32(ip),D_BITS),ip,in);
+}
+
 #endif
 
 #undef do_compress
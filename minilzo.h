@@ -83,6 +83,26 @@ lzo1x_1_compress        ( const lzo_bytep src, lzo_uint  src_len,
                                 lzo_bytep dst, lzo_uintp dst_len,
                                 lzo_voidp wrkmem );
 
+/* compression of one segment of a larger block, see minilzo.c */
+LZO_EXTERN(int)
+lzo1x_1_compress_segment ( const lzo_bytep src, lzo_uint  src_len,
+                                 lzo_bytep dst, lzo_uintp dst_len,
+                                 lzo_uintp tail, lzo_voidp wrkmem );
+
+/* compression with the preceding bytes as history, see minilzo.c */
+LZO_EXTERN(int)
+lzo1x_1_compress_window ( const lzo_bytep src, lzo_uint  src_len,
+                                lzo_uint  start,
+                                lzo_bytep dst, lzo_uintp dst_len,
+                                lzo_voidp wrkmem );
+
+LZO_EXTERN(void)
+lzo1x_1_window_shift    ( lzo_voidp wrkmem, lzo_uint shift );
+
+LZO_EXTERN(void)
+lzo1x_1_window_fill     ( const lzo_bytep src, lzo_uint  src_len,
+                                lzo_voidp wrkmem );
+
 /* decompression */
 LZO_EXTERN(int)
 lzo1x_decompress        ( const lzo_bytep src, lzo_uint  src_len,
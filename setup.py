@@ -1,3 +1,4 @@
+import sys
 from setuptools import setup, Extension
 
 include_dirs = []
@@ -9,9 +10,19 @@ extra_objects = []
 extra_compile_args = []
 extra_link_args = []
 
+if sys.platform != 'win32':
+    # lzopool.c
+    libraries.append('pthread')
+
+if sys.platform.startswith('linux'):
+    # lzocache.c, shm_open is in librt before glibc 2.34
+    libraries.append('rt')
+
 ext = Extension(
     name="_lzo",
-    sources=["lzomodule.c", "minilzo.c"],
+    sources=["lzomodule.c", "minilzo.c", "lzostream.c", "lzosegment.c", "lzopool.c",
+             "lzoctx.c", "lzoinplace.c", "lzoopt.c", "lzoaio.c", "lzomap.c",
+             "lzocache.c"],
     include_dirs=include_dirs,
     define_macros=define_macros,
     library_dirs=library_dirs,